@@ -0,0 +1,159 @@
+--[[
+Copyright (c) Jason White. MIT license.
+
+Description:
+Generates synthetic source trees to benchmark against. This is run with plain
+Lua:
+
+    lua gentree.lua wide <dir> <files>
+        A single directory with the given number of files.
+
+    lua gentree.lua deep <dir> <depth>
+        Directories nested the given number of levels deep, with a few files at
+        every level.
+
+    lua gentree.lua mono <dir> <files> <targets>
+        A monorepo with the given total number of files split up evenly among
+        packages. Every package has a BUILD.lua with a C and a D library, so
+        there are about as many packages as half the number of targets. The
+        top-level BUILD.lua imports every package.
+]]
+
+local mode, root = arg[1], arg[2]
+
+if not mode or not root then
+    io.stderr:write("Usage: lua gentree.lua wide|deep|mono <dir> <args...>\n")
+    os.exit(1)
+end
+
+-- Number of files in each directory of a package.
+local files_per_dir = 100
+
+--[[
+    Creates directories in batches. Plain Lua has no way to do this itself.
+]]
+local pending = {}
+
+local function flush_dirs()
+    if #pending == 0 then return end
+
+    local ok = os.execute("mkdir -p " .. table.concat(pending, " "))
+    assert(ok, "failed to create directories")
+
+    pending = {}
+end
+
+local function mkdir(dir)
+    table.insert(pending, "'" .. dir .. "'")
+
+    if #pending >= 256 then
+        flush_dirs()
+    end
+end
+
+local function touch(file, contents)
+    local f = assert(io.open(file, "w"))
+    if contents then f:write(contents) end
+    f:close()
+end
+
+-- Alternates between the kinds of files found in a typical tree.
+local exts = {".c", ".h", ".d", ".c", ".txt"}
+
+local function ext(i)
+    return exts[(i - 1) % #exts + 1]
+end
+
+local function wide(files)
+    mkdir(root)
+    flush_dirs()
+
+    for i = 1, files do
+        touch(string.format("%s/file%d%s", root, i, ext(i)))
+    end
+end
+
+local function deep(depth)
+    local dirs = {}
+
+    local dir = root
+    for level = 1, depth do
+        dir = dir .. "/d" .. level
+        mkdir(dir)
+        table.insert(dirs, dir)
+    end
+
+    flush_dirs()
+
+    for level, dir in ipairs(dirs) do
+        for i = 1, 5 do
+            touch(string.format("%s/file%d%s", dir, i, ext(i + level)))
+        end
+    end
+end
+
+local package_template = [[
+local cc = require "rules.cc"
+local d = require "rules.d"
+
+cc.library {
+    name = "%s_c",
+    static = true,
+    srcs = glob "**/*.c",
+    compiler_opts = {"-O2", "-Wall"},
+}
+
+d.library {
+    name = "%s_d",
+    srcs = glob "**/*.d",
+    combined = false,
+}
+]]
+
+local function mono(files, targets)
+    local packages = math.max(1, math.ceil(targets / 2))
+    local per_package = math.ceil(files / packages)
+    local subdirs = math.max(1, math.ceil(per_package / files_per_dir))
+
+    mkdir(root)
+
+    for p = 1, packages do
+        for s = 1, subdirs do
+            mkdir(string.format("%s/pkg%d/src%d", root, p, s))
+        end
+    end
+
+    flush_dirs()
+
+    local top = {}
+
+    local left = files
+    for p = 1, packages do
+        local name = "pkg" .. p
+        local dir = root .. "/" .. name
+
+        touch(dir .. "/BUILD.lua", string.format(package_template, name, name))
+        table.insert(top, string.format("import %q\n", name .. "/BUILD.lua"))
+
+        local n = math.min(per_package, left)
+        left = left - n
+
+        for i = 1, n do
+            local s = (i - 1) % subdirs + 1
+            touch(string.format("%s/src%d/file%d%s", dir, s, i, ext(i)))
+        end
+    end
+
+    touch(root .. "/BUILD.lua", table.concat(top))
+end
+
+if mode == "wide" then
+    wide(tonumber(arg[3]))
+elseif mode == "deep" then
+    deep(tonumber(arg[3]))
+elseif mode == "mono" then
+    mono(tonumber(arg[3]), tonumber(arg[4]))
+else
+    io.stderr:write("Unknown tree '".. mode .."'\n")
+    os.exit(1)
+end
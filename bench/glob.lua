@@ -0,0 +1,16 @@
+--[[
+Copyright (c) Jason White. MIT license.
+
+Description:
+Globs each of the patterns given on the command line. This is run by
+button-lua with --profile so that the time spent in glob() can be seen:
+
+    button-lua glob.lua -o /dev/null --profile <trace> <patterns...>
+]]
+
+-- The patterns are relative to the working directory.
+SCRIPT_DIR = nil
+
+for _, pattern in ipairs({...}) do
+    glob(pattern)
+end
@@ -0,0 +1,88 @@
+--[[
+Copyright (c) Jason White. MIT license.
+
+Description:
+Times individual operations in a tight loop. This is run by button-lua:
+
+    button-lua micro.lua -o /dev/null <iterations> > results.json
+
+The time per call of each operation, in nanoseconds of CPU time, is printed to
+stdout as a JSON object. Scripts can only open files for reading, so it is up
+to the caller to put it somewhere.
+]]
+
+local iterations = ...
+iterations = tonumber(iterations) or 100000
+
+local timings = {}
+
+local function bench(name, f)
+    local start = os.clock()
+    f(iterations)
+    local elapsed = os.clock() - start
+
+    table.insert(timings, string.format("%q:%.1f", name,
+        elapsed * 1e9 / iterations))
+end
+
+local paths = {
+    "foo/bar/baz.c",
+    "./foo//bar/../baz/qux.h",
+    "/usr/include/../lib/./gcc/x86_64/crt1.o",
+    "a/b/c/d/e/f/g/h/i/j/k/l/m/n/o/p.d",
+}
+
+bench("path.norm", function(n)
+    local norm = path.norm
+    for i = 1, n do
+        norm(paths[i % #paths + 1])
+    end
+end)
+
+local patterns = {
+    {"foo/bar/baz.c", "foo/*/*.c"},
+    {"src/a/b/c/d.cc", "src/**/*.cc"},
+    {"include/x.h", "*/[abx].[ch]"},
+    {"a/b/c/d/e/f/g/h/i/j/k/l/m/n/o/p.d", "**/p.d"},
+}
+
+bench("path.matches", function(n)
+    local matches = path.matches
+    for i = 1, n do
+        local p = patterns[i % #patterns + 1]
+        matches(p[1], p[2])
+    end
+end)
+
+bench("path.join", function(n)
+    local join = path.join
+    for i = 1, n do
+        join("foo/bar", paths[i % #paths + 1])
+    end
+end)
+
+bench("rule", function(n)
+    for i = 1, n do
+        rule {
+            inputs = {"src/file" .. i .. ".c", "include/common.h"},
+            task = {{"gcc", "-c", "src/file" .. i .. ".c", "-o",
+                     "obj/file" .. i .. ".o"}},
+            outputs = {"obj/file" .. i .. ".o"},
+        }
+    end
+end)
+
+bench("rule_template", function(n)
+    local t = rule_template {
+        inputs = {"include/common.h"},
+        command = {"gcc", "-O2", "-Wall"},
+        args = {"-c", "$in", "-o", "$out"},
+        display = "cc ",
+    }
+
+    for i = 1, n do
+        t:add("src/file" .. i .. ".c", "obj/file" .. i .. ".o")
+    end
+end)
+
+io.write("{", table.concat(timings, ","), "}\n")
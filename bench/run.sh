@@ -0,0 +1,124 @@
+#!/bin/bash -e
+# Copyright (c) 2016 Jason White
+# MIT License
+#
+# Description:
+# Runs the benchmarks and appends the results to a file, one JSON object per
+# line, so that runs can be compared across commits.
+#
+# Usage: bench/run.sh [results]
+#
+# The synthetic trees are generated once and kept in $BENCH_DIR. Their sizes
+# can be changed with these environment variables (delete $BENCH_DIR
+# afterwards):
+#
+#   BENCH_WIDE_FILES   Files in the wide, flat directory.  (default: 100000)
+#   BENCH_DEEP_DEPTH   Levels of the deeply nested tree.    (default: 200)
+#   BENCH_MONO_FILES   Files in the monorepo.               (default: 1000000)
+#   BENCH_MONO_TARGETS Targets in the monorepo.             (default: 2000)
+#   BENCH_ITERATIONS   Iterations of each micro benchmark.  (default: 1000000)
+
+bench=$(cd "$(dirname "$0")" && pwd)
+repo=$(dirname "$bench")
+
+results=$(realpath -m -- "${1:-$bench/results.jsonl}")
+
+BENCH_DIR=${BENCH_DIR:-$bench/work}
+BENCH_WIDE_FILES=${BENCH_WIDE_FILES:-100000}
+BENCH_DEEP_DEPTH=${BENCH_DEEP_DEPTH:-200}
+BENCH_MONO_FILES=${BENCH_MONO_FILES:-1000000}
+BENCH_MONO_TARGETS=${BENCH_MONO_TARGETS:-2000}
+BENCH_ITERATIONS=${BENCH_ITERATIONS:-1000000}
+
+if [[ ! -x "$repo/button-lua" ]]; then
+    echo "Error: Could not find $repo/button-lua"
+    exit 1
+fi
+
+export PATH=$repo:$PATH
+
+commit=$(git -C "$repo" rev-parse --short HEAD 2>/dev/null || echo unknown)
+date=$(date -u +%Y-%m-%dT%H:%M:%SZ)
+
+tempdir=$(mktemp -d)
+
+teardown() {
+    rm -rf -- "$tempdir"
+}
+
+# Cleanup on exit
+trap teardown 0
+
+# Generates a tree unless it is already there.
+gentree() {
+    local name=$1
+    shift
+
+    if [[ ! -f "$BENCH_DIR/$name.done" ]]; then
+        echo ":: Generating '$name'..."
+        rm -rf -- "$BENCH_DIR/$name"
+        mkdir -p -- "$BENCH_DIR"
+        lua "$bench/gentree.lua" "$1" "$BENCH_DIR/$name" "${@:2}"
+        touch -- "$BENCH_DIR/$name.done"
+    fi
+}
+
+# Writes out a result. The extra fields must already be JSON.
+result() {
+    local name=$1 seconds=$2 extra=$3
+    printf '{"commit":"%s","date":"%s","case":"%s","seconds":%s%s}\n' \
+        "$commit" "$date" "$name" "$seconds" "${extra:+,$extra}" >> "$results"
+    printf '   %-24s %8.3f s\n' "$name" "$seconds"
+}
+
+# Runs button-lua on a script with profiling and records the result. The
+# profile's totals are kept along with the wall time. The options must come
+# right after the script, before any of the script's own arguments.
+run() {
+    local name=$1
+    shift
+
+    local trace="$tempdir/$name.json"
+
+    local TIMEFORMAT=%R
+    local seconds
+    seconds=$( { time button-lua "$1" --profile "$trace" "${@:2}" \
+        > /dev/null 2> "$tempdir/$name.log" ; } 2>&1 )
+
+    local profile
+    profile=$(sed -n 's/^"otherData":\(.*\)}$/\1/p' "$trace")
+
+    result "$name" "$seconds" "\"profile\":$profile"
+}
+
+gentree wide wide "$BENCH_WIDE_FILES"
+gentree deep deep "$BENCH_DEEP_DEPTH"
+gentree mono mono "$BENCH_MONO_FILES" "$BENCH_MONO_TARGETS"
+
+echo ":: Running benchmarks for $commit..."
+
+cd -- "$BENCH_DIR"
+
+run glob-wide "$bench/glob.lua" -o /dev/null "wide/*.c"
+run glob-deep "$bench/glob.lua" -o /dev/null "deep/**/*.c"
+run glob-mono "$bench/glob.lua" -o /dev/null "mono/**/*.c" "mono/**/*.d"
+run glob-mono-excludes "$bench/glob.lua" -o /dev/null \
+    "mono/**/*.c" "!mono/**/file1*.c"
+
+cd -- "$BENCH_DIR/mono"
+
+run generate-json BUILD.lua -o /dev/null
+run generate-binary BUILD.lua -o /dev/null -f binary
+run generate-parallel BUILD.lua -o /dev/null --parallel
+run generate-parallel-rules BUILD.lua -o /dev/null --parallel --parallel-rules
+
+cd -- "$tempdir"
+
+# The time per call is more useful here than the total. Scripts can't write
+# files, so the timings come out on stdout.
+TIMEFORMAT=%R
+seconds=$( { time button-lua "$bench/micro.lua" -o /dev/null \
+    "$BENCH_ITERATIONS" > "$tempdir/micro.json" ; } 2>&1 )
+result micro "$seconds" "\"ns_per_call\":$(cat "$tempdir/micro.json")"
+
+echo ":: Results appended to $results"
@@ -38,46 +38,9 @@ io.open = function(filename, mode)
 end
 
 --[[
-    Wrap dofile to provide dependency information to the host build system.
+    Note that loadfile, dofile, and package.searchers[2] are implemented in C++
+    and provide dependency information to the host build system themselves.
 ]]
-local _loadfile = loadfile
-function loadfile(...)
-    local filename = ...
-    if filename ~= nil then
-        publish_input(filename)
-    end
-
-    _loadfile(...)
-end
-
---[[
-    Wrap dofile to provide dependency information to the host build system.
-]]
-local _dofile = dofile
-function dofile(...)
-    local filename = ...
-    if filename ~= nil then
-        publish_input(filename)
-    end
-
-    _dofile(...)
-end
-
---[[
-    Wrap package.searchers[2] to provide dependency information to the host build
-    system.
-]]
-local _searcher = package.searchers[2]
-package.searchers[2] = function(module)
-    local loader, fname = _searcher(module)
-
-    if type(loader) == "function" then
-        publish_input(fname)
-        return loader, fname
-    end
-
-    return loader
-end
 
 --[[
     Import the rules from another build script.
@@ -184,50 +147,7 @@ function table.print(t, name, indent)
     print(table.show(t, name, indent))
 end
 
-function table.append(t, ...)
-    for _,i in ipairs({...}) do
-        if type(i) == "table" then
-            for _,j in ipairs(i) do
-                table.insert(t, j)
-            end
-        else
-            table.insert(t, i)
-        end
-    end
-
-    return t
-end
-
-function table.join(...)
-    local t = {}
-    return table.append(t, ...)
-end
-
---[[
-Checks if the given table contains the given value. Returns true if the value is
-in the table, false otherwise.
-]]
-function table.contains(t, value)
-    for _,v in ipairs(t) do
-        if v == value then
-            return true
-        end
-    end
-
-    return false
-end
-
 --[[
-Returns a new table with only the items that the predicate returns true for.
+table.append, table.join, table.contains, table.filter, and table.set are
+implemented natively. See src/lua_table.cc.
 ]]
-function table.filter(t, pred)
-    local filtered = {}
-
-    for _,v in ipairs(t) do
-        if pred(v) then
-            table.insert(filtered, v)
-        end
-    end
-
-    return filtered
-end
@@ -53,11 +53,23 @@ local function add(target)
     return target
 end
 
+--[[
+    Returns the list of targets added so far. Targets of scripts imported in
+    parallel are merged into this list.
+]]
+local function list()
+    return targets
+end
+
 --[[
     Resolve dependencies. For all targets, the .rules method is called with the
     set of dependencies.
+
+    If a generate function is given, the .rules methods are not called here.
+    Instead, the list of targets is handed to it once all dependencies are
+    resolved.
 ]]
-local function resolve()
+local function resolve(generate)
 
     local index = {}
 
@@ -78,7 +90,13 @@ local function resolve()
         -- Replace string dependencies with resolved dependencies.
         v.deps = deps
 
-        v:rules()
+        if not generate then
+            v:rules()
+        end
+    end
+
+    if generate then
+        generate(targets)
     end
 end
 
@@ -86,4 +104,5 @@ return {
     common = common,
     add = add,
     resolve = resolve,
+    targets = list,
 }
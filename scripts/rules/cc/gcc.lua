@@ -10,15 +10,15 @@ local rules = require "rules"
 --[[
     Helper functions.
 ]]
-local cc_srcs = {".cc", ".cpp", ".cxx", ".c++.C"}
-local cc_hdrs = {".h", ".hh", ".hpp", ".hxx", ".inc"}
+local cc_srcs = table.set {".cc", ".cpp", ".cxx", ".c++.C"}
+local cc_hdrs = table.set {".h", ".hh", ".hpp", ".hxx", ".inc"}
 
 local function is_c_source(ext)
     return ext == ".c"
 end
 
 local function is_cpp_source(ext)
-    return table.contains(cc_srcs, ext)
+    return cc_srcs[ext] ~= nil
 end
 
 local function is_source(f)
@@ -37,27 +37,19 @@ local function has_cpp_source(srcs)
 end
 
 local function is_header(f)
-    return table.contains(cc_hdrs, path.getext(f))
-end
-
-local function to_object(objdir, src)
-    return path.norm(path.join(objdir, src .. ".o"))
+    return cc_hdrs[path.getext(f)] ~= nil
 end
 
 --[[
     Returns a list of filtered C/C++ sources and their corresponding objects.
 ]]
 local function get_sources_and_objects(srcs, objdir)
-    local sources = {}
-    local objects = {}
-    for _,v in ipairs(srcs) do
-        if is_source(v) then
-            table.insert(sources, path.norm(v))
-            table.insert(objects, to_object(objdir, v))
-        end
+    local sources = table.filter(srcs, is_source)
+    for i,v in ipairs(sources) do
+        sources[i] = path.norm(v)
     end
 
-    return sources, objects
+    return sources, path.joinnorm(objdir, sources, ".o")
 end
 
 --[[
@@ -75,9 +67,8 @@ local function compile(self)
         table.insert(compiler_opts, "-W".. v)
     end
 
-    for _,v in ipairs(self.includes) do
-        table.insert(compiler_opts,
-            "-I".. path.norm(path.join(self.scriptdir, v)))
+    for _,v in ipairs(path.joinnorm(self.scriptdir, self.includes)) do
+        table.insert(compiler_opts, "-I".. v)
     end
 
     for _,v in ipairs(self.defines) do
@@ -86,32 +77,28 @@ local function compile(self)
 
     table.append(compiler_opts, self.compiler_opts)
 
-    local headers = table.filter(self.srcs, is_header)
-    for i,v in ipairs(headers) do
-        headers[i] = path.norm(path.join(self.scriptdir, v))
-    end
+    local headers = path.joinnorm(self.scriptdir,
+        table.filter(self.srcs, is_header))
 
     local sources, objects = get_sources_and_objects(
         self.srcs,
         path.join(self.scriptdir, objdir)
         )
 
-    for i,src in ipairs(sources) do
-
-        local deps = {}
-        for _,v in ipairs(self.src_deps[src] or {}) do
-            table.insert(deps, path.norm(path.join(self.scriptdir, v)))
-        end
+    -- Everything but the source, object, and extra dependencies is the same
+    -- for each source.
+    local t = rule_template {
+        inputs  = headers,
+        command = table.join(args, compiler_opts),
+        args    = {"-c", "$in", "-o", "$out"},
+        display = "cc ",
+    }
 
-        local src = path.norm(path.join(self.scriptdir, src))
-        local obj = objects[i]
+    local paths = path.joinnorm(self.scriptdir, sources)
 
-        rule {
-            inputs  = table.join(headers, {src}, deps),
-            task    = {table.join(args, compiler_opts, {"-c", src, "-o", obj})},
-            outputs = {obj},
-            display = "cc ".. src,
-        }
+    for i,src in ipairs(sources) do
+        local deps = path.joinnorm(self.scriptdir, self.src_deps[src] or {})
+        t:add(paths[i], objects[i], deps)
     end
 
     return objects
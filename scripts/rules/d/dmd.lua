@@ -18,10 +18,6 @@ local function is_d_source(src)
     return path.getext(src) == ".d"
 end
 
-local function to_object(objdir, src)
-    return path.norm(path.setext(path.join(objdir, src), ".o"))
-end
-
 --[[
     Filters for D source files.
 ]]
@@ -39,13 +35,7 @@ end
     Returns a list of objects corresponding to the given list of sources.
 ]]
 local function objects(srcs, objdir)
-    local objs = {}
-
-    for _,v in ipairs(srcs) do
-        table.insert(objs, to_object(objdir, v))
-    end
-
-    return objs
+    return path.joinnorm(objdir, path.setexts(srcs, ".o"))
 end
 
 --[[
@@ -144,14 +134,12 @@ function common:rules()
 
     local compiler_opts = {"-op", "-od".. objdir}
 
-    for _,v in ipairs(self.imports) do
-        table.insert(compiler_opts,
-            "-I" .. path.norm(path.join(self.scriptdir, v)))
+    for _,v in ipairs(path.joinnorm(self.scriptdir, self.imports)) do
+        table.insert(compiler_opts, "-I" .. v)
     end
 
-    for _,v in ipairs(self.string_imports) do
-        table.insert(compiler_opts,
-            "-J" .. path.norm(path.join(self.scriptdir, v)))
+    for _,v in ipairs(path.joinnorm(self.scriptdir, self.string_imports)) do
+        table.insert(compiler_opts, "-J" .. v)
     end
 
     for _,v in ipairs(self.versions) do
@@ -184,14 +172,13 @@ function common:rules()
 
     if self.combined then
         local deps = {}
-        for i,src in ipairs(srcs) do
-            for _,dep in ipairs(self.src_deps[src] or {}) do
-                table.insert(deps, path.norm(path.join(self.scriptdir, dep)))
-            end
-
-            srcs[i] = path.norm(path.join(self.scriptdir, src))
+        for _,src in ipairs(srcs) do
+            table.append(deps,
+                path.joinnorm(self.scriptdir, self.src_deps[src] or {}))
         end
 
+        srcs = path.joinnorm(self.scriptdir, srcs)
+
         -- Combined compilation
         rule {
             inputs  = table.join(srcs, libs, deps),
@@ -201,23 +188,17 @@ function common:rules()
         }
     else
         -- Individual compilation
-        for i,src in ipairs(srcs) do
+        local t = rule_template {
+            command = table.join(args, compiler_opts),
+            args    = {"-c", "$in", "-of$out"},
+            display = "dmd ",
+        }
+
+        local paths = path.joinnorm(self.scriptdir, srcs)
 
-            local deps = {}
-            for _,v in ipairs(self.src_deps[src] or {}) do
-                table.insert(deps, path.norm(path.join(self.scriptdir, v)))
-            end
-
-            local src = path.norm(path.join(self.scriptdir, src))
-            local obj = objs[i]
-
-            rule {
-                inputs  = table.join({src}, deps),
-                task    = {table.join(args, compiler_opts,
-                    {"-c", src, "-of".. obj})},
-                outputs = {obj},
-                display = "dmd ".. src,
-            }
+        for i,src in ipairs(srcs) do
+            local deps = path.joinnorm(self.scriptdir, self.src_deps[src] or {})
+            t:add(paths[i], objs[i], deps)
         end
 
         rule {
@@ -7,4 +7,5 @@ This file is the last Lua script that gets executed.
 
 local rules = require "rules"
 
-rules.resolve()
+-- This is only set if rules are to be generated in parallel.
+rules.resolve(__GENERATE_RULES)
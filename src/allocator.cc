@@ -0,0 +1,183 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Memory allocator for Lua states.
+ */
+#ifdef _WIN32
+#   include <windows.h>
+#   include <psapi.h>
+#   pragma comment(lib, "psapi.lib")
+#else
+#   include <sys/resource.h>
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+
+namespace {
+
+// Room at the start of each chunk for the link to the next one. This keeps
+// the blocks after it aligned.
+const size_t chunkHeader = 16;
+
+inline size_t sizeClass(size_t size) {
+    return (size - 1) / LuaAllocator::granularity;
+}
+
+inline size_t classSize(size_t c) {
+    return (c + 1) * LuaAllocator::granularity;
+}
+
+}
+
+LuaAllocator::LuaAllocator(bool neverFree)
+    : _neverFree(neverFree), _free(), _next(NULL), _end(NULL), _chunks(NULL),
+      _used(0), _peak(0) {
+}
+
+LuaAllocator::~LuaAllocator() {
+    while (_chunks) {
+        void* next = *(void**)_chunks;
+        free(_chunks);
+        _chunks = next;
+    }
+}
+
+bool LuaAllocator::newChunk() {
+    char* chunk = (char*)malloc(chunkSize);
+    if (!chunk) return false;
+
+    *(void**)chunk = _chunks;
+    _chunks = chunk;
+
+    // Whatever was left of the last chunk is too small to bother with.
+    _next = chunk + chunkHeader;
+    _end = chunk + chunkSize;
+    return true;
+}
+
+void* LuaAllocator::allocSmall(size_t size) {
+    const size_t c = sizeClass(size);
+
+    if (FreeBlock* block = _free[c]) {
+        _free[c] = block->next;
+        return block;
+    }
+
+    const size_t n = classSize(c);
+
+    if ((size_t)(_end - _next) < n && !newChunk())
+        return NULL;
+
+    void* block = _next;
+    _next += n;
+    return block;
+}
+
+void LuaAllocator::freeSmall(void* ptr, size_t size) {
+    if (_neverFree) return;
+
+    const size_t c = sizeClass(size);
+
+    FreeBlock* block = (FreeBlock*)ptr;
+    block->next = _free[c];
+    _free[c] = block;
+}
+
+void* LuaAllocator::realloc(void* ptr, size_t osize, size_t nsize) {
+    // If there is no block, osize is the type of object being allocated.
+    if (!ptr) osize = 0;
+
+    if (nsize == 0) {
+        if (ptr) {
+            if (osize <= maxSmall)
+                freeSmall(ptr, osize);
+            else
+                free(ptr);
+
+            _used -= osize;
+        }
+
+        return NULL;
+    }
+
+    void* p;
+
+    if (!ptr) {
+        p = (nsize <= maxSmall) ? allocSmall(nsize) : malloc(nsize);
+    }
+    else if (osize <= maxSmall && nsize <= maxSmall) {
+        if (sizeClass(osize) == sizeClass(nsize))
+            p = ptr;
+        else if ((p = allocSmall(nsize))) {
+            memcpy(p, ptr, osize < nsize ? osize : nsize);
+            freeSmall(ptr, osize);
+        }
+    }
+    else if (osize > maxSmall && nsize > maxSmall) {
+        p = ::realloc(ptr, nsize);
+    }
+    else if (osize <= maxSmall) {
+        // Growing out of a small block.
+        if ((p = malloc(nsize))) {
+            memcpy(p, ptr, osize);
+            freeSmall(ptr, osize);
+        }
+    }
+    else {
+        // Shrinking into a small block.
+        if ((p = allocSmall(nsize))) {
+            memcpy(p, ptr, nsize);
+            free(ptr);
+        }
+    }
+
+    if (!p) {
+        // Lua expects shrinking a block to always work. Keeping the old block
+        // is fine since it is at least as big as the size class of the new
+        // size. The worst that can happen is that a block from malloc ends up
+        // on a free list and is never given back.
+        if (ptr && nsize <= osize)
+            p = ptr;
+        else
+            return NULL;
+    }
+
+    _used = _used - osize + nsize;
+    if (_used > _peak)
+        _peak = _used;
+
+    return p;
+}
+
+void* LuaAllocator::alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+    return ((LuaAllocator*)ud)->realloc(ptr, osize, nsize);
+}
+
+size_t peakMemory() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                sizeof(counters)))
+        return 0;
+
+    return counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+
+#   ifdef __APPLE__
+    return (size_t)usage.ru_maxrss;
+#   else
+    // Linux and the BSDs report this in kilobytes.
+    return (size_t)usage.ru_maxrss * 1024;
+#   endif
+#endif
+}
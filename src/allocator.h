@@ -0,0 +1,95 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Memory allocator for Lua states.
+ */
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Allocates memory for a single Lua state.
+ *
+ * Almost everything Lua allocates is small: strings, tables, closures, and the
+ * arrays inside them. Small blocks are carved out of large chunks and, once
+ * freed, kept on a free list for their size class. Since Lua always passes
+ * along the size of the block being freed or resized, blocks don't need a
+ * header saying how big they are. Larger blocks go straight to malloc.
+ *
+ * If small blocks are never freed, they are simply left where they are until
+ * the Lua state is closed. This is the fastest option for a short run, at the
+ * expense of memory that would have been reused.
+ *
+ * This is not thread safe. Each Lua state has its own allocator, which must
+ * outlive it.
+ */
+class LuaAllocator
+{
+public:
+    // Blocks up to this size come from chunks.
+    static const size_t maxSmall = 256;
+
+    // Small blocks are rounded up to a multiple of this.
+    static const size_t granularity = 8;
+
+    // Size of each chunk that small blocks are carved from.
+    static const size_t chunkSize = 256 * 1024;
+
+private:
+    static const size_t classCount = maxSmall / granularity;
+
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    const bool _neverFree;
+
+    FreeBlock* _free[classCount];
+
+    // Unused part of the current chunk.
+    char* _next;
+    char* _end;
+
+    // Every chunk, linked together through the start of each one.
+    void* _chunks;
+
+    // Bytes currently allocated by Lua, and the most there ever were.
+    size_t _used;
+    size_t _peak;
+
+public:
+    explicit LuaAllocator(bool neverFree = false);
+    ~LuaAllocator();
+
+    LuaAllocator(const LuaAllocator&) = delete;
+    LuaAllocator& operator=(const LuaAllocator&) = delete;
+
+    /**
+     * The allocation function to pass to lua_newstate() along with a pointer
+     * to the allocator.
+     */
+    static void* alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+
+    /**
+     * The most memory the Lua state has used at once, in bytes.
+     */
+    size_t peak() const {
+        return _peak;
+    }
+
+private:
+    void* allocSmall(size_t size);
+    void freeSmall(void* ptr, size_t size);
+    bool newChunk();
+
+    void* realloc(void* ptr, size_t osize, size_t nsize);
+};
+
+/**
+ * The most memory the whole process has used at once, in bytes. Returns 0 if
+ * this isn't known.
+ */
+size_t peakMemory();
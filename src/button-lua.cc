@@ -9,30 +9,73 @@
 
 #ifdef _WIN32
 #   define _CRT_SECURE_NO_WARNINGS
+#   include <io.h>
+#   include <fcntl.h>
 #endif
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string>
+#include <memory>
+#include <new>
+#include <thread>
 
 #include "button-lua.h"
 #include "rules.h"
 #include "path.h"
 #include "lua_path.h"
+#include "lua_table.h"
 #include "embedded.h"
 #include "lua_glob.h"
 #include "deps.h"
 #include "dircache.h"
 #include "threadpool.h"
+#include "hasher.h"
+#include "lua_load.h"
+#include "lua_import.h"
+#include "replaycache.h"
+#include "profile.h"
+#include "server.h"
 
 namespace {
 
-const char* usage = "Usage: button-lua <script> [-o output] [args...]\n";
+const char* usage =
+    "Usage: button-lua <script> [-o output] [-f json|binary]\n"
+    "                  [--dir-cache file] [--replay-cache file] [--parallel]\n"
+    "                  [--parallel-rules] [-j threads] [--profile file]\n"
+    "                  [--never-free] [--connect socket] [args...]\n"
+    "       button-lua --serve socket\n";
 
 struct Options
 {
     const char* script;
     const char* output;
+    buttonlua::RuleFormat format;
+
+    // File to keep directory listings in between runs.
+    const char* dirCache;
+
+    // File to save the run in so that it can be replayed if nothing changes.
+    const char* replayCache;
+
+    // Import scripts in parallel?
+    bool parallel;
+
+    // Generate the rules of targets in parallel?
+    bool parallelRules;
+
+    // Number of threads in each thread pool.
+    size_t threads;
+
+    // File to write a trace of where the time went to.
+    const char* profile;
+
+    // Never free small blocks of memory used by Lua?
+    bool neverFree;
+
+    // Socket of a server to do the run instead, if it is there.
+    const char* connect;
 };
 
 struct Args
@@ -50,18 +93,99 @@ bool parse_args(Options &opts, Args &args)
         opts.script = args.argv[0];
         --args.n; ++args.argv;
 
-        if (args.n > 0 && strcmp(args.argv[0], "-o") == 0) {
-            if (args.n > 1)
-                opts.output = args.argv[1];
-            else
-                return false;
+        opts.output = NULL;
+        opts.format = buttonlua::RuleFormat::json;
+        opts.dirCache = NULL;
+        opts.replayCache = NULL;
+        opts.parallel = false;
+        opts.parallelRules = false;
+        opts.threads = std::thread::hardware_concurrency();
+        opts.profile = NULL;
+        opts.neverFree = false;
+        opts.connect = NULL;
+
+        // Options must come right after the script. Everything after them is
+        // passed along to the script.
+        while (args.n > 0) {
+            const char* opt = args.argv[0];
+
+            if (strcmp(opt, "-o") == 0) {
+                if (args.n > 1)
+                    opts.output = args.argv[1];
+                else
+                    return false;
+            }
+            else if (strcmp(opt, "-f") == 0) {
+                if (args.n < 2)
+                    return false;
+
+                if (strcmp(args.argv[1], "json") == 0)
+                    opts.format = buttonlua::RuleFormat::json;
+                else if (strcmp(args.argv[1], "binary") == 0)
+                    opts.format = buttonlua::RuleFormat::binary;
+                else
+                    return false;
+            }
+            else if (strcmp(opt, "--dir-cache") == 0) {
+                if (args.n > 1)
+                    opts.dirCache = args.argv[1];
+                else
+                    return false;
+            }
+            else if (strcmp(opt, "--replay-cache") == 0) {
+                if (args.n > 1)
+                    opts.replayCache = args.argv[1];
+                else
+                    return false;
+            }
+            else if (strcmp(opt, "-j") == 0) {
+                if (args.n < 2)
+                    return false;
+
+                char* end;
+                const unsigned long n = strtoul(args.argv[1], &end, 10);
+                if (*args.argv[1] == '\0' || *end != '\0' || n == 0)
+                    return false;
+
+                opts.threads = (size_t)n;
+            }
+            else if (strcmp(opt, "--connect") == 0) {
+                if (args.n > 1)
+                    opts.connect = args.argv[1];
+                else
+                    return false;
+            }
+            else if (strcmp(opt, "--profile") == 0) {
+                if (args.n > 1)
+                    opts.profile = args.argv[1];
+                else
+                    return false;
+            }
+            else if (strcmp(opt, "--parallel") == 0) {
+                opts.parallel = true;
+                --args.n;
+                ++args.argv;
+                continue;
+            }
+            else if (strcmp(opt, "--parallel-rules") == 0) {
+                opts.parallelRules = true;
+                --args.n;
+                ++args.argv;
+                continue;
+            }
+            else if (strcmp(opt, "--never-free") == 0) {
+                opts.neverFree = true;
+                --args.n;
+                ++args.argv;
+                continue;
+            }
+            else {
+                break;
+            }
 
             args.n -= 2;
             args.argv += 2;
         }
-        else {
-            opts.output = NULL;
-        }
 
         return true;
     }
@@ -73,22 +197,122 @@ void print_error(lua_State* L) {
     printf("Error: %s\n", lua_tostring(L, -1));
 }
 
+/**
+ * Rules from scripts imported in parallel must come before any rules the main
+ * script adds after importing them.
+ */
+void wait_for_imports(lua_State* L, buttonlua::Importer* importer,
+        buttonlua::Rules& rules) {
+    if (importer && importer->pending())
+        importer->wait(L, rules);
+}
+
 int rule(lua_State* L) {
     buttonlua::Rules* rules = (buttonlua::Rules*)lua_touserdata(L, lua_upvalueindex(1));
-    if (rules)
+    buttonlua::Importer* importer = (buttonlua::Importer*)lua_touserdata(L, lua_upvalueindex(2));
+    if (rules) {
+        wait_for_imports(L, importer, *rules);
         rules->add(L);
+    }
+    return 0;
+}
+
+struct Template {
+    buttonlua::RuleTemplate t;
+    buttonlua::Importer* importer;
+};
+
+/**
+ * Creates a rule template. See RuleTemplate for the fields of the table.
+ */
+int rule_template(lua_State* L) {
+    buttonlua::Rules* rules = (buttonlua::Rules*)lua_touserdata(L, lua_upvalueindex(1));
+
+    void* p = lua_newuserdata(L, sizeof(Template));
+    Template* t = new (p) Template();
+    t->importer = (buttonlua::Importer*)lua_touserdata(L, lua_upvalueindex(2));
+    luaL_setmetatable(L, "rule_template");
+
+    t->t.init(L, 1, *rules);
+
+    return 1;
+}
+
+/**
+ * Adds a rule based on the template: t:add(input, output[, deps])
+ */
+int rule_template_add(lua_State* L) {
+    Template* t = (Template*)luaL_checkudata(L, 1, "rule_template");
+
+    buttonlua::Rules& rules = *t->t.rules();
+    wait_for_imports(L, t->importer, rules);
+
+    return rules.add(L, t->t, 2);
+}
+
+int rule_template_gc(lua_State* L) {
+    Template* t = (Template*)luaL_checkudata(L, 1, "rule_template");
+
+    t->~Template();
+
     return 0;
 }
 
+const luaL_Reg rule_template_methods[] = {
+    {"add", rule_template_add},
+    {NULL, NULL}
+};
+
 int publish_input(lua_State* L) {
-    ImplicitDeps* deps = (ImplicitDeps*)lua_touserdata(L, lua_upvalueindex(1));
+    InputHasher* hasher = (InputHasher*)lua_touserdata(L, lua_upvalueindex(1));
 
     size_t len;
     const char* path = luaL_checklstring(L, 1, &len);
 
-    if (deps)
-        deps->addInput(path, len);
+    profile::count(profile::publishInputs);
+
+    if (hasher)
+        hasher->add(path, len);
+
+    return 0;
+}
 
+/**
+ * Imports a script in parallel: import(file)
+ */
+int import(lua_State* L) {
+    buttonlua::Importer* importer = (buttonlua::Importer*)lua_touserdata(L, lua_upvalueindex(1));
+    return importer->import(L);
+}
+
+/**
+ * Merges all of the scripts imported in parallel.
+ */
+int wait_imports(lua_State* L) {
+    buttonlua::Importer* importer = (buttonlua::Importer*)lua_touserdata(L, lua_upvalueindex(1));
+    buttonlua::Rules* rules = (buttonlua::Rules*)lua_touserdata(L, lua_upvalueindex(2));
+    importer->wait(L, *rules);
+    return 0;
+}
+
+/**
+ * Generates the rules for a list of targets in parallel.
+ */
+int generate_rules(lua_State* L) {
+    buttonlua::Importer* importer = (buttonlua::Importer*)lua_touserdata(L, lua_upvalueindex(1));
+    buttonlua::Rules* rules = (buttonlua::Rules*)lua_touserdata(L, lua_upvalueindex(2));
+    importer->generate(L, *rules);
+    return 0;
+}
+
+/**
+ * Called on errors outside of a protected call. This is the same as what
+ * luaL_newstate() sets up.
+ */
+int panic(lua_State* L) {
+    const char* msg = lua_tostring(L, -1);
+    fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+            msg ? msg : "error object is not a string");
     return 0;
 }
 
@@ -96,6 +320,13 @@ int publish_input(lua_State* L) {
 
 namespace buttonlua {
 
+lua_State* new_state(LuaAllocator& allocator) {
+    lua_State* L = lua_newstate(LuaAllocator::alloc, &allocator);
+    if (L)
+        lua_atpanic(L, panic);
+    return L;
+}
+
 int init(lua_State* L) {
 
     // Initialize the standard library
@@ -110,12 +341,26 @@ int init(lua_State* L) {
     luaL_requiref(L, "posixpath", luaopen_posixpath, 1);
     lua_pop(L, 1);
 
+    luaopen_table_utils(L);
+    lua_pop(L, 1);
+
     lua_pushcfunction(L, lua_glob);
     lua_setglobal(L, "glob");
 
+    // Scripts loaded from disk are reported as inputs. These read each file
+    // once and checksum the same bytes that get loaded.
+    lua_pushcfunction(L, lua_loadfile);
+    lua_setglobal(L, "loadfile");
+
+    lua_pushcfunction(L, lua_dofile);
+    lua_setglobal(L, "dofile");
+
     lua_getglobal(L, "package");
     lua_getfield(L, -1, "searchers");
     if (lua_type(L, -1) == LUA_TTABLE) {
+        lua_pushcfunction(L, lua_file_searcher);
+        lua_rawseti(L, -2, 2);
+
         // Remove the last entry.
         lua_pushnil(L);
         lua_rawseti(L, -2, 4);
@@ -142,66 +387,154 @@ int init(lua_State* L) {
     return 0;
 }
 
-int execute(lua_State* L, int argc, char** argv) {
+void register_globals(lua_State* L, const Context& ctx, Rules& rules,
+        Importer* importer) {
 
-    Options opts;
-    Args args = {argc-1, argv+1};
+    lua_pushlightuserdata(L, ctx.dirCache);
+    lua_setglobal(L, "__DIR_CACHE");
 
-    if (!parse_args(opts, args)) {
-        fputs(usage, stderr);
-        return 1;
-    }
+    lua_pushlightuserdata(L, ctx.hasher);
+    lua_setglobal(L, "__INPUT_HASHER");
 
-    // Set SCRIPT_DIR to the script's directory.
-    Path dirname = Path(opts.script).dirname();
-    lua_pushlstring(L, dirname.path, dirname.length);
-    lua_setglobal(L, "SCRIPT_DIR");
+    lua_pushlightuserdata(L, ctx.pool);
+    lua_setglobal(L, "__THREAD_POOL");
 
-    if (luaL_loadfile(L, opts.script) != LUA_OK) {
-        print_error(L);
-        return 1;
-    }
+    // Register publish_input() function
+    lua_pushlightuserdata(L, ctx.hasher);
+    lua_pushcclosure(L, publish_input, 1);
+    lua_setglobal(L, "publish_input");
 
+    // Register rule() function
+    lua_pushlightuserdata(L, &rules);
+    lua_pushlightuserdata(L, importer);
+    lua_pushcclosure(L, rule, 2);
+    lua_setglobal(L, "rule");
+
+    // Register rule_template() function
+    luaL_newmetatable(L, "rule_template");
+    luaL_newlib(L, rule_template_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, rule_template_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    lua_pushlightuserdata(L, &rules);
+    lua_pushlightuserdata(L, importer);
+    lua_pushcclosure(L, rule_template, 2);
+    lua_setglobal(L, "rule_template");
+}
+
+namespace {
+
+/**
+ * Opens the file the rules are written to.
+ */
+FILE* open_output(const Options& opts) {
     FILE* output;
 
-    if (!opts.output || strcmp(opts.output, "-") == 0)
+    const bool binary = opts.format == RuleFormat::binary;
+
+    if (!opts.output || strcmp(opts.output, "-") == 0) {
         output = stdout;
+#ifdef _WIN32
+        // Don't let newlines get translated in the binary format.
+        if (binary) _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    }
     else
-        output = fopen(opts.output, "w");
+        output = fopen(opts.output, binary ? "wb" : "w");
 
-    if (!output) {
+    if (!output)
         perror("Failed to open output file");
-        return 1;
+
+    return output;
+}
+
+/**
+ * Closes the file the rules were written to. A server keeps running after the
+ * run, so this can't be left up to the process exiting.
+ */
+void close_output(FILE* output) {
+    if (output == stdout)
+        fflush(output);
+    else
+        fclose(output);
+}
+
+/**
+ * Runs the loaded script at the top of the stack and writes the rules to the
+ * given file.
+ */
+int run_scripts(lua_State* L, const Options& opts, const Args& args,
+        FILE* output, ImplicitDeps& deps, DirCache* warmCache) {
+
+    // A server's cache is kept up to date by other means than a file.
+    std::unique_ptr<DirCache> ownCache;
+    if (!warmCache) {
+        ownCache.reset(new DirCache(&deps));
+
+        if (opts.dirCache)
+            ownCache->load(opts.dirCache);
     }
 
-    ImplicitDeps deps;
-    ThreadPool pool; // TODO: Allow setting pool size from command line
-    Rules rules(output);
-    DirCache dirCache(&deps);
+    DirCache& dirCache = warmCache ? *warmCache : *ownCache;
 
-    lua_pushlightuserdata(L, &dirCache);
-    lua_setglobal(L, "__DIR_CACHE");
+    ThreadPool pool(opts.threads);
+    Rules rules(output, opts.format);
+    InputHasher hasher(&deps, &dirCache, pool);
 
-    lua_pushlightuserdata(L, &pool);
-    lua_setglobal(L, "__THREAD_POOL");
+    const Context ctx = {&dirCache, &hasher, &pool};
 
-    // Register publish_input() function
-    lua_pushlightuserdata(L, &deps);
-    lua_pushcclosure(L, publish_input, 1);
-    lua_setglobal(L, "publish_input");
+    std::unique_ptr<Importer> importer;
+    if (opts.parallel || opts.parallelRules)
+        importer.reset(new Importer(ctx, opts.format, opts.threads,
+                    opts.neverFree));
 
-    // Register rule() function
-    lua_pushlightuserdata(L, &rules);
-    lua_pushcclosure(L, rule, 1);
-    lua_setglobal(L, "rule");
+    register_globals(L, ctx, rules, importer.get());
+
+    if (opts.parallel) {
+        // Register import() function
+        lua_pushlightuserdata(L, importer.get());
+        lua_pushcclosure(L, import, 1);
+        lua_setglobal(L, "import");
+    }
+
+    if (opts.parallelRules) {
+        // This is used by rules.resolve() to generate rules in parallel.
+        lua_pushlightuserdata(L, importer.get());
+        lua_pushlightuserdata(L, &rules);
+        lua_pushcclosure(L, generate_rules, 2);
+        lua_setglobal(L, "__GENERATE_RULES");
+    }
+
+    if (importer)
+        importer->baseline(L);
 
     // Pass along the rest of the command line arguments to the Lua script.
     for (int i = 0; i < args.n; ++i)
         lua_pushstring(L, args.argv[i]);
 
-    if (lua_pcall(L, args.n, LUA_MULTRET, 0) != LUA_OK) {
-        print_error(L);
-        return 1;
+    {
+        profile::Span span(profile::lua, opts.script, strlen(opts.script));
+
+        if (lua_pcall(L, args.n, LUA_MULTRET, 0) != LUA_OK) {
+            print_error(L);
+            return 1;
+        }
+    }
+
+    profile::Span span(profile::shutdown);
+
+    // All targets must be known before they are resolved.
+    if (importer) {
+        lua_pushlightuserdata(L, importer.get());
+        lua_pushlightuserdata(L, &rules);
+        lua_pushcclosure(L, wait_imports, 2);
+
+        if (lua_pcall(L, 0, 0, 0) != LUA_OK) {
+            print_error(L);
+            return 1;
+        }
     }
 
     // Shutdown
@@ -210,7 +543,154 @@ int execute(lua_State* L, int argc, char** argv) {
         return 1;
     }
 
+    // Checksums may still be listing directories.
+    hasher.wait();
+
+    if (ownCache && opts.dirCache && !dirCache.save(opts.dirCache))
+        fprintf(stderr, "Warning: Failed to save directory cache '%s'\n",
+                opts.dirCache);
+
     return 0;
 }
 
+/**
+ * Loads and runs the script given on the command line. If there is a replay
+ * cache, the run is recorded in it.
+ */
+int run(lua_State* L, const Options& opts, const Args& args,
+        ReplayCache* replay, ImplicitDeps& deps, DirCache* warmCache) {
+
+    // Set SCRIPT_DIR to the script's directory.
+    Path dirname = Path(opts.script).dirname();
+    lua_pushlstring(L, dirname.path, dirname.length);
+    lua_setglobal(L, "SCRIPT_DIR");
+
+    if (luaL_loadfile(L, opts.script) != LUA_OK) {
+        print_error(L);
+        return 1;
+    }
+
+    FILE* output = open_output(opts);
+    if (!output)
+        return 1;
+
+    // While recording, the rules only go to the output once the run has
+    // succeeded.
+    FILE* capture = replay ? replay->record(deps) : NULL;
+
+    const int ret = run_scripts(L, opts, args, capture ? capture : output,
+            deps, warmCache);
+
+    if (ret == 0 && capture && !replay->finish(output, deps))
+        fprintf(stderr, "Warning: Failed to save replay cache '%s'\n",
+                opts.replayCache);
+
+    close_output(output);
+
+    return ret;
+}
+
+/**
+ * Replays the saved output if possible and otherwise runs the scripts.
+ */
+int run_or_replay(const Options& opts, const Args& args, int argc,
+        char** argv, Warm* warm) {
+
+    std::unique_ptr<ImplicitDeps> ownDeps;
+    if (!warm)
+        ownDeps.reset(new ImplicitDeps());
+
+    ImplicitDeps& deps = warm ? *warm->deps : *ownDeps;
+
+    std::unique_ptr<ReplayCache> replay;
+
+    if (opts.replayCache) {
+        replay.reset(new ReplayCache(opts.replayCache, argc-1, argv+1,
+                    opts.script));
+
+        // If nothing has changed, there is no need to run any Lua at all.
+        if (replay->check()) {
+            FILE* output = open_output(opts);
+            if (!output)
+                return 1;
+
+            replay->replay(output, deps);
+            close_output(output);
+            return 0;
+        }
+    }
+
+    DirCache* warmCache = warm ? warm->dirCache : NULL;
+
+    // Use the server's Lua state if it is ready and fits.
+    if (warm && warm->L && !opts.neverFree) {
+        lua_State* L = warm->L;
+        warm->L = NULL;
+
+        const int ret = run(L, opts, args, replay.get(), deps, warmCache);
+        lua_close(L);
+
+        profile::peak(profile::luaPeak, warm->allocator->peak());
+        return ret;
+    }
+
+    LuaAllocator allocator(opts.neverFree);
+
+    lua_State* L = new_state(allocator);
+    if (!L) return 1;
+
+    int ret = init(L);
+
+    if (ret == 0)
+        ret = run(L, opts, args, replay.get(), deps, warmCache);
+
+    lua_close(L);
+
+    profile::peak(profile::luaPeak, allocator.peak());
+
+    return ret;
+}
+
+}
+
+int execute(int argc, char** argv, Warm* warm) {
+
+    if (!warm && argc > 1 && strcmp(argv[1], "--serve") == 0) {
+        if (argc != 3) {
+            fputs(usage, stderr);
+            return 1;
+        }
+
+        return serve(argv[2]);
+    }
+
+    Options opts;
+    Args args = {argc-1, argv+1};
+
+    if (!parse_args(opts, args)) {
+        fputs(usage, stderr);
+        return 1;
+    }
+
+    // Let the server do it, if there is one. A server ignores this.
+    if (opts.connect && !warm) {
+        int status;
+        if (forward(opts.connect, argc, argv, status))
+            return status;
+    }
+
+    if (opts.profile)
+        profile::start();
+
+    const int ret = run_or_replay(opts, args, argc, argv, warm);
+
+    profile::peak(profile::processPeak, peakMemory());
+
+    if (opts.profile && !profile::finish(opts.profile, stderr))
+        fprintf(stderr, "Warning: Failed to write profile '%s'\n",
+                opts.profile);
+
+    return ret;
+}
+
 }
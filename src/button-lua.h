@@ -10,16 +10,68 @@
 
 #include "lua.hpp"
 
+#include "allocator.h"
+
+class DirCache;
+class InputHasher;
+class ThreadPool;
+class ImplicitDeps;
+
 namespace buttonlua {
 
+class Rules;
+class Importer;
+
+/**
+ * Objects that are shared by every Lua state.
+ */
+struct Context {
+    DirCache* dirCache;
+    InputHasher* hasher;
+    ThreadPool* pool;
+};
+
+
+/**
+ * Creates a new Lua state that gets its memory from the given allocator.
+ * Returns NULL if there is not enough memory.
+ */
+lua_State* new_state(LuaAllocator& allocator);
+
 /**
  * Initializes the Lua state with additional functions and libraries.
  */
 int init(lua_State* L);
 
 /**
- * Executes the script given on the command line. Fails if no script is given.
+ * Makes the shared objects available to the Lua state and registers the
+ * functions for adding rules. If there is an importer, rules are only added
+ * once all the scripts imported so far have been merged.
+ */
+void register_globals(lua_State* L, const Context& ctx, Rules& rules,
+        Importer* importer);
+
+/**
+ * What a server keeps around between runs. See serve().
+ */
+struct Warm {
+    // Listings that are kept up to date between runs.
+    DirCache* dirCache;
+
+    // Where the dependencies of this run are sent.
+    ImplicitDeps* deps;
+
+    // A Lua state that has been initialized already, if any, along with its
+    // allocator. If the run uses the state, it closes it and sets this to
+    // NULL.
+    lua_State* L;
+    LuaAllocator* allocator;
+};
+
+/**
+ * Executes the script given on the command line in a new Lua state. Fails if
+ * no script is given. A server passes along what it keeps between runs.
  */
-int execute(lua_State* L, int argc, char **argv);
+int execute(int argc, char **argv, Warm* warm = NULL);
 
 }
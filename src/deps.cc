@@ -7,14 +7,64 @@
  * Handles sending dependencies to parent build system.
  */
 #include "deps.h"
+#include "profile.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef _WIN32
+#   include <windows.h>
+#else
+#   include <errno.h>
+#   include <unistd.h>
+#endif
 
-#include <windows.h>
+namespace {
 
-ImplicitDeps::ImplicitDeps() : _inputs(NULL), _outputs(NULL) {
+/**
+ * Returns a name length that fits in a record.
+ */
+uint32_t nameLength(size_t length) {
+    return length > UINT32_MAX ? UINT32_MAX : (uint32_t)length;
+}
+
+}
+
+#ifdef _WIN32
+
+ImplicitDeps::Channel::Channel()
+    : handle(NULL), buf(NULL, batchSize), recording(false) {}
+
+bool ImplicitDeps::Channel::isOpen() const {
+    return handle != NULL;
+}
+
+void ImplicitDeps::Channel::flush() {
+    profile::Span span(profile::depsWrite);
+    profile::count(profile::depsBytes, buf.length());
+
+    const char* data = buf.data();
+    size_t length = buf.length();
+
+    // WriteFile may not write everything in one go to a pipe.
+    while (length > 0) {
+        DWORD written;
+        if (!WriteFile(handle, data, (DWORD)length, &written, NULL))
+            break;
+
+        data += written;
+        length -= written;
+    }
+
+    buf.clear();
+}
+
+void ImplicitDeps::Channel::close() {
+    if (handle) CloseHandle(handle);
+    handle = NULL;
+}
+
+ImplicitDeps::ImplicitDeps() {
 
     static const size_t bufLength = 32;
     char buf[bufLength];
@@ -25,125 +75,181 @@ ImplicitDeps::ImplicitDeps() : _inputs(NULL), _outputs(NULL) {
     if (len == 0 || len >= bufLength)
         return;
 
-    _inputs = (void*)strtoull(buf, NULL, 10);
+    _inputs.handle = (void*)strtoull(buf, NULL, 10);
 
     len = GetEnvironmentVariableA("BUTTON_OUTPUTS", buf, bufLength);
     if (len == 0 || len >= bufLength)
         return;
 
-    _outputs = (void*)strtoull(buf, NULL, 10);
+    _outputs.handle = (void*)strtoull(buf, NULL, 10);
 }
 
-ImplicitDeps::~ImplicitDeps() {
-    if (_inputs)  CloseHandle(_inputs);
-    if (_outputs) CloseHandle(_outputs);
-}
-
-bool ImplicitDeps::hasParent() const {
-    return _inputs != NULL || _outputs != NULL;
-}
+#else // WIN32
 
-void ImplicitDeps::addInput(const Dependency& dep) {
-    if (!_inputs) return;
+ImplicitDeps::Channel::Channel()
+    : fd(-1), buf(NULL, batchSize), recording(false) {}
 
-    DWORD written;
-    WriteFile(_inputs, &dep, sizeof(dep) + dep.length, &written, NULL);
+bool ImplicitDeps::Channel::isOpen() const {
+    return fd != -1;
 }
 
-void ImplicitDeps::addOutput(const Dependency& dep) {
-    if (!_outputs) return;
+void ImplicitDeps::Channel::flush() {
+    profile::Span span(profile::depsWrite);
+    profile::count(profile::depsBytes, buf.length());
 
-    DWORD written;
-    WriteFile(_outputs, &dep, sizeof(dep) + dep.length, &written, NULL);
-}
+    const char* data = buf.data();
+    size_t length = buf.length();
 
-void ImplicitDeps::addInput(const char* name, size_t length) {
-    if (!_inputs) return;
+    // Writes to a pipe can be partial.
+    while (length > 0) {
+        const ssize_t written = ::write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
 
-    if (length > UINT32_MAX)
-        length = UINT32_MAX;
+        data += written;
+        length -= (size_t)written;
+    }
 
-    Dependency dep = {0};
-    dep.length = (uint32_t)length;
-
-    DWORD written;
-    WriteFile(_inputs, &dep, sizeof(dep), &written, NULL);
-    WriteFile(_inputs, name, dep.length, &written, NULL);
+    buf.clear();
 }
 
-void ImplicitDeps::addOutput(const char* name, size_t length) {
-    if (!_outputs) return;
-
-    if (length > UINT32_MAX)
-        length = UINT32_MAX;
-
-    Dependency dep = {0};
-    dep.length = (uint32_t)length;
-
-    DWORD written;
-    WriteFile(_outputs, &dep, sizeof(dep), &written, NULL);
-    WriteFile(_outputs, name, dep.length, &written, NULL);
+void ImplicitDeps::Channel::close() {
+    if (fd != -1) ::close(fd);
+    fd = -1;
 }
 
-#else // WIN32
-
-ImplicitDeps::ImplicitDeps() : _inputs(NULL), _outputs(NULL) {
+ImplicitDeps::ImplicitDeps() {
     const char* var;
     int fd;
 
     var = getenv("BUTTON_INPUTS");
     if (var && (fd = atoi(var)))
-        _inputs = fdopen(fd, "a");
+        _inputs.fd = fd;
 
     var = getenv("BUTTON_OUTPUTS");
     if (var && (fd = atoi(var)))
-        _outputs = fdopen(fd, "a");
+        _outputs.fd = fd;
+}
+
+ImplicitDeps::ImplicitDeps(int inputs, int outputs) {
+    _inputs.fd = inputs;
+    _outputs.fd = outputs;
+}
+
+#endif // !_WIN32
+
+void ImplicitDeps::Channel::add(const Dependency& dep, const char* name) {
+    // The record is the key. The same name with a different status or checksum
+    // is still sent.
+    std::string record((const char*)&dep, sizeof(dep));
+    record.append(name, dep.length);
+
+    if (!seen.insert(record).second)
+        return;
+
+    if (recording)
+        records.push_back(record);
+
+    if (!isOpen())
+        return;
+
+    if (buf.length() + record.size() > batchSize)
+        flush();
+
+    buf.write(record.data(), record.size());
 }
 
 ImplicitDeps::~ImplicitDeps() {
-    if (_inputs)  fclose(_inputs);
-    if (_outputs) fclose(_outputs);
+    flush();
+
+    _inputs.close();
+    _outputs.close();
 }
 
 bool ImplicitDeps::hasParent() const {
-    return _inputs != NULL || _outputs != NULL;
+    return _inputs.isOpen() || _outputs.isOpen();
+}
+
+void ImplicitDeps::record() {
+    _inputs.recording = true;
+    _outputs.recording = true;
+}
+
+bool ImplicitDeps::enabled() const {
+    return _inputs.wanted() || _outputs.wanted();
 }
 
 void ImplicitDeps::addInput(const Dependency& dep) {
-    if (!_inputs) return;
+    if (!_inputs.wanted()) return;
+
+    std::lock_guard<std::mutex> lock(_mutex);
 
-    fwrite(&dep, sizeof(dep) + dep.length, 1, _inputs);
+    _inputs.add(dep, dep.name);
 }
 
 void ImplicitDeps::addOutput(const Dependency& dep) {
-    if (!_outputs) return;
+    if (!_outputs.wanted()) return;
 
-    fwrite(&dep, sizeof(dep) + dep.length, 1, _outputs);
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _outputs.add(dep, dep.name);
 }
 
 void ImplicitDeps::addInput(const char* name, size_t length) {
-    if (!_inputs) return;
-
-    if (length > UINT32_MAX)
-        length = UINT32_MAX;
+    if (!_inputs.wanted()) return;
 
     Dependency dep = {0};
-    dep.length = (uint32_t)length;
+    dep.length = nameLength(length);
+
+    std::lock_guard<std::mutex> lock(_mutex);
 
-    fwrite(&dep, sizeof(dep), 1, _inputs);
-    fwrite(name, 1, dep.length, _inputs);
+    _inputs.add(dep, name);
 }
 
-void ImplicitDeps::addOutput(const char* name, size_t length) {
-    if (!_outputs) return;
+void ImplicitDeps::addInput(const char* name, size_t length, uint32_t status,
+        const uint8_t checksum[32]) {
+    if (!_inputs.wanted()) return;
+
+    Dependency dep;
+    dep.status = status;
+    memcpy(dep.checksum, checksum, sizeof(dep.checksum));
+    dep.length = nameLength(length);
 
-    if (length > UINT32_MAX)
-        length = UINT32_MAX;
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _inputs.add(dep, name);
+}
+
+void ImplicitDeps::addOutput(const char* name, size_t length) {
+    if (!_outputs.wanted()) return;
 
     Dependency dep = {0};
-    dep.length = (uint32_t)length;
+    dep.length = nameLength(length);
+
+    std::lock_guard<std::mutex> lock(_mutex);
 
-    fwrite(&dep, sizeof(dep), 1, _outputs);
-    fwrite(name, 1, dep.length, _outputs);
+    _outputs.add(dep, name);
+}
+
+void ImplicitDeps::addOutput(const char* name, size_t length, uint32_t status,
+        const uint8_t checksum[32]) {
+    if (!_outputs.wanted()) return;
+
+    Dependency dep;
+    dep.status = status;
+    memcpy(dep.checksum, checksum, sizeof(dep.checksum));
+    dep.length = nameLength(length);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _outputs.add(dep, name);
+}
+
+void ImplicitDeps::flush() {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if (_inputs.isOpen())  _inputs.flush();
+    if (_outputs.isOpen()) _outputs.flush();
 }
-#endif // !_WIN32
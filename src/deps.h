@@ -12,6 +12,13 @@
 #include <stddef.h>
 #include <stdio.h>
 
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "output.h"
+
 #ifdef _WIN32
 #   pragma warning(push)
 
@@ -40,7 +47,9 @@ struct Dependency {
      * system will compute the value when needed.
      *
      * For files, this is the checksum of the file contents. For directories,
-     * this is the checksum of the paths in the sorted directory listing.
+     * this is the checksum of the paths in the sorted directory listing. The
+     * paths are the names of the entries relative to the directory (without
+     * "." or ".."), sorted bytewise, each followed by a NUL byte.
      */
     uint8_t checksum[32];
 
@@ -74,25 +83,114 @@ struct Dependency {
 class ImplicitDeps {
 private:
 
+    // Records are sent in batches of about this size.
+    static const size_t batchSize = 1 << 16;
+
+    /**
+     * A stream of dependencies to the parent build system. Records are
+     * accumulated and written out in large chunks. Duplicate records are only
+     * sent once.
+     */
+    struct Channel {
 #ifdef _WIN32
-    void* _inputs;
-    void* _outputs;
+        void* handle;
 #else
-    FILE* _inputs;
-    FILE* _outputs;
+        int fd;
 #endif
 
+        // Records that haven't been written yet.
+        OutputBuffer buf;
+
+        // Every record that has been added so far.
+        std::unordered_set<std::string> seen;
+
+        // If recording, every record in the order it was first added.
+        bool recording;
+        std::vector<std::string> records;
+
+        Channel();
+
+        bool isOpen() const;
+
+        // Returns true if records are either sent or recorded.
+        bool wanted() const {
+            return recording || isOpen();
+        }
+
+        void add(const Dependency& dep, const char* name);
+
+        // Writes out all pending records.
+        void flush();
+
+        // Closes the handle.
+        void close();
+    };
+
+    Channel _inputs;
+    Channel _outputs;
+
+    // Dependencies can be added from multiple threads.
+    std::mutex _mutex;
+
 public:
+    /**
+     * Sends dependencies to the parent build system named by the BUTTON_INPUTS
+     * and BUTTON_OUTPUTS environment variables, if any.
+     */
     ImplicitDeps();
+
+#ifndef _WIN32
+    /**
+     * Sends dependencies to the given file descriptors instead, which are
+     * taken over. Either may be -1.
+     */
+    ImplicitDeps(int inputs, int outputs);
+#endif
+
+    /**
+     * Flushes any remaining dependencies.
+     */
     ~ImplicitDeps();
 
+    ImplicitDeps(const ImplicitDeps&) = delete;
+    ImplicitDeps& operator=(const ImplicitDeps&) = delete;
+
     /**
      * Returns true if there is a parent build system to send dependencies to.
      */
     bool hasParent() const;
 
     /**
-     * Adds the given dependency.
+     * Keeps every dependency added from now on, even if there is no parent
+     * build system, so that they can be saved and sent again by a later run.
+     * Must be called before any dependencies are added.
+     */
+    void record();
+
+    /**
+     * Returns true if dependencies are either sent to a parent build system or
+     * recorded. If not, there is no point in finding out what they are.
+     */
+    bool enabled() const;
+
+    /**
+     * The inputs and outputs recorded so far, in the order they were first
+     * added. Each is a Dependency immediately followed by its name. Must not
+     * be called while dependencies are still being added.
+     */
+    const std::vector<std::string>& inputs() const {
+        return _inputs.records;
+    }
+
+    const std::vector<std::string>& outputs() const {
+        return _outputs.records;
+    }
+
+    /**
+     * Adds the given dependency. Adding the same dependency again does
+     * nothing.
+     *
+     * These functions are thread safe.
      */
     void addInput(const Dependency& dep);
     void addOutput(const Dependency& dep);
@@ -102,6 +200,21 @@ public:
      */
     void addInput(const char* name, size_t length);
     void addOutput(const char* name, size_t length);
+
+    /**
+     * Adds a dependency along with its status and checksum. See Dependency for
+     * what these mean.
+     */
+    void addInput(const char* name, size_t length, uint32_t status,
+            const uint8_t checksum[32]);
+    void addOutput(const char* name, size_t length, uint32_t status,
+            const uint8_t checksum[32]);
+
+    /**
+     * Sends all pending dependencies to the parent build system. This is also
+     * done when a batch fills up and on destruction.
+     */
+    void flush();
 };
 
 
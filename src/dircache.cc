@@ -11,122 +11,469 @@
 #   include <dirent.h>
 #   include <sys/stat.h>
 #   include <fcntl.h>
+#   include <sys/resource.h>
+#   include <unistd.h>
+#   ifdef __linux__
+#       include <sys/syscall.h>
+#   endif
 #endif // _WIN32
 
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
 #include <algorithm>
+#include <iterator>
+#include <memory>
 #include <utility>
 
 #include "threadpool.h"
 #include "dircache.h"
 #include "path.h"
 #include "deps.h"
+#include "sha256.h"
+#include "profile.h"
+#include "dirwatch.h"
+
+void DirEntries::reserve(size_t count, size_t namesLength) {
+    _items.reserve(count);
+    _names.reserve(namesLength + count);
+}
+
+void DirEntries::add(const char* name, size_t length, DirEntry::Type type) {
+    _items.push_back(Item {(uint32_t)_names.size(), (uint32_t)length, type});
+    _names.append(name, length);
+    _names.push_back('\0');
+
+    if (type == DirEntry::dir)
+        ++_dirs;
+}
+
+void DirEntries::sort() {
+    const char* names = _names.data();
+
+    std::sort(_items.begin(), _items.end(),
+        [names] (const Item& a, const Item& b) {
+            const int c = memcmp(names + a.offset, names + b.offset,
+                    std::min(a.length, b.length));
+            if (c != 0) return c < 0;
+            if (a.length != b.length) return a.length < b.length;
+            return a.type < b.type;
+        });
+
+    // Repack the names so that they are in order too.
+    std::string sorted;
+    sorted.reserve(_names.size());
+
+    for (auto&& item: _items) {
+        const uint32_t offset = (uint32_t)sorted.size();
+        sorted.append(names + item.offset, item.length + 1);
+        item.offset = offset;
+    }
 
-bool operator<(const DirEntry& a, const DirEntry& b) {
-    return std::tie(a.name, a.isDir) < std::tie(b.name, b.isDir);
+    _names.swap(sorted);
+
+    index();
 }
 
 namespace {
 
 /**
- * Returns true if a NULL-terminated path is "." or "..".
+ * Returns the extension of a name: everything from its last '.' on, or nothing
+ * if there is no '.'.
  */
-#ifdef _WIN32
+inline Path extension(const char* name, size_t length) {
+    for (size_t i = length; i-- > 0; ) {
+        if (name[i] == '.')
+            return Path(name + i, length - i);
+    }
 
-bool isDotOrDotDot(const wchar_t* p) {
-    return (*p++ == L'.' && (*p == L'\0' || (*p++ == L'.' && *p == L'\0')));
+    return Path(name + length, 0);
 }
-#else
 
-bool isDotOrDotDot(const char* p) {
-    return (*p++ == '.' && (*p == '\0' || (*p++ == '.' && *p == '\0')));
+inline bool isAsciiLetter(char c) {
+    const char lower = (char)(c | 0x20);
+    return lower >= 'a' && lower <= 'z';
 }
 
-#endif
-
 /**
- * Returns a list of the files in a directory.
+ * Orders extensions the same way for every spelling that the file system
+ * considers equal.
  */
-DirEntries dirEntries(const std::string& path) {
+int compareExt(const Path& a, const Path& b) {
+    const size_t n = std::min(a.length, b.length);
+
+    for (size_t i = 0; i < n; ++i) {
+        const unsigned char x = (unsigned char)Path::fold(a.path[i]);
+        const unsigned char y = (unsigned char)Path::fold(b.path[i]);
+        if (x != y)
+            return x < y ? -1 : 1;
+    }
+
+    return a.length < b.length ? -1 : (a.length > b.length ? 1 : 0);
+}
+
+}
+
+void DirEntries::index() {
+    _byExt.clear();
+
+    if (_items.size() < indexThreshold)
+        return;
+
+    const char* names = _names.data();
+
+    _byExt.resize(_items.size());
+    for (size_t i = 0; i < _byExt.size(); ++i)
+        _byExt[i] = (uint32_t)i;
+
+    std::sort(_byExt.begin(), _byExt.end(),
+        [this, names] (uint32_t a, uint32_t b) {
+            const Item& x = _items[a];
+            const Item& y = _items[b];
+            const int c = compareExt(extension(names + x.offset, x.length),
+                                     extension(names + y.offset, y.length));
+            return c < 0 || (c == 0 && a < b);
+        });
+}
+
+void DirEntries::withExtension(const char* ext, size_t length,
+        const uint32_t*& begin, const uint32_t*& end) const {
+
+    const char* names = _names.data();
+    const Path key(ext, length);
+
+    auto extOf = [this, names] (uint32_t i) {
+        const Item& item = _items[i];
+        return extension(names + item.offset, item.length);
+    };
 
-    DirEntries entries;
+    auto lo = std::lower_bound(_byExt.begin(), _byExt.end(), key,
+        [&extOf] (uint32_t i, const Path& key) {
+            return compareExt(extOf(i), key) < 0;
+        });
+
+    auto hi = std::upper_bound(lo, _byExt.end(), key,
+        [&extOf] (const Path& key, uint32_t i) {
+            return compareExt(key, extOf(i)) < 0;
+        });
+
+    begin = _byExt.data() + (lo - _byExt.begin());
+    end = _byExt.data() + (hi - _byExt.begin());
+}
+
+void DirEntries::withPrefix(const char* prefix, size_t length,
+        size_t& begin, size_t& end) const {
+
+    const char* names = _names.data();
+
+    // Entries are sorted by name, so the ones with the prefix are together.
+    // Compared to the prefix, each entry comes before, within, or after.
+    auto cmp = [names, prefix, length] (const Item& item) {
+        const size_t n = std::min((size_t)item.length, length);
+        const int c = memcmp(names + item.offset, prefix, n);
+        if (c != 0) return c;
+        return item.length < length ? -1 : 0;
+    };
+
+    auto lo = std::partition_point(_items.begin(), _items.end(),
+        [&cmp] (const Item& item) { return cmp(item) < 0; });
+
+    auto hi = std::partition_point(lo, _items.end(),
+        [&cmp] (const Item& item) { return cmp(item) == 0; });
+
+    begin = (size_t)(lo - _items.begin());
+    end = (size_t)(hi - _items.begin());
+}
+
+bool DirEntries::find(const char* name, size_t length, DirEntry& entry) const {
+    const char* names = _names.data();
+
+    auto it = std::lower_bound(_items.begin(), _items.end(), length,
+        [names, name] (const Item& item, size_t length) {
+            const int c = memcmp(names + item.offset, name,
+                    std::min((size_t)item.length, length));
+            return c < 0 || (c == 0 && item.length < length);
+        });
+
+    if (it == _items.end() || it->length != length ||
+            memcmp(names + it->offset, name, length) != 0)
+        return false;
+
+    entry = DirEntry {names + it->offset, it->length, it->type};
+    return true;
+}
+
+namespace {
 
 #ifdef _WIN32
 
-    // Convert path to UTF-16
-    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
-    std::wstring widePath = converter.from_bytes(path);
+/**
+ * Returns true if a name of the given length is "." or "..".
+ */
+bool isDotOrDotDot(const wchar_t* p, size_t length) {
+    return (length == 1 && p[0] == L'.') ||
+           (length == 2 && p[0] == L'.' && p[1] == L'.');
+}
 
-    // We need "*.*" at the end of the path to list everything (even file names
-    // that don't have a dot in them). Oh the insanity!
-    widePath.append(L"\\*.*");
+/**
+ * Lists the files in a directory. Returns false if the directory could not be
+ * opened or read, or if it isn't a directory.
+ *
+ * The directory is read through a handle, many entries per call. Unlike on
+ * Posix, it can't be opened relative to its parent without going through
+ * NtCreateFile, so it is always opened by its full path.
+ */
+bool dirEntries(const std::string& path, DirEntries& entries) {
 
-    WIN32_FIND_DATAW entry;
+    entries.clear();
 
-    HANDLE h = FindFirstFileExW(
+    // Convert path to UTF-16
+    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
+    std::wstring widePath = converter.from_bytes(path.empty() ? "." : path);
+
+    HANDLE h = CreateFileW(
             widePath.c_str(),
-            FindExInfoBasic, // Don't need the alternate name
-            &entry, // Find data
-            FindExSearchNameMatch, // Do not filter
-            NULL, // Search filter. Always NULL.
-            FIND_FIRST_EX_LARGE_FETCH // Try to increase performance
+            FILE_LIST_DIRECTORY,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            NULL,
+            OPEN_EXISTING,
+            FILE_FLAG_BACKUP_SEMANTICS, // Needed to open directories
+            NULL
             );
 
     if (h == INVALID_HANDLE_VALUE)
-        return entries;
+        return false;
+
+    // Files can be opened this way too, but they don't exist as directories.
+    BY_HANDLE_FILE_INFORMATION attrs;
+    if (!GetFileInformationByHandle(h, &attrs) ||
+            !(attrs.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+        CloseHandle(h);
+        return false;
+    }
 
-    do {
-        if (isDotOrDotDot(entry.cFileName)) continue;
+    // Must be suitably aligned for FILE_FULL_DIR_INFO.
+    uint64_t buf[1 << 13];
+
+    // A UTF-16 code unit takes at most 3 bytes in UTF-8.
+    char name[MAX_PATH * 3 + 1];
+
+    while (GetFileInformationByHandleEx(h, FileFullDirectoryInfo, buf,
+                sizeof(buf))) {
+
+        const char* p = (const char*)buf;
+
+        for (;;) {
+            const FILE_FULL_DIR_INFO* info = (const FILE_FULL_DIR_INFO*)p;
+            const size_t length = info->FileNameLength / sizeof(WCHAR);
+
+            if (!isDotOrDotDot(info->FileName, length)) {
+                const int n = WideCharToMultiByte(CP_UTF8, 0, info->FileName,
+                        (int)length, name, sizeof(name), NULL, NULL);
+
+                // In Windows, if it's not a directory, then it must be a
+                // file.
+                if (n > 0) {
+                    entries.add(name, (size_t)n,
+                        (info->FileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+                            ? DirEntry::dir : DirEntry::file
+                        );
+                }
+            }
+
+            if (info->NextEntryOffset == 0)
+                break;
+
+            p += info->NextEntryOffset;
+        }
+    }
+
+    // Anything other than reaching the end leaves the listing incomplete, and
+    // it must not be used as if it were complete.
+    const bool complete = GetLastError() == ERROR_NO_MORE_FILES;
+
+    CloseHandle(h);
 
-        entries.push_back(DirEntry {
-                converter.to_bytes(entry.cFileName),
-                (entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-                    == FILE_ATTRIBUTE_DIRECTORY
-                });
+    if (!complete) {
+        entries.clear();
+        return false;
+    }
 
-    } while (FindNextFileW(h, &entry));
+    // Sort the entries. The order in which directories are listed is not
+    // guaranteed to be deterministic.
+    entries.sort();
 
-    FindClose(h);
+    return true;
+}
 
 #else // _WIN32
 
-    DIR* dir = opendir(path.length() > 0 ? path.c_str() : ".");
-    if (!dir) return entries; // TODO: Throw exception instead
+/**
+ * Returns true if a NULL-terminated path is "." or "..".
+ */
+bool isDotOrDotDot(const char* p) {
+    return (*p++ == '.' && (*p == '\0' || (*p++ == '.' && *p == '\0')));
+}
+
+/**
+ * Returns the type of a directory entry. The file system is not required to
+ * provide the type, in which case we need to figure it out by using lstat.
+ */
+DirEntry::Type entryType(int fd, const char* name, unsigned char type) {
+    switch (type) {
+        case DT_REG:     return DirEntry::file;
+        case DT_DIR:     return DirEntry::dir;
+        case DT_UNKNOWN: break;
+        default:         return DirEntry::other;
+    }
 
-    struct dirent* entry;
     struct stat statbuf;
+    if (fstatat(fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0)
+        return DirEntry::other;
 
-    while ((entry = readdir(dir))) {
-        if (isDotOrDotDot(entry->d_name)) continue;
+    switch (statbuf.st_mode & S_IFMT) {
+        case S_IFREG: return DirEntry::file;
+        case S_IFDIR: return DirEntry::dir;
+    }
 
-        if (entry->d_type == DT_UNKNOWN) {
-            // Directory entry type is unknown. The file system is not required
-            // to provide this information. Thus, we need to figure it out by
-            // using stat.
-            if (fstatat(dirfd(dir), entry->d_name, &statbuf, 0) == 0) {
-                switch (statbuf.st_mode & S_IFMT) {
-                    case S_IFIFO:  entry->d_type = DT_FIFO; break;
-                    case S_IFCHR:  entry->d_type = DT_CHR;  break;
-                    case S_IFDIR:  entry->d_type = DT_DIR;  break;
-                    case S_IFBLK:  entry->d_type = DT_BLK;  break;
-                    case S_IFREG:  entry->d_type = DT_REG;  break;
-                    case S_IFLNK:  entry->d_type = DT_LNK;  break;
-                    case S_IFSOCK: entry->d_type = DT_SOCK; break;
-                }
-            }
+    return DirEntry::other;
+}
+
+/**
+ * Lists the files in an open directory. The file descriptor is left open.
+ */
+bool dirEntries(int fd, DirEntries& entries) {
+
+    entries.clear();
+
+#ifdef __linux__
+
+    // Read as many entries as fit in the buffer with each system call.
+    struct Dirent64 {
+        uint64_t       d_ino;
+        int64_t        d_off;
+        unsigned short d_reclen;
+        unsigned char  d_type;
+        char           d_name[256];
+    };
+
+    uint64_t buf[1 << 12];
+
+    for (;;) {
+        const long n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+        if (n < 0) return false;
+        if (n == 0) break;
+
+        for (long pos = 0; pos < n; ) {
+            const Dirent64* entry = (const Dirent64*)((const char*)buf + pos);
+            pos += entry->d_reclen;
+
+            if (isDotOrDotDot(entry->d_name)) continue;
+
+            entries.add(entry->d_name, strlen(entry->d_name),
+                    entryType(fd, entry->d_name, entry->d_type));
         }
+    }
 
-        entries.push_back(DirEntry { entry->d_name, entry->d_type == DT_DIR });
+#else // __linux__
+
+    // fdopendir takes ownership of the file descriptor.
+    const int dirFd = dup(fd);
+    if (dirFd < 0) return false;
+
+    DIR* dir = fdopendir(dirFd);
+    if (!dir) {
+        close(dirFd);
+        return false;
+    }
+
+    struct dirent* entry;
+
+    while ((entry = readdir(dir))) {
+        if (isDotOrDotDot(entry->d_name)) continue;
+
+        entries.add(entry->d_name, strlen(entry->d_name),
+                entryType(fd, entry->d_name, entry->d_type));
     }
 
     closedir(dir);
 
-#endif // !_WIN32
+#endif // !__linux__
 
     // Sort the entries. The order in which directories are listed is not
     // guaranteed to be deterministic.
-    std::sort(entries.begin(), entries.end());
+    entries.sort();
 
-    return entries;
+    return true;
+}
+
+/**
+ * Opens a directory for listing. The path is relative to the given directory
+ * or, if that is AT_FDCWD, to the working directory. Returns -1 on failure.
+ */
+int openDir(int dirFd, const char* path) {
+    int fd;
+
+    do {
+        fd = openat(dirFd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    } while (fd < 0 && errno == EINTR);
+
+    return fd;
+}
+
+/**
+ * Returns true if the normalized path is inside the normalized base directory
+ * and, if so, where the part relative to the base begins.
+ */
+bool relativeTo(const std::string& base, const std::string& path,
+        size_t& offset) {
+
+    // All relative paths are inside the working directory.
+    if (base == ".") {
+        offset = 0;
+        return !Path(path).isabs();
+    }
+
+    if (path.size() <= base.size() ||
+            path.compare(0, base.size(), base) != 0)
+        return false;
+
+    // The root already ends with a path separator.
+    if (Path::isSep(base.back())) {
+        offset = base.size();
+        return true;
+    }
+
+    offset = base.size() + 1;
+    return Path::isSep(path[base.size()]);
+}
+
+#endif // !_WIN32
+
+/**
+ * Reports a directory to the parent build system. The checksum covers the
+ * names in the sorted listing, each followed by a NUL byte, as described for
+ * Dependency::checksum.
+ */
+void reportDir(ImplicitDeps* deps, const std::string& path, bool exists,
+        const DirEntries& entries) {
+
+    if (!deps || !deps->enabled()) return;
+
+    if (!exists) {
+        // Let the parent figure it out.
+        deps->addInput(path.data(), path.length());
+        return;
+    }
+
+    // The names are already laid out that way.
+    const std::string& names = entries.names();
+
+    uint8_t checksum[Sha256::digestLength];
+    Sha256::hash(names.data(), names.size(), checksum);
+
+    deps->addInput(path.data(), path.length(), 3, checksum);
 }
 
 enum class PathType {
@@ -185,6 +532,69 @@ PathType pathType(const Path root, const Path path) {
     return pathType(buf);
 }
 
+/**
+ * Returns the same type as pathType() would for a directory entry.
+ */
+PathType entryPathType(const DirEntry& entry) {
+    switch (entry.type) {
+        case DirEntry::file: return PathType::file;
+        case DirEntry::dir:  return PathType::dir;
+        default:             return PathType::unknown;
+    }
+}
+
+/**
+ * Returns true if the path exists. Unlike pathType(), symbolic links are
+ * followed.
+ */
+bool exists(const Path root, const Path path) {
+    std::string buf(root.path, root.length);
+    path.join(buf);
+
+#ifdef _WIN32
+    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
+    return GetFileAttributesW(converter.from_bytes(buf).c_str()) !=
+        INVALID_FILE_ATTRIBUTES;
+#else
+    struct stat statbuf;
+    return stat(buf.c_str(), &statbuf) == 0;
+#endif
+}
+
+/**
+ * Hashes a path for the directory index (FNV-1a). If the case is folded, paths
+ * that only differ in case get the same hash.
+ */
+uint64_t hashPath(const char* p, size_t length, bool foldCase) {
+    uint64_t h = 14695981039346656037ULL;
+
+    if (foldCase) {
+        for (size_t i = 0; i < length; ++i) {
+            h ^= (unsigned char)WinPath::fold(p[i]);
+            h *= 1099511628211ULL;
+        }
+    }
+    else {
+        for (size_t i = 0; i < length; ++i) {
+            h ^= (unsigned char)p[i];
+            h *= 1099511628211ULL;
+        }
+    }
+
+    return h;
+}
+
+/**
+ * Returns true if two paths are the same key in the directory index.
+ */
+inline bool samePath(const std::string& a, const std::string& b,
+        bool foldCase) {
+    if (!foldCase)
+        return a == b;
+
+    return a.size() == b.size() && WinPath::equal(a.data(), b.data(), a.size());
+}
+
 /**
  * Returns true if the given string contains a glob pattern.
  */
@@ -201,6 +611,28 @@ inline bool isGlobPattern(const Path& p) {
     return false;
 }
 
+/**
+ * Appends a string to a glob cache key, prefixed by its length.
+ */
+void appendKey(std::string& key, const char* s, size_t length) {
+    key.append((const char*)&length, sizeof(length));
+    key.append(s, length);
+}
+
+/**
+ * Returns true if any component of the path is "..".
+ */
+bool hasDotDot(const std::string& path) {
+    for (size_t i = 0; i + 1 < path.size(); ++i) {
+        if (path[i] == '.' && path[i+1] == '.' &&
+                (i == 0 || Path::isSep(path[i-1])) &&
+                (i + 2 == path.size() || Path::isSep(path[i+2])))
+            return true;
+    }
+
+    return false;
+}
+
 /**
  * Returns true if the given path element is a recursive glob pattern.
  */
@@ -210,13 +642,126 @@ inline bool isRecursiveGlob(const Path& p) {
 
 }
 
-DirCache::DirCache(ImplicitDeps* deps)
-        : _deps(deps) {
+DirCache::DirCache(ImplicitDeps* deps, bool foldCase)
+        : _deps(deps), _foldCase(foldCase), _persistent(false), _startTime(0),
+          _watcher(NULL), _session(0), _dead(0), _maxOpenDirs(0),
+          _openDirs(0) {
+
+#ifndef _WIN32
+    // Leave most file descriptors for everything else.
+    _maxOpenDirs = 256;
+
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+            limit.rlim_cur != RLIM_INFINITY &&
+            limit.rlim_cur / 4 < (rlim_t)_maxOpenDirs)
+        _maxOpenDirs = (int)(limit.rlim_cur / 4);
+#endif
 }
 
 DirCache::~DirCache() {
 }
 
+bool DirCache::load(const char* path) {
+    _persistent = true;
+    _startTime = (uint64_t)time(NULL);
+
+    _file.reset(new DirCacheFile());
+
+    if (!_file->open(path)) {
+        _file.reset();
+        return false;
+    }
+
+    return true;
+}
+
+bool DirCache::save(const char* path) {
+    // The new file may replace the one that is mapped.
+    _file.reset();
+
+    std::vector<DirRecord> records;
+
+    for (auto&& shard: _shards) {
+        for (auto&& entry: shard.entries) {
+
+            // Changes made right after listing a directory might not have
+            // changed its stamp. It's not safe to reuse these.
+            if (entry.dead || !entry.hasStamp ||
+                    entry.stamp.isRacy(_startTime))
+                continue;
+
+            records.push_back(DirRecord {&entry.path, &entry.stamp, &entry.entries});
+        }
+    }
+
+    return DirCacheFile::write(path, records);
+}
+
+void DirCache::watch(DirWatcher* watcher) {
+    _watcher = watcher;
+}
+
+void DirCache::drop(const std::string& path) {
+    std::string buf;
+    const bool isNorm = Path(path).isNorm();
+    if (!isNorm)
+        Path(path).norm(buf);
+
+    const std::string& key = isNorm ? path : buf;
+    const uint64_t hash = hashPath(key.data(), key.size(), _foldCase);
+
+    Shard& shard = _shards[(hash >> 32) % shardCount];
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (Entry* entry = shard.remove(hash, key, _foldCase)) {
+        entry->dead = true;
+        ++_dead;
+    }
+}
+
+bool DirCache::refresh(ImplicitDeps* deps) {
+    std::vector<std::string> changed;
+
+    if (_watcher && !_watcher->changes(changed))
+        return false;
+
+    for (auto&& path: changed)
+        drop(path);
+
+    // Without a watch, there's no telling if the directory has changed. A
+    // directory that didn't exist might have been created without its parent
+    // being watched.
+    std::vector<const std::string*> unsure;
+
+    for (auto&& shard: _shards) {
+        for (auto&& entry: shard.entries) {
+            if (!entry.dead && (!entry.watched || !entry.exists))
+                unsure.push_back(&entry.path);
+        }
+    }
+
+    for (auto&& path: unsure)
+        drop(*path);
+
+    // Dropped entries take up memory until the whole cache is thrown away.
+    // Don't let them outnumber the rest.
+    size_t total = 0;
+    for (auto&& shard: _shards)
+        total += shard.entries.size();
+
+    if (_dead > 1024 && _dead > total - _dead)
+        return false;
+
+    _deps = deps;
+    ++_session;
+
+    std::lock_guard<std::mutex> lock(_globsMutex);
+    _globs.clear();
+
+    return true;
+}
+
 const DirEntries& DirCache::dirEntries(Path root, Path dir) {
     std::string buf(root.path, root.length);
     dir.join(buf);
@@ -224,133 +769,931 @@ const DirEntries& DirCache::dirEntries(Path root, Path dir) {
 }
 
 const DirEntries& DirCache::dirEntries(const std::string& path) {
+    return listedEntry(path, NULL, NULL).entries;
+}
 
-    auto normalized = Path(path).norm();
+/**
+ * A directory that is held open so that the directories below it can be
+ * opened relative to it. The kernel then doesn't need to resolve the full path
+ * every time.
+ */
+struct DirCache::OpenDir {
+    DirCache* cache;
+    int fd;
+    const std::string* path; // Normalized path of the directory.
+
+    OpenDir(DirCache* cache, int fd, const std::string* path)
+        : cache(cache), fd(fd), path(path) {}
+
+    ~OpenDir() {
+#ifndef _WIN32
+        close(fd);
+        --cache->_openDirs;
+#endif
+    }
+};
 
-    std::lock_guard<std::mutex> lock(_mutex);
+const DirCache::Entry& DirCache::listedEntry(const std::string& path,
+        const OpenDir* base, OpenDirPtr* opened) {
 
-    // Did we already do the work?
-    const auto it = _cache.find(normalized);
-    if (it != _cache.end())
-        return it->second;
+    // Avoid a copy if the path is already normalized.
+    std::string buf;
+    const bool isNorm = Path(path).isNorm();
+    if (!isNorm)
+        Path(path).norm(buf);
 
-    if (_deps) _deps->addInput(normalized.data(), normalized.length());
+    const std::string& key = isNorm ? path : buf;
+    const uint64_t hash = hashPath(key.data(), key.size(), _foldCase);
 
-    // List the directories, cache it, and return the cached list.
-    return _cache.insert(
-            std::pair<std::string, DirEntries>(normalized, ::dirEntries(normalized))
-            ).first->second;
-}
+    // The low bits are used for the index within the shard.
+    Shard& shard = _shards[(hash >> 32) % shardCount];
+
+    Entry* entry;
+
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        entry = &shard.get(hash, key, _foldCase);
+    }
 
-void DirCache::glob(Path root, Path path, MatchCallback callback, ThreadPool* pool) {
+    // List the directory if nobody has done it yet.
+    bool listed = false;
 
-    bool onlyMatchDirs = path.basename().length == 0;
+    std::call_once(entry->listed, [&] {
+        list(*entry, base, opened);
+        entry->ready.store(true, std::memory_order_release);
+        listed = true;
+    });
+
+    // A listing kept from a previous run is reported again, once.
+    if (!listed &&
+            entry->reported.load(std::memory_order_relaxed) != _session &&
+            entry->reported.exchange(_session) != _session)
+        reportDir(_deps, entry->path, entry->exists, entry->entries);
+
+    profile::count(listed ? profile::dirCacheMisses : profile::dirCacheHits);
+
+    return *entry;
+}
 
-    auto components = path.components();
+const DirCache::Entry* DirCache::findListed(const std::string& path) {
 
     std::string buf;
+    const bool isNorm = Path(path).isNorm();
+    if (!isNorm)
+        Path(path).norm(buf);
 
-    globImpl(root, buf, components, 0, onlyMatchDirs, callback, pool);
+    const std::string& key = isNorm ? path : buf;
+    const uint64_t hash = hashPath(key.data(), key.size(), _foldCase);
 
-    if (pool) pool->waitAll();
+    Shard& shard = _shards[(hash >> 32) % shardCount];
+
+    Entry* entry;
+
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        entry = shard.find(hash, key, _foldCase);
+    }
+
+    if (entry && entry->ready.load(std::memory_order_acquire) &&
+            entry->reported.load(std::memory_order_relaxed) == _session) {
+        profile::count(profile::dirCacheHits);
+        return entry;
+    }
+
+    return NULL;
 }
 
-void DirCache::globImpl(Path root, std::string& path,
-        const std::vector<Path>& components, size_t index,
-        bool matchDirs, MatchCallback callback, ThreadPool* pool) {
+void DirCache::list(Entry& entry, const OpenDir* base, OpenDirPtr* opened) {
 
-    if (index >= components.size()) return;
+    const std::string& path = entry.path;
 
-    const Path& pattern = components[index];
+    profile::Span span(profile::readdir, path.data(), path.size());
 
-    // We only want to use the callback if this is the last thing to match.
-    const bool lastOne = index == components.size()-1;
+    entry.reported.store(_session, std::memory_order_relaxed);
 
-    const size_t pathLength = path.size();
+    // The watch must come first so that no change after the listing is
+    // missed.
+    if (_watcher)
+        entry.watched = _watcher->watch(path);
+
+#ifdef _WIN32
+
+    (void)base;
+    (void)opened;
+
+    if (_persistent) {
+        // Note that the stamp must be taken before listing. If the directory
+        // changes while being listed, the stamp won't match next time.
+        entry.hasStamp = DirStamp::get(path, entry.stamp);
+
+        if (entry.hasStamp && _file &&
+                _file->find(path, entry.stamp, entry.entries)) {
+            entry.exists = true;
+            reportDir(_deps, path, true, entry.entries);
+            return;
+        }
+    }
+
+    entry.exists = ::dirEntries(path, entry.entries);
+    profile::count(profile::dirsListed);
+    reportDir(_deps, path, entry.exists, entry.entries);
+
+#else // _WIN32
+
+    size_t offset;
+
+    const int fd = (base && relativeTo(*base->path, path, offset))
+        ? openDir(base->fd, path.c_str() + offset)
+        : openDir(AT_FDCWD, path.c_str());
+
+    bool exists = fd >= 0;
+
+    // The stamp comes from the same file descriptor that is listed. Note that
+    // it must be taken before listing. If the directory changes while being
+    // listed, the stamp won't match next time.
+    if (_persistent && exists)
+        entry.hasStamp = DirStamp::get(fd, entry.stamp);
+
+    if (entry.hasStamp && _file &&
+            _file->find(path, entry.stamp, entry.entries)) {
+        reportDir(_deps, path, true, entry.entries);
+    }
+    else {
+        exists = exists && ::dirEntries(fd, entry.entries);
+        profile::count(profile::dirsListed);
+        reportDir(_deps, path, exists, entry.entries);
+    }
+
+    entry.exists = exists;
+
+    if (fd < 0)
+        return;
+
+    // Keep the directory open for whoever lists the directories below it, but
+    // not so many that we run out of file descriptors.
+    if (opened && ++_openDirs <= _maxOpenDirs) {
+        opened->reset(new OpenDir(this, fd, &path));
+    }
+    else {
+        if (opened) --_openDirs;
+        close(fd);
+    }
+
+#endif // !_WIN32
+}
+
+DirCache::Entry* DirCache::Shard::find(uint64_t hash, const std::string& path,
+        bool foldCase) {
+
+    if (index.empty())
+        return NULL;
+
+    const size_t mask = index.size() - 1;
+
+    for (size_t i = (size_t)hash & mask; index[i].entry; i = (i + 1) & mask) {
+        if (index[i].hash == hash &&
+                samePath(index[i].entry->path, path, foldCase))
+            return index[i].entry;
+    }
+
+    return NULL;
+}
+
+DirCache::Entry& DirCache::Shard::get(uint64_t hash, const std::string& path,
+        bool foldCase) {
+
+    if (Entry* entry = find(hash, path, foldCase))
+        return *entry;
+
+    size_t mask = index.size() - 1;
+
+    // Not found. Grow the index if it would be more than 3/4 full.
+    if ((entries.size() + 1) * 4 > index.size() * 3) {
+        std::vector<Slot> bigger(index.empty() ? 16 : index.size() * 2,
+                Slot {0, NULL});
+        mask = bigger.size() - 1;
+
+        for (auto&& slot: index) {
+            if (!slot.entry) continue;
+
+            size_t i = (size_t)slot.hash & mask;
+            while (bigger[i].entry)
+                i = (i + 1) & mask;
+
+            bigger[i] = slot;
+        }
+
+        index.swap(bigger);
+    }
+
+    entries.emplace_back(path);
+    Entry* entry = &entries.back();
 
-    if (isRecursiveGlob(pattern)) {
-        // A recursive glob can match 0 or more directories. Lets assume here it
-        // will match 0 directories. Note that this will cause the same
-        // directory to be listed twice. This should be okay since we are
-        // caching directory listing results.
-        queueGlob(root, path, components, index+1, matchDirs, callback, pool);
-
-        // We also want to continue on here attempting to match more than 0
-        // directories.
-        for (auto&& entry: dirEntries(root, path)) {
-
-            Path(entry.name).join(path);
-
-            if (lastOne && entry.isDir == matchDirs) {
-                // Note that "**" matches all files recursively and "**/"
-                // matches all directories recursively. Thus, we yield this
-                // path if this is the last pattern in the list and we've found
-                // the type of entry we're looking for.
-                callback(path);
+    size_t i = (size_t)hash & mask;
+    while (index[i].entry)
+        i = (i + 1) & mask;
+
+    index[i] = Slot {hash, entry};
+
+    return *entry;
+}
+
+DirCache::Entry* DirCache::Shard::remove(uint64_t hash, const std::string& path,
+        bool foldCase) {
+
+    if (index.empty())
+        return NULL;
+
+    const size_t mask = index.size() - 1;
+
+    size_t i = (size_t)hash & mask;
+    for (; index[i].entry; i = (i + 1) & mask) {
+        if (index[i].hash == hash &&
+                samePath(index[i].entry->path, path, foldCase))
+            break;
+    }
+
+    Entry* entry = index[i].entry;
+    if (!entry)
+        return NULL;
+
+    // Shift back any entries after it that would no longer be found. This
+    // keeps every probe sequence free of holes.
+    for (size_t j = (i + 1) & mask; index[j].entry; j = (j + 1) & mask) {
+        const size_t home = (size_t)index[j].hash & mask;
+
+        // The entry at j can move to i if i lies between its home slot and j,
+        // going around the end.
+        const bool movable = (i <= j) ? (home <= i || home > j)
+                                      : (home <= i && home > j);
+        if (movable) {
+            index[i] = index[j];
+            i = j;
+        }
+    }
+
+    index[i] = Slot {0, NULL};
+    return entry;
+}
+
+/**
+ * A glob expression split up into its components.
+ */
+struct DirCache::CompiledGlob {
+    enum class Kind : uint8_t {
+        literal,   // Matches exactly one name. Doesn't need a listing.
+        pattern,   // Matches names in a listing.
+        recursive, // "**". Matches 0 or more directories.
+    };
+
+    std::vector<Path> components;
+    std::vector<Kind> kinds;
+
+    // Compiled patterns. Only used for pattern components.
+    std::vector<GlobPattern<Path>> patterns;
+
+    bool matchDirs; // Only match directories?
+    bool exclude;   // Remove matches instead of adding them?
+
+    // One past the last ".." component, or 0 if there is none.
+    uint32_t dotDotEnd;
+
+    // One past the last "." or ".." component, or 0 if there is none. Paths
+    // matched through these aren't below the directory they are matched from
+    // as far as "**" is concerned.
+    uint32_t dotEnd;
+};
+
+/**
+ * Matched paths, with one list per worker thread so that adding to them
+ * doesn't need a lock. The last list is for threads outside of the pool.
+ */
+struct DirCache::GlobResults {
+    ThreadPool* pool;
+
+    std::vector<std::vector<std::string>> lists;
+
+    // Guards the last list.
+    std::mutex mutex;
+
+    GlobResults(ThreadPool* pool)
+        : pool(pool), lists(pool ? pool->size() + 1 : 1) {}
+
+    void add(const std::string& path) {
+        const size_t i = pool ? pool->currentWorker() : 0;
+
+        if (i + 1 < lists.size()) {
+            lists[i].push_back(path);
+        }
+        else {
+            std::lock_guard<std::mutex> lock(mutex);
+            lists.back().push_back(path);
+        }
+    }
+};
+
+namespace {
+
+/**
+ * Calls f(i) for every i in [0, n), on the thread pool if there is one.
+ */
+template<class F>
+void parallelFor(ThreadPool* pool, size_t n, const F& f) {
+    if (!pool || n < 2) {
+        for (size_t i = 0; i < n; ++i)
+            f(i);
+        return;
+    }
+
+    TaskGroup group(*pool);
+
+    for (size_t i = 0; i < n; ++i)
+        group.run([&f, i] { f(i); });
+
+    group.wait();
+}
+
+/**
+ * Merges the lists into a single sorted list without any duplicates. The lists
+ * are sorted on their own first and then merged pairwise.
+ */
+std::vector<std::string> sortUnique(
+        std::vector<std::vector<std::string>>& lists, ThreadPool* pool) {
+
+    lists.erase(std::remove_if(lists.begin(), lists.end(),
+                [] (const std::vector<std::string>& v) { return v.empty(); }),
+            lists.end());
+
+    if (lists.empty())
+        return std::vector<std::string>();
+
+    parallelFor(pool, lists.size(), [&] (size_t i) {
+        std::sort(lists[i].begin(), lists[i].end());
+    });
+
+    while (lists.size() > 1) {
+        std::vector<std::vector<std::string>> merged((lists.size() + 1) / 2);
+
+        parallelFor(pool, merged.size(), [&] (size_t i) {
+            std::vector<std::string>& a = lists[2*i];
+
+            if (2*i + 1 == lists.size()) {
+                merged[i].swap(a);
+                return;
             }
 
-            if (entry.isDir) {
-                // We can match 0 or more directories. Go deeper!
-                queueGlob(root, path, components, index, matchDirs, callback,
-                        pool);
+            std::vector<std::string>& b = lists[2*i + 1];
+
+            merged[i].reserve(a.size() + b.size());
+            std::merge(std::make_move_iterator(a.begin()),
+                       std::make_move_iterator(a.end()),
+                       std::make_move_iterator(b.begin()),
+                       std::make_move_iterator(b.end()),
+                       std::back_inserter(merged[i]));
+        });
+
+        lists.swap(merged);
+    }
+
+    std::vector<std::string>& result = lists.front();
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return std::move(result);
+}
+
+/**
+ * Orders names the same way as directory listings are sorted.
+ */
+int compareNames(const Path& a, const Path& b) {
+    const int c = memcmp(a.path, b.path, std::min(a.length, b.length));
+    if (c != 0) return c;
+    return a.length < b.length ? -1 : (a.length > b.length ? 1 : 0);
+}
+
+}
+
+DirCache::GlobResult DirCache::glob(Path root,
+        const std::vector<GlobExpr>& exprs, ThreadPool* pool) {
+
+    // The order of the expressions matters, so they are all part of the key
+    // in the order given. Lengths are included so that no two different sets
+    // of expressions can have the same key.
+    std::string key;
+    appendKey(key, root.path, root.length);
+
+    for (auto&& e: exprs) {
+        key.push_back(e.exclude ? '!' : '+');
+        appendKey(key, e.pattern.path, e.pattern.length);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_globsMutex);
+        auto it = _globs.find(key);
+        if (it != _globs.end()) {
+            profile::count(profile::globCacheHits);
+            return it->second;
+        }
+    }
+
+    // If the same glob is done by another thread in the meantime, both walks
+    // get the same results. Only the first one is kept.
+    GlobResult result = std::make_shared<const std::vector<std::string>>(
+            globWalk(root, exprs, pool));
+
+    std::lock_guard<std::mutex> lock(_globsMutex);
+    return _globs.emplace(std::move(key), std::move(result)).first->second;
+}
+
+std::vector<std::string> DirCache::globWalk(Path root,
+        const std::vector<GlobExpr>& exprs, ThreadPool* pool) {
+
+    std::vector<CompiledGlob> globs(exprs.size());
+
+    // Where to start in each expression.
+    std::vector<GlobState> states;
+
+    for (size_t i = 0; i < exprs.size(); ++i) {
+        CompiledGlob& g = globs[i];
+
+        g.components = exprs[i].pattern.components();
+        g.matchDirs = exprs[i].pattern.basename().length == 0;
+        g.exclude = exprs[i].exclude;
+
+        // Compile the patterns up front so that they don't need to be parsed
+        // again for every directory entry.
+        g.kinds.resize(g.components.size());
+        g.patterns.resize(g.components.size());
+
+        g.dotDotEnd = 0;
+        g.dotEnd = 0;
+
+        for (size_t j = 0; j < g.components.size(); ++j) {
+            const Path& c = g.components[j];
+
+            if (c.isDotDot())
+                g.dotDotEnd = (uint32_t)j + 1;
+
+            if (c.isDot() || c.isDotDot())
+                g.dotEnd = (uint32_t)j + 1;
+
+            if (isRecursiveGlob(c))
+                g.kinds[j] = CompiledGlob::Kind::recursive;
+            else if (isGlobPattern(c)) {
+                g.kinds[j] = CompiledGlob::Kind::pattern;
+                g.patterns[j] = GlobPattern<Path>(c);
             }
+            else
+                g.kinds[j] = CompiledGlob::Kind::literal;
+        }
 
-            path.resize(pathLength);
+        if (!g.components.empty())
+            states.push_back(GlobState {(uint32_t)i, 0});
+    }
+
+    GlobResults results(pool);
+
+    {
+        std::unique_ptr<TaskGroup> group;
+        if (pool) group.reset(new TaskGroup(*pool));
+
+        const GlobContext ctx = {root, &globs, pool, group.get(), &results};
+
+        std::string buf;
+
+        if (!states.empty())
+            globImpl(ctx, buf, states, OpenDirPtr());
+
+        if (group) group->wait();
+    }
+
+    return sortUnique(results.lists, pool);
+}
+
+void DirCache::globImpl(const GlobContext& ctx, std::string& path,
+        std::vector<GlobState>& states, const OpenDirPtr& dir) {
+
+    typedef CompiledGlob::Kind Kind;
+
+    const std::vector<CompiledGlob>& globs = *ctx.globs;
+
+    // A recursive glob can match 0 directories, so whatever comes after it can
+    // also match in this directory. Note that a state added here may be
+    // another recursive glob.
+    for (size_t i = 0; i < states.size(); ++i) {
+        const GlobState s = states[i];
+        const CompiledGlob& g = globs[s.expr];
+
+        if (g.kinds[s.index] == Kind::recursive &&
+                s.index + 1 < g.components.size())
+            states.push_back(GlobState {s.expr, s.index + 1});
+    }
+
+    std::sort(states.begin(), states.end());
+    states.erase(std::unique(states.begin(), states.end()), states.end());
+
+    // An exclusion ending in "**" removes everything of its type below here.
+    // The expressions before it can't add any of that back, so they don't need
+    // to go any further, unless a "." or ".." is still ahead of them. This
+    // is tracked separately for expressions matching files and directories.
+    int64_t cutoff[2] = {-1, -1};
+
+    for (auto&& s: states) {
+        const CompiledGlob& g = globs[s.expr];
+
+        if (g.exclude && s.index + 1 == g.components.size() &&
+                g.kinds[s.index] == Kind::recursive)
+            cutoff[g.matchDirs] = std::max(cutoff[g.matchDirs],
+                    (int64_t)s.expr);
+    }
+
+    if (cutoff[0] >= 0 || cutoff[1] >= 0) {
+        states.erase(std::remove_if(states.begin(), states.end(),
+            [&] (const GlobState& s) {
+                const CompiledGlob& g = globs[s.expr];
+                return (int64_t)s.expr < cutoff[g.matchDirs] &&
+                       s.index >= g.dotEnd;
+            }), states.end());
+    }
+
+    // An exclusion only removes what expressions before it add. Without any,
+    // there is nothing for it to do. If nothing is left to add, nothing needs
+    // to be listed.
+    int64_t firstInclude[2] = {-1, -1};
+
+    for (auto&& s: states) {
+        const CompiledGlob& g = globs[s.expr];
+        if (!g.exclude && firstInclude[g.matchDirs] < 0)
+            firstInclude[g.matchDirs] = s.expr;
+    }
+
+    states.erase(std::remove_if(states.begin(), states.end(),
+        [&] (const GlobState& s) {
+            const CompiledGlob& g = globs[s.expr];
+            return g.exclude && (firstInclude[g.matchDirs] < 0 ||
+                                 (int64_t)s.expr < firstInclude[g.matchDirs]);
+        }), states.end());
+
+    if (states.empty())
+        return;
+
+    // Literal components don't need a directory listing. They are sorted by
+    // name so they can be paired up with any listed entry of the same name.
+    // This way, every path is only visited once.
+    std::vector<std::pair<Path, GlobState>> literals;
+
+    // States that need to be matched against every entry in the listing.
+    std::vector<GlobState> listed;
+
+    for (auto&& s: states) {
+        const CompiledGlob& g = globs[s.expr];
+
+        if (g.kinds[s.index] == Kind::literal)
+            literals.push_back(std::make_pair(g.components[s.index], s));
+        else
+            listed.push_back(s);
+    }
+
+    std::sort(literals.begin(), literals.end(),
+        [] (const std::pair<Path, GlobState>& a,
+            const std::pair<Path, GlobState>& b) {
+            const int c = compareNames(a.first, b.first);
+            return c < 0 || (c == 0 && a.second < b.second);
+        });
+
+    // Directories below this one are opened relative to it if it gets opened.
+    // Otherwise, they are opened relative to the same parent as this one.
+    OpenDirPtr opened;
+
+    static const DirEntries noEntries;
+    const DirEntries* entries = &noEntries;
+
+    // The listing of this directory, if there is one at hand without having to
+    // list it just for the literal names. These can be looked up in it
+    // instead of asking the file system about each of them. Since the listing
+    // was reported as a dependency either way, this doesn't add any.
+    const Entry* known = NULL;
+
+    {
+        std::string buf(ctx.root.path, ctx.root.length);
+        Path(path).join(buf);
+
+        if (!listed.empty()) {
+            known = &listedEntry(buf, dir.get(), &opened);
+            entries = &known->entries;
+        }
+        else if (!literals.empty()) {
+            known = findListed(buf);
         }
     }
-    else if (isGlobPattern(pattern)) {
-        for (auto&& entry: dirEntries(root, path)) {
-            const Path name = Path(entry.name);
 
-            if (!name.matches(pattern)) continue;
+    // Listings are made of normalized paths. If ".." was used to get here,
+    // the directory the file system would see can be a different one.
+    if (hasDotDot(path))
+        known = NULL;
 
-            name.join(path);
+    const OpenDirPtr& childDir = opened ? opened : dir;
+
+    const size_t pathLength = path.size();
+
+    // States for the child currently being visited.
+    std::vector<GlobState> next;
+
+    // Index of the last expression whose final component matched the child.
+    // The last matching expression decides whether the child is included.
+    int64_t last = -1;
+
+    auto lit = literals.begin();
+
+    // Applies all literal states for the given name.
+    auto matchLiterals = [&] (const Path& name) {
+
+        // Only plain names can be looked up in the listing. Anything else,
+        // like "..", is left to the file system.
+        const bool useListing = known && !name.isDot() && !name.isDotDot() &&
+                                !name.isabs();
+
+        // If the directory doesn't exist, neither does anything in it.
+        // Otherwise, a name that isn't in the listing is still checked with the
+        // file system in case it is spelled differently on a case-insensitive
+        // file system.
+        DirEntry entry;
+        const bool missing = useListing && !known->exists;
+        const bool found = useListing && known->exists &&
+            known->entries.find(name.path, name.length, entry);
+
+        PathType type = PathType::unknown;
+        bool haveType = false;
+
+        for (; lit != literals.end() && compareNames(lit->first, name) == 0;
+                ++lit) {
+            const GlobState& s = lit->second;
+            const CompiledGlob& g = globs[s.expr];
+
+            if (s.index + 1 == g.components.size()) {
+                // The explicitly named path must exist in order to be
+                // returned.
+                if (!haveType) {
+                    if (found)
+                        type = entryPathType(entry);
+                    else if (!missing)
+                        type = pathType(ctx.root, path);
+                    haveType = true;
+                }
 
-            if (lastOne) {
-                if (entry.isDir == matchDirs)
-                    callback(path);
+                if (( g.matchDirs && type == PathType::dir) ||
+                    (!g.matchDirs && type == PathType::file))
+                    last = std::max(last, (int64_t)s.expr);
             }
-            else if (entry.isDir) {
-                // It's a directory and it matched. Shift the pattern.
-                queueGlob(root, path, components, index+1, matchDirs, callback,
-                        pool);
+            else if (found || !useListing || s.index < g.dotDotEnd ||
+                     (!missing && exists(ctx.root, path))) {
+                // Assume it's a directory and go deeper. There's no point if
+                // it doesn't exist at all, unless a ".." later on goes back
+                // up.
+                next.push_back(GlobState {s.expr, s.index + 1});
+            }
+        }
+    };
+
+    // When spawning tasks, the last subdirectory to visit is held back and
+    // visited on this thread at the end. Until there are at least two, there
+    // is nothing to gain from another thread.
+    std::string heldPath;
+    std::vector<GlobState> heldStates;
+    bool held = false;
+
+    // Adds or removes the child and goes deeper if needed. The child must
+    // already be joined to the path.
+    auto visit = [&] () {
+        if (last >= 0 && !globs[(size_t)last].exclude)
+            ctx.results->add(path);
+
+        if (!next.empty()) {
+            if (!ctx.group)
+                globImpl(ctx, path, next, childDir);
+            else {
+                if (held)
+                    queueGlob(ctx, heldPath, heldStates, childDir);
+
+                heldPath = path;
+                heldStates.swap(next);
+                held = true;
+            }
+        }
+
+        path.resize(pathLength);
+    };
+
+    // Visits literally named paths that come before the given name.
+    auto visitLiterals = [&] (const Path* before) {
+        while (lit != literals.end() &&
+                (!before || compareNames(lit->first, *before) < 0)) {
+            next.clear();
+            last = -1;
+
+            const Path name = lit->first;
+            name.join(path);
+            matchLiterals(name);
+            visit();
+        }
+    };
+
+    auto visitEntry = [&] (const DirEntry& entry) {
+        const Path name(entry.name, entry.length);
+
+        visitLiterals(&name);
+
+        next.clear();
+        last = -1;
+
+        for (auto&& s: listed) {
+            const CompiledGlob& g = globs[s.expr];
+
+            // We only want to match if this is the last component.
+            const bool lastOne = s.index + 1 == g.components.size();
+
+            switch (g.kinds[s.index]) {
+                case Kind::recursive:
+                    // Note that "**" matches all files recursively and "**/"
+                    // matches all directories recursively.
+                    if (lastOne && entry.isDir() == g.matchDirs)
+                        last = std::max(last, (int64_t)s.expr);
+
+                    // We can match 0 or more directories. Go deeper!
+                    if (entry.isDir())
+                        next.push_back(s);
+                    break;
+
+                case Kind::pattern:
+                    if (!g.patterns[s.index].matches(name))
+                        break;
+
+                    if (lastOne) {
+                        if (entry.isDir() == g.matchDirs)
+                            last = std::max(last, (int64_t)s.expr);
+                    }
+                    else if (entry.isDir()) {
+                        // It's a directory and it matched. Shift the pattern.
+                        next.push_back(GlobState {s.expr, s.index + 1});
+                    }
+                    break;
+
+                case Kind::literal:
+                    break;
             }
+        }
 
+        name.join(path);
+
+        // Literal states that name this entry.
+        matchLiterals(name);
+
+        if (next.empty() && last < 0) {
             path.resize(pathLength);
+            return;
         }
+
+        visit();
+    };
+
+    // In a large listing, only the entries that can match need to be looked
+    // at. Literal names are still visited in order either way.
+    std::vector<uint32_t> positions;
+
+    if (narrowListing(globs, listed, *entries, positions)) {
+        for (uint32_t i: positions)
+            visitEntry((*entries)[i]);
     }
     else {
-        Path(pattern).join(path);
-
-        if (lastOne) {
-            // The explicitly named path must exist in order to be returned.
-            PathType type = pathType(root, path);
-            if (( matchDirs && type == PathType::dir) ||
-                (!matchDirs && type == PathType::file)) {
-                callback(path);
+        for (auto&& entry: *entries)
+            visitEntry(entry);
+    }
+
+    visitLiterals(NULL);
+
+    if (held)
+        globImpl(ctx, heldPath, heldStates, childDir);
+}
+
+bool DirCache::narrowListing(const std::vector<CompiledGlob>& globs,
+        const std::vector<GlobState>& listed, const DirEntries& entries,
+        std::vector<uint32_t>& positions) {
+
+    typedef CompiledGlob::Kind Kind;
+
+    if (!entries.indexed())
+        return false;
+
+    for (auto&& s: listed) {
+        const CompiledGlob& g = globs[s.expr];
+
+        // A recursive glob goes into every directory.
+        if (g.kinds[s.index] != Kind::pattern)
+            return false;
+
+        const GlobPattern<Path>& pattern = g.patterns[s.index];
+
+        // If the characters every match ends with include a '.', every match
+        // has the extension that starts there.
+        const char* suffix;
+        const size_t suffixLength = pattern.suffix(suffix);
+        const Path ext = extension(suffix, suffixLength);
+
+        const uint32_t* extBegin = NULL;
+        const uint32_t* extEnd = NULL;
+
+        if (ext.length > 0)
+            entries.withExtension(ext.path, ext.length, extBegin, extEnd);
+
+        // Entries are sorted byte by byte, so if case doesn't matter, only the
+        // part of the prefix before the first letter can be looked up.
+        const char* prefix;
+        size_t prefixLength = pattern.prefix(prefix);
+
+        if (!Path::caseSensitive) {
+            for (size_t i = 0; i < prefixLength; ++i) {
+                if (isAsciiLetter(prefix[i])) {
+                    prefixLength = i;
+                    break;
+                }
             }
         }
+
+        if (ext.length == 0 && prefixLength == 0)
+            return false;
+
+        size_t prefixBegin = 0, prefixEnd = entries.size();
+
+        if (prefixLength > 0)
+            entries.withPrefix(prefix, prefixLength, prefixBegin, prefixEnd);
+
+        if (ext.length > 0 &&
+                (size_t)(extEnd - extBegin) <= prefixEnd - prefixBegin) {
+            positions.insert(positions.end(), extBegin, extEnd);
+        }
         else {
-            // Assume it's a directory and go deeper
-            queueGlob(root, path, components, index+1, matchDirs, callback,
-                    pool);
+            for (size_t i = prefixBegin; i < prefixEnd; ++i)
+                positions.push_back((uint32_t)i);
         }
 
-        path.resize(pathLength);
+        // Not worth it if most of the listing is left anyway.
+        if (positions.size() > entries.size() / 2)
+            return false;
+    }
+
+    if (listed.size() > 1) {
+        std::sort(positions.begin(), positions.end());
+        positions.erase(std::unique(positions.begin(), positions.end()),
+                positions.end());
     }
+
+    return true;
 }
 
-void DirCache::queueGlob(Path root, std::string& path,
-        const std::vector<Path>& components, size_t index,
-        bool matchDirs, MatchCallback callback,
-        ThreadPool* pool) {
-    if (pool) {
-        pool->enqueueTask([this, root, path, &components, index, matchDirs, callback, pool] {
-                globImpl(root, (std::string&)path, components, index, matchDirs,
-                        callback, pool);
-                });
+bool DirCache::worthSpawning(const GlobContext& ctx, const std::string& path) {
+
+    // Rather than a fixed limit on the depth, this limits the number of tasks
+    // waiting to run. Idle workers only need a couple each to steal from.
+    static const size_t queuedPerWorker = 2;
+
+    if (ctx.pool->queued() >= ctx.pool->size() * queuedPerWorker)
+        return false;
+
+    // All that is left of a small directory without subdirectories is to
+    // match its names, which is quicker than queuing a task.
+    static const size_t smallDir = 256;
+
+    if (!hasDotDot(path)) {
+        std::string buf(ctx.root.path, ctx.root.length);
+        Path(path).join(buf);
+
+        const Entry* entry = findListed(buf);
+        if (entry && entry->entries.dirs() == 0 &&
+                entry->entries.size() <= smallDir)
+            return false;
+    }
+
+    return true;
+}
+
+void DirCache::queueGlob(const GlobContext& ctx, std::string& path,
+        std::vector<GlobState>& states, const OpenDirPtr& dir) {
+    if (ctx.group && worthSpawning(ctx, path)) {
+        // Note that the context outlives all queued tasks since glob() waits
+        // for them to finish.
+        struct GlobTask {
+            DirCache* cache;
+            const GlobContext* ctx;
+            std::string path;
+            std::vector<GlobState> states;
+            OpenDirPtr dir;
+
+            void operator()() {
+                cache->globImpl(*ctx, path, states, dir);
+            }
+        };
+
+        ctx.group->run(GlobTask {this, &ctx, path, std::move(states), dir});
     }
     else {
-        globImpl(root, path, components, index, matchDirs, callback, pool);
+        globImpl(ctx, path, states, dir);
     }
 }
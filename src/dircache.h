@@ -9,47 +9,384 @@
  */
 #pragma once
 
-#include <map>
+#include <stdint.h>
+
+#include <deque>
 #include <string>
 #include <vector>
+#include <unordered_map>
+#include <atomic>
 #include <mutex>
-#include <functional>
+#include <memory>
 
 #include "path.h"
+#include "dircachefile.h"
 
 class ImplicitDeps;
 class ThreadPool;
+class TaskGroup;
+class DirWatcher;
 
+/**
+ * A single entry in a directory listing. The name points into the listing it
+ * came from.
+ */
 struct DirEntry {
-    std::string name;
-    bool isDir;
+    // Same as what lstat would say. Symbolic links are "other".
+    enum Type : uint8_t {
+        other,
+        file,
+        dir,
+    };
 
-    // Implement ordering for sorting purposes.
-    friend bool operator<(const DirEntry& a, const DirEntry& b);
+    const char* name; // NUL-terminated
+    size_t length;
+    Type type;
+
+    bool isDir() const {
+        return type == dir;
+    }
 };
 
-typedef std::vector<DirEntry> DirEntries;
+/**
+ * A directory listing.
+ *
+ * The names are packed back-to-back into a single buffer, each followed by a
+ * NUL byte, and are indexed by a flat array. A listing thus needs a couple of
+ * allocations instead of one per name, and scanning it touches contiguous
+ * memory.
+ */
+class DirEntries {
+private:
+    struct Item {
+        uint32_t offset; // Offset of the name in _names.
+        uint32_t length; // Length of the name.
+        DirEntry::Type type;
+    };
+
+    std::vector<Item> _items;
+    std::string _names;
+
+    // Number of entries that are directories.
+    size_t _dirs;
+
+    // For large listings, the positions of the entries ordered by extension
+    // and then by name. Empty otherwise.
+    std::vector<uint32_t> _byExt;
+
+public:
+    // Listings with at least this many entries are indexed by extension.
+    static const size_t indexThreshold = 1024;
+
+    class const_iterator {
+    private:
+        const DirEntries* _entries;
+        size_t _i;
+
+    public:
+        const_iterator(const DirEntries* entries, size_t i)
+            : _entries(entries), _i(i) {}
+
+        DirEntry operator*() const {
+            return (*_entries)[_i];
+        }
+
+        const_iterator& operator++() {
+            ++_i;
+            return *this;
+        }
+
+        bool operator!=(const const_iterator& rhs) const {
+            return _i != rhs._i;
+        }
+    };
+
+    DirEntries() : _dirs(0) {}
+
+    size_t size() const {
+        return _items.size();
+    }
+
+    /**
+     * Number of entries that are directories.
+     */
+    size_t dirs() const {
+        return _dirs;
+    }
+
+    bool empty() const {
+        return _items.empty();
+    }
+
+    DirEntry operator[](size_t i) const {
+        const Item& item = _items[i];
+        return DirEntry {_names.data() + item.offset, item.length, item.type};
+    }
+
+    const_iterator begin() const {
+        return const_iterator(this, 0);
+    }
+
+    const_iterator end() const {
+        return const_iterator(this, _items.size());
+    }
+
+    /**
+     * All of the names, in order, each followed by a NUL byte.
+     */
+    const std::string& names() const {
+        return _names;
+    }
+
+    void clear() {
+        _items.clear();
+        _names.clear();
+        _dirs = 0;
+        _byExt.clear();
+    }
+
+    /**
+     * Reserves space for the given number of entries and, if known, the total
+     * length of their names.
+     */
+    void reserve(size_t count, size_t namesLength = 0);
+
+    /**
+     * Adds an entry to the end.
+     */
+    void add(const char* name, size_t length, DirEntry::Type type);
 
-// Called with the matched path.
-using MatchCallback = std::function<void(Path)>;
+    /**
+     * Sorts the entries by name and indexes them. The names are repacked in
+     * the new order.
+     */
+    void sort();
+
+    /**
+     * Indexes sorted entries by extension if there are enough of them for it
+     * to pay off. This must be done again after adding entries.
+     */
+    void index();
+
+    /**
+     * True if the entries are indexed by extension.
+     */
+    bool indexed() const {
+        return !_byExt.empty();
+    }
+
+    /**
+     * Finds the entries whose names have the given extension (everything from
+     * the last '.' on), using the index. Sets the range of their positions,
+     * which are in order. The extension is compared the same way as names on
+     * this file system.
+     */
+    void withExtension(const char* ext, size_t length,
+            const uint32_t*& begin, const uint32_t*& end) const;
+
+    /**
+     * Finds the entries whose names start with the given prefix with a binary
+     * search. The entries must be sorted. Sets the range of their positions.
+     * The prefix must match exactly, even if the file system is not case
+     * sensitive.
+     */
+    void withPrefix(const char* prefix, size_t length,
+            size_t& begin, size_t& end) const;
+
+    /**
+     * Finds an entry by name with a binary search. The entries must be
+     * sorted. The name must match exactly, even if the file system is not case
+     * sensitive.
+     */
+    bool find(const char* name, size_t length, DirEntry& entry) const;
+};
+
+/**
+ * A glob pattern along with whether it adds or removes matches.
+ */
+struct GlobExpr {
+    Path pattern;
+    bool exclude;
+};
 
 /**
  * A cache for directory listings.
  */
 class DirCache {
 private:
-    // Mapping of directory names to directory contents.
-    std::map<std::string, DirEntries> _cache;
+    struct Entry {
+        // Normalized path of the directory, spelled the way it was first
+        // looked up.
+        const std::string path;
+
+        // Guards the directory listing. The first thread to look up the
+        // directory lists it. Any other threads that want it in the meantime
+        // wait for that listing to finish.
+        std::once_flag listed;
+
+        DirEntries entries;
+
+        // True if the directory could be listed.
+        bool exists;
+
+        // Set once the listing is done. This lets others use the listing
+        // without waiting on it or causing it to be made.
+        std::atomic<bool> ready;
+
+        // Stamp of the directory at the time it was listed. Only used if the
+        // listings are to be saved.
+        DirStamp stamp;
+        bool hasStamp;
+
+        // True if changes to the directory are being watched for.
+        bool watched;
+
+        // True if the entry was dropped from the index. It is only kept
+        // around since entries never move.
+        bool dead;
+
+        // Last run in which the directory was reported as a dependency.
+        std::atomic<uint32_t> reported;
+
+        Entry(const std::string& path)
+            : path(path), exists(false), ready(false), hasStamp(false),
+              watched(false), dead(false), reported(0) {}
+    };
+
+    struct Slot {
+        uint64_t hash;
+        Entry* entry; // NULL if the slot is empty.
+    };
+
+    // The cache is split up into shards, each with its own lock, so that
+    // lookups of different directories rarely contend. Locks are only held
+    // for the lookup itself, never while listing a directory.
+    struct Shard {
+        std::mutex mutex;
+
+        // Entries never move once added, so they can be handed out.
+        std::deque<Entry> entries;
+
+        // Open addressing hash index of the entries by path, with linear
+        // probing. The size is always a power of two.
+        std::vector<Slot> index;
+
+        /**
+         * Finds the entry for the given normalized path. Returns NULL if there
+         * is none. The lock must be held.
+         */
+        Entry* find(uint64_t hash, const std::string& path, bool foldCase);
+
+        /**
+         * Finds the entry for the given normalized path, adding it if it
+         * doesn't exist yet. The lock must be held.
+         */
+        Entry& get(uint64_t hash, const std::string& path, bool foldCase);
+
+        /**
+         * Removes the entry for the given normalized path from the index.
+         * Returns the entry that was removed, if any. The lock must be held.
+         */
+        Entry* remove(uint64_t hash, const std::string& path, bool foldCase);
+    };
+
+    static const size_t shardCount = 64;
+
+    Shard _shards[shardCount];
 
     ImplicitDeps* _deps;
 
-    // Mutex protects the cache.
-    std::mutex _mutex;
+    // True if paths that only differ in case are the same directory.
+    const bool _foldCase;
+
+    // Listings from a previous run, if any.
+    std::unique_ptr<DirCacheFile> _file;
+
+    // True if the listings are going to be saved for the next run.
+    bool _persistent;
+
+    // Time at which the listings were loaded.
+    uint64_t _startTime;
+
+    // Watches listed directories for changes, if any.
+    DirWatcher* _watcher;
+
+    // Number of the current run. See refresh().
+    uint32_t _session;
+
+    // Number of entries that have been dropped from the index.
+    size_t _dead;
+
+    // Directories are opened relative to a parent that is held open, if any.
+    // Only so many are held open at a time.
+    struct OpenDir;
+    typedef std::shared_ptr<const OpenDir> OpenDirPtr;
+
+    int _maxOpenDirs;
+    std::atomic<int> _openDirs;
+
+public:
+    /**
+     * Matched paths of a glob. These are shared by every glob of the same
+     * expressions and so can't be changed.
+     */
+    typedef std::shared_ptr<const std::vector<std::string>> GlobResult;
+
+private:
+    // Results of the globs done so far, keyed by the root and expressions.
+    std::mutex _globsMutex;
+    std::unordered_map<std::string, GlobResult> _globs;
 
 public:
-    DirCache(ImplicitDeps* deps = nullptr);
+    /**
+     * If foldCase is true, paths that only differ in the case of ASCII letters
+     * are taken to be the same directory, which is then only listed once. This
+     * is the default where the file system is not case sensitive.
+     */
+    DirCache(ImplicitDeps* deps = nullptr,
+            bool foldCase = !Path::caseSensitive);
     virtual ~DirCache();
 
+    /**
+     * Uses the listings saved by a previous run in the given file. A saved
+     * listing is only used if the directory hasn't changed since. This costs
+     * one stat per directory instead of a full listing.
+     *
+     * Directories are still reported as dependencies either way.
+     *
+     * This must be called before any lookups. Returns false if the file could
+     * not be loaded, in which case all directories are listed as usual.
+     */
+    bool load(const char* path);
+
+    /**
+     * Saves all the listings made (or reused) so far to the given file for the
+     * next run. Must not be called while any lookups are in progress.
+     */
+    bool save(const char* path);
+
+    /**
+     * Watches every directory listed from now on for changes with the given
+     * watcher, which must outlive the cache. This must be called before any
+     * lookups.
+     */
+    void watch(DirWatcher* watcher);
+
+    /**
+     * Starts another run with the same listings, sending dependencies to the
+     * given channels. Listings that the watcher says have changed are dropped,
+     * as are the listings of directories that are not watched or didn't exist.
+     * Everything else is kept and, when it is first looked up again, reported
+     * as a dependency once more. Remembered globs are forgotten.
+     *
+     * Returns false if changes may have been missed or if too many listings
+     * had been dropped. The cache should then be thrown away in favor of a
+     * new one.
+     *
+     * Must not be called while any lookups are in progress.
+     */
+    bool refresh(ImplicitDeps* deps);
+
     /**
      * Returns a list of names in the given directory.
      *
@@ -67,39 +404,121 @@ public:
     /**
      * Globs for files starting at the given root.
      *
+     * All of the expressions are evaluated together in a single walk of the
+     * directory tree. A path is in the result if the last expression that
+     * matches it is not an exclusion. That is, it is as if each expression
+     * adds or removes its matches in turn.
+     *
      * Parameters:
-     *   root     = The root directory to start searching from. All matched
-     *              paths are relative to this directory.
-     *   path     = The path which can contain glob patterns. Recursive glob
-     *              expressions are also supported.
-     *   callback = The function to call for every matched file name.
-     *   pool     = Thread pool to use for evaluating glob expressions. If NULL,
-     *              all expressions are evaluated serially which can actually be
-     *              faster in some cases.
+     *   root  = The root directory to start searching from. All matched
+     *           paths are relative to this directory.
+     *   exprs = The paths which can contain glob patterns. Recursive glob
+     *           expressions are also supported.
+     *   pool  = Thread pool to use for evaluating glob expressions. If NULL,
+     *           all expressions are evaluated serially. Only the tasks started
+     *           by this glob are waited on, so the pool can be shared with
+     *           other work. The calling thread helps run tasks while it waits.
+     *
+     * Even with a pool, most of the walk happens without any tasks. A task is
+     * only worth its overhead for a subtree that may be big, so directories
+     * are visited on the current thread when:
+     *
+     *  - only one subdirectory needs visiting, however deep it goes,
+     *  - the directory is already listed and has no subdirectories of its own
+     *    and not many entries, or
+     *  - there are already enough tasks queued to keep every worker busy.
+     *
+     * This way, small globs don't pay for any tasks, and big ones still spread
+     * out over the whole pool.
+     *
+     * The results are remembered. Globbing the same expressions from the same
+     * root again returns the same results without walking the tree. Since a
+     * directory is only ever listed once, walking it again would not find
+     * anything new anyway.
+     *
+     * Returns: The matched paths, sorted and without duplicates.
      */
-    void glob(Path root, Path path, MatchCallback callback, ThreadPool* pool = nullptr);
+    GlobResult glob(Path root, const std::vector<GlobExpr>& exprs,
+            ThreadPool* pool = nullptr);
 
 private:
 
+    // Walks the tree for a glob.
+    std::vector<std::string> globWalk(Path root,
+            const std::vector<GlobExpr>& exprs, ThreadPool* pool);
+
+    // Lists a directory for the first time.
+    void list(Entry& entry, const OpenDir* base, OpenDirPtr* opened);
+
+    // Drops the listing of a directory, if there is one.
+    void drop(const std::string& path);
+
+    /**
+     * Looks up a directory, listing it if that hasn't been done yet. If it
+     * needs to be listed, it is opened relative to the base directory if
+     * possible. If opened is not NULL, it may be set to the directory that was
+     * opened for listing.
+     */
+    const Entry& listedEntry(const std::string& path, const OpenDir* base,
+            OpenDirPtr* opened);
+
+    /**
+     * Returns the directory if it has already been listed and reported as a
+     * dependency in this run. Nothing is listed and no dependency is reported.
+     * Returns NULL otherwise.
+     */
+    const Entry* findListed(const std::string& path);
+
+    struct CompiledGlob;
+    struct GlobResults;
+
+    // A position in one of the expressions being globbed.
+    struct GlobState {
+        uint32_t expr;  // Index of the expression.
+        uint32_t index; // Component to match next.
+
+        bool operator<(const GlobState& rhs) const {
+            return expr < rhs.expr || (expr == rhs.expr && index < rhs.index);
+        }
+
+        bool operator==(const GlobState& rhs) const {
+            return expr == rhs.expr && index == rhs.index;
+        }
+    };
+
+    // State shared by all parts of a single glob. Keeping this in one place
+    // keeps queued tasks small.
+    struct GlobContext {
+        Path root; // Root from which all matched paths are relative.
+        const std::vector<CompiledGlob>* globs; // Expressions being globbed.
+        ThreadPool* pool; // Pool to spawn tasks on, if any.
+        TaskGroup* group; // Tasks spawned for this glob, if any.
+        GlobResults* results; // Where to put matched paths.
+    };
+
     void globImpl(
-            Path root, // Root from which all matched paths are relative.
+            const GlobContext& ctx,
             std::string& path, // The directory path we've matched so far.
-            const std::vector<Path>& components, // Path components of the pattern.
-            size_t index, // Current component we're trying to match.
-            bool matchDirs, // Only match directories.
-            MatchCallback callback, // Function to call for every match
-            ThreadPool* pool
+            std::vector<GlobState>& states, // What we're trying to match.
+            const OpenDirPtr& dir // Closest open parent directory, if any.
             );
 
+    // Finds the positions of the entries in a large listing that the given
+    // states can match, in order. Returns false if every entry needs to be
+    // looked at.
+    static bool narrowListing(const std::vector<CompiledGlob>& globs,
+            const std::vector<GlobState>& listed, const DirEntries& entries,
+            std::vector<uint32_t>& positions);
+
+    // Returns true if visiting the given directory is worth a task of its own.
+    bool worthSpawning(const GlobContext& ctx, const std::string& path);
+
     // Helper function to run an asynchronous glob using the thread pool (if
-    // any).
+    // any and if it is worth it).
     void queueGlob(
-            Path root,
+            const GlobContext& ctx,
             std::string& path,
-            const std::vector<Path>& components,
-            size_t index,
-            bool matchDirs,
-            MatchCallback callback,
-            ThreadPool* pool
+            std::vector<GlobState>& states,
+            const OpenDirPtr& dir
             );
 };
@@ -0,0 +1,460 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Persistent storage for directory listings between runs.
+ */
+
+#ifdef _WIN32
+#   define _CRT_SECURE_NO_WARNINGS
+#   include <windows.h>
+#   include <codecvt>
+#   include <locale>
+#else
+#   include <sys/types.h>
+#   include <sys/stat.h>
+#   include <sys/mman.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <algorithm>
+
+#include "dircachefile.h"
+#include "dircache.h"
+#include "output.h"
+
+namespace {
+
+const char magic[4] = {'B', 'L', 'D', 'C'};
+const uint32_t version = 2;
+
+// Size of a single index entry.
+const size_t indexEntrySize = 12;
+
+// Size of a stamp in the file.
+const size_t stampSize = 32;
+
+#ifdef _WIN32
+
+std::wstring toWide(const std::string& s) {
+    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
+    return converter.from_bytes(s);
+}
+
+uint64_t fileTime(const LARGE_INTEGER& t) {
+    return (uint64_t)t.QuadPart;
+}
+
+#else
+
+#if defined(__APPLE__)
+#   define MTIME(st) ((uint64_t)(st).st_mtimespec.tv_sec * 1000000000 + (st).st_mtimespec.tv_nsec)
+#   define CTIME(st) ((uint64_t)(st).st_ctimespec.tv_sec * 1000000000 + (st).st_ctimespec.tv_nsec)
+#else
+#   define MTIME(st) ((uint64_t)(st).st_mtim.tv_sec * 1000000000 + (st).st_mtim.tv_nsec)
+#   define CTIME(st) ((uint64_t)(st).st_ctim.tv_sec * 1000000000 + (st).st_ctim.tv_nsec)
+#endif
+
+#endif
+
+/**
+ * Compares a path in the file with the given path.
+ */
+int comparePath(const char* a, size_t alen, const std::string& b) {
+    int c = memcmp(a, b.data(), std::min(alen, b.size()));
+    if (c != 0) return c;
+    return alen < b.size() ? -1 : (alen > b.size() ? 1 : 0);
+}
+
+bool pathLess(const DirRecord& a, const DirRecord& b) {
+    return *a.path < *b.path;
+}
+
+}
+
+std::string currentDir() {
+#ifdef _WIN32
+    DWORD len = GetCurrentDirectoryW(0, NULL);
+    if (len == 0) return std::string();
+
+    std::wstring buf(len, L'\0');
+    len = GetCurrentDirectoryW(len, &buf[0]);
+    buf.resize(len);
+
+    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
+    return converter.to_bytes(buf);
+#else
+    std::string buf(256, '\0');
+
+    while (!getcwd(&buf[0], buf.size())) {
+        if (errno != ERANGE) return std::string();
+        buf.resize(buf.size() * 2);
+    }
+
+    buf.resize(strlen(buf.c_str()));
+    return buf;
+#endif
+}
+
+bool DirStamp::get(const std::string& path, DirStamp& stamp) {
+#ifdef _WIN32
+
+    HANDLE h = CreateFileW(
+            toWide(path.empty() ? "." : path).c_str(),
+            FILE_READ_ATTRIBUTES,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            NULL,
+            OPEN_EXISTING,
+            FILE_FLAG_BACKUP_SEMANTICS, // Needed to open directories
+            NULL
+            );
+
+    if (h == INVALID_HANDLE_VALUE)
+        return false;
+
+    BY_HANDLE_FILE_INFORMATION info;
+    FILE_BASIC_INFO basic;
+
+    const bool ok =
+        GetFileInformationByHandle(h, &info) &&
+        GetFileInformationByHandleEx(h, FileBasicInfo, &basic, sizeof(basic));
+
+    CloseHandle(h);
+
+    if (!ok) return false;
+
+    stamp.dev = info.dwVolumeSerialNumber;
+    stamp.ino = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+    stamp.mtime = fileTime(basic.LastWriteTime);
+    stamp.ctime = fileTime(basic.ChangeTime);
+    return true;
+
+#else
+
+    struct stat st;
+    if (stat(path.empty() ? "." : path.c_str(), &st) != 0)
+        return false;
+
+    stamp.dev = (uint64_t)st.st_dev;
+    stamp.ino = (uint64_t)st.st_ino;
+    stamp.mtime = MTIME(st);
+    stamp.ctime = CTIME(st);
+    return true;
+
+#endif
+}
+
+#ifndef _WIN32
+
+bool DirStamp::get(int fd, DirStamp& stamp) {
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return false;
+
+    stamp.dev = (uint64_t)st.st_dev;
+    stamp.ino = (uint64_t)st.st_ino;
+    stamp.mtime = MTIME(st);
+    stamp.ctime = CTIME(st);
+    return true;
+}
+
+#endif
+
+bool DirStamp::isRacy(uint64_t startTime) const {
+#ifdef _WIN32
+    // FILETIME is in 100ns intervals since 1601.
+    const uint64_t t = std::max(mtime, ctime) / 10000000 - 11644473600ULL;
+#else
+    const uint64_t t = std::max(mtime, ctime) / 1000000000;
+#endif
+
+    // Leave some room for file systems with coarse timestamps.
+    return t + 2 >= startTime;
+}
+
+DirCacheFile::DirCacheFile()
+    : _data(NULL), _length(0), _count(0), _index(NULL)
+#ifdef _WIN32
+    , _file(INVALID_HANDLE_VALUE), _mapping(NULL)
+#endif
+{
+}
+
+DirCacheFile::~DirCacheFile() {
+    close();
+}
+
+bool DirCacheFile::open(const char* path) {
+    close();
+
+#ifdef _WIN32
+
+    _file = CreateFileW(toWide(path).c_str(), GENERIC_READ, FILE_SHARE_READ,
+            NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (_file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(_file, &size) || size.QuadPart == 0) {
+        close();
+        return false;
+    }
+
+    _mapping = CreateFileMappingW(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!_mapping) {
+        close();
+        return false;
+    }
+
+    _data = (const char*)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!_data) {
+        close();
+        return false;
+    }
+
+    _length = (size_t)size.QuadPart;
+
+#else
+
+    int fd = ::open(path, O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+
+    void* p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    // The mapping stays valid after the file is closed.
+    ::close(fd);
+
+    if (p == MAP_FAILED)
+        return false;
+
+    _data = (const char*)p;
+    _length = (size_t)st.st_size;
+
+#endif
+
+    // Validate the header.
+    size_t pos = sizeof(magic) + 8;
+    if (_length < pos || memcmp(_data, magic, sizeof(magic)) != 0 ||
+            getU32(_data + 4) != version) {
+        close();
+        return false;
+    }
+
+    const uint32_t cwdLength = getU32(_data + 8);
+    const std::string cwd = currentDir();
+    if (_length - pos < (size_t)cwdLength + 4 || cwdLength != cwd.size() ||
+            memcmp(_data + pos, cwd.data(), cwdLength) != 0) {
+        close();
+        return false;
+    }
+
+    pos += cwdLength;
+
+    _count = getU32(_data + pos);
+    pos += 4;
+
+    if ((_length - pos) / indexEntrySize < _count) {
+        close();
+        return false;
+    }
+
+    _index = _data + pos;
+
+    return true;
+}
+
+void DirCacheFile::close() {
+#ifdef _WIN32
+    if (_data) UnmapViewOfFile(_data);
+    if (_mapping) CloseHandle(_mapping);
+    if (_file != INVALID_HANDLE_VALUE) CloseHandle(_file);
+    _mapping = NULL;
+    _file = INVALID_HANDLE_VALUE;
+#else
+    if (_data) munmap((void*)_data, _length);
+#endif
+
+    _data = NULL;
+    _length = 0;
+    _count = 0;
+    _index = NULL;
+}
+
+bool DirCacheFile::find(const std::string& path, const DirStamp& stamp,
+        DirEntries& entries) const {
+
+    if (!_data) return false;
+
+    // Binary search for the path.
+    size_t lo = 0, hi = _count;
+    const char* found = NULL;
+
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        const char* e = _index + mid * indexEntrySize;
+
+        const uint32_t offset = getU32(e);
+        const uint32_t length = getU32(e + 4);
+
+        if (offset > _length || length > _length - offset)
+            return false; // Corrupt
+
+        const int c = comparePath(_data + offset, length, path);
+        if (c < 0)
+            lo = mid + 1;
+        else if (c > 0)
+            hi = mid;
+        else {
+            found = e;
+            break;
+        }
+    }
+
+    if (!found) return false;
+
+    size_t pos = getU32(found + 8);
+    if (pos > _length || _length - pos < stampSize + 4)
+        return false;
+
+    const char* p = _data + pos;
+
+    DirStamp s;
+    s.dev   = getU64(p);
+    s.ino   = getU64(p + 8);
+    s.mtime = getU64(p + 16);
+    s.ctime = getU64(p + 24);
+
+    // Out of date?
+    if (!(s == stamp))
+        return false;
+
+    const uint32_t count = getU32(p + stampSize);
+    pos += stampSize + 4;
+
+    entries.clear();
+    entries.reserve(count);
+
+    // The entries were saved in sorted order.
+    for (uint32_t i = 0; i < count; ++i) {
+        if (_length - pos < 5)
+            return false;
+
+        const uint32_t length = getU32(_data + pos);
+        const uint8_t type = (uint8_t)_data[pos + 4];
+        pos += 5;
+
+        if (_length - pos < length)
+            return false;
+
+        if (type > DirEntry::dir)
+            return false; // Corrupt
+
+        entries.add(_data + pos, length, (DirEntry::Type)type);
+        pos += length;
+    }
+
+    entries.index();
+
+    return true;
+}
+
+bool DirCacheFile::write(const char* path, std::vector<DirRecord>& records) {
+
+    std::sort(records.begin(), records.end(), pathLess);
+
+    const std::string cwd = currentDir();
+
+    // Everything up to the end of the index.
+    const size_t headerLength = sizeof(magic) + 8 + cwd.size() + 4 +
+        records.size() * indexEntrySize;
+
+    OutputBuffer recs(NULL, 1 << 16);
+
+    std::vector<size_t> recordOffsets;
+    recordOffsets.reserve(records.size());
+
+    for (auto&& r: records) {
+        recordOffsets.push_back(recs.length());
+
+        putU64(recs, r.stamp->dev);
+        putU64(recs, r.stamp->ino);
+        putU64(recs, r.stamp->mtime);
+        putU64(recs, r.stamp->ctime);
+
+        putU32(recs, (uint32_t)r.entries->size());
+
+        for (auto&& entry: *r.entries) {
+            putU32(recs, (uint32_t)entry.length);
+            recs.put((char)entry.type);
+            recs.write(entry.name, entry.length);
+        }
+    }
+
+    // Offsets are 32-bit.
+    size_t pathsLength = 0;
+    for (auto&& r: records)
+        pathsLength += r.path->size();
+
+    if (headerLength + recs.length() + pathsLength > UINT32_MAX)
+        return false;
+
+    const std::string tmp = std::string(path) + ".tmp";
+
+#ifdef _WIN32
+    FILE* f = _wfopen(toWide(tmp).c_str(), L"wb");
+#else
+    FILE* f = fopen(tmp.c_str(), "wb");
+#endif
+
+    if (!f) return false;
+
+    {
+        OutputBuffer out(f);
+
+        out.write(magic, sizeof(magic));
+        putU32(out, version);
+        putU32(out, (uint32_t)cwd.size());
+        out.write(cwd.data(), cwd.size());
+        putU32(out, (uint32_t)records.size());
+
+        size_t pathOffset = headerLength + recs.length();
+
+        for (size_t i = 0; i < records.size(); ++i) {
+            putU32(out, (uint32_t)pathOffset);
+            putU32(out, (uint32_t)records[i].path->size());
+            putU32(out, (uint32_t)(headerLength + recordOffsets[i]));
+            pathOffset += records[i].path->size();
+        }
+
+        out.write(recs.data(), recs.length());
+
+        for (auto&& r: records)
+            out.write(r.path->data(), r.path->size());
+    }
+
+    const bool ok = ferror(f) == 0;
+
+    if (fclose(f) != 0 || !ok)
+        return false;
+
+#ifdef _WIN32
+    return MoveFileExW(toWide(tmp).c_str(), toWide(path).c_str(),
+            MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(tmp.c_str(), path) == 0;
+#endif
+}
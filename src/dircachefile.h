@@ -0,0 +1,139 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Persistent storage for directory listings between runs.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+class DirEntries;
+
+/**
+ * Returns the current working directory, or an empty string if it can't be
+ * found out.
+ */
+std::string currentDir();
+
+/**
+ * Identifies a particular version of a directory. If any of these fields
+ * changes, the directory listing may have changed.
+ *
+ * On Posix, this is the device, inode, modification time, and change time. On
+ * Windows, this is the volume serial number, file index, last write time, and
+ * change time. The same goes for files.
+ */
+struct DirStamp {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t mtime;
+    uint64_t ctime;
+
+    bool operator==(const DirStamp& rhs) const {
+        return dev == rhs.dev && ino == rhs.ino &&
+               mtime == rhs.mtime && ctime == rhs.ctime;
+    }
+
+    /**
+     * Gets the stamp of the given directory or file. Returns false if it
+     * can't be accessed.
+     */
+    static bool get(const std::string& path, DirStamp& stamp);
+
+#ifndef _WIN32
+    /**
+     * Gets the stamp of an open directory.
+     */
+    static bool get(int fd, DirStamp& stamp);
+#endif
+
+    /**
+     * Returns true if the directory was modified so recently that a change
+     * immediately after listing it may not have changed its stamp. Such
+     * listings are not saved.
+     */
+    bool isRacy(uint64_t startTime) const;
+};
+
+/**
+ * A directory listing along with the stamp it was taken with.
+ */
+struct DirRecord {
+    const std::string* path;
+    const DirStamp* stamp;
+    const DirEntries* entries;
+};
+
+/**
+ * A memory-mapped file of directory listings from a previous run.
+ *
+ * The file is laid out as follows. All integers are little-endian.
+ *
+ *     "BLDC"        Magic bytes.
+ *     version       32-bit format version. Currently 2.
+ *     cwd           32-bit length followed by the working directory the
+ *                   listings were made from. Relative paths are only valid in
+ *                   that directory.
+ *     count         32-bit number of directories.
+ *     index         For each directory, sorted by path, the 32-bit offset and
+ *                   length of its path and the 32-bit offset of its record.
+ *     records       For each directory, its stamp (4 64-bit integers), a
+ *                   32-bit entry count, and, for each sorted entry, a 32-bit
+ *                   name length, a byte with the type (0 for other, 1 for
+ *                   files, 2 for directories), and the name.
+ *     paths         Directory paths, back-to-back.
+ *
+ * Lookups are a binary search over the index and only touch the pages they
+ * need.
+ */
+class DirCacheFile {
+private:
+    const char* _data;
+    size_t _length;
+
+    // Number of directories and where their index starts.
+    uint32_t _count;
+    const char* _index;
+
+#ifdef _WIN32
+    void* _file;
+    void* _mapping;
+#endif
+
+public:
+    DirCacheFile();
+    ~DirCacheFile();
+
+    DirCacheFile(const DirCacheFile&) = delete;
+    DirCacheFile& operator=(const DirCacheFile&) = delete;
+
+    /**
+     * Maps the given file into memory. Returns false if the file doesn't exist
+     * or is not a valid cache file for the current working directory.
+     */
+    bool open(const char* path);
+
+    /**
+     * Unmaps the file.
+     */
+    void close();
+
+    /**
+     * Finds the listing for the given normalized directory path. The listing is
+     * only returned if it was made when the directory had the given stamp.
+     */
+    bool find(const std::string& path, const DirStamp& stamp,
+            DirEntries& entries) const;
+
+    /**
+     * Writes out a new cache file. The file is replaced atomically. The
+     * records do not need to be sorted.
+     */
+    static bool write(const char* path, std::vector<DirRecord>& records);
+};
@@ -0,0 +1,241 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Watches directories for changes.
+ */
+#ifdef __linux__
+#   include <errno.h>
+#   include <sys/inotify.h>
+#   include <unistd.h>
+#endif
+
+#include <unordered_set>
+
+#include "dirwatch.h"
+#include "path.h"
+
+#ifdef __linux__
+
+namespace {
+
+// Anything that changes what a listing would say.
+const uint32_t watchMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+    IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+}
+
+DirWatcher::DirWatcher() : _fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {
+}
+
+DirWatcher::~DirWatcher() {
+    if (_fd >= 0) close(_fd);
+}
+
+bool DirWatcher::watch(const std::string& path) {
+    if (_fd < 0) return false;
+
+    std::string dir = path;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    while (true) {
+        if (!watchOne(dir))
+            return false;
+
+        // The parent is always a prefix.
+        const size_t parent = Path(dir).dirname().length;
+        if (parent == dir.size())
+            break;
+
+        dir.resize(parent);
+    }
+
+    return true;
+}
+
+/**
+ * Watches a single directory unless it is already. The lock must be held.
+ */
+bool DirWatcher::watchOne(const std::string& path) {
+    if (_paths.count(path))
+        return true;
+
+    const int wd = inotify_add_watch(_fd, path.empty() ? "." : path.c_str(),
+            watchMask);
+    if (wd < 0) return false;
+
+    _paths.emplace(path, wd);
+    _dirs[wd].push_back(path);
+    return true;
+}
+
+/**
+ * Forgets about a watched path. The watch itself stays if the directory is
+ * watched under another path, or until it is watched under a new one. The lock
+ * must be held.
+ */
+void DirWatcher::unwatch(const std::string& path) {
+    auto it = _paths.find(path);
+    if (it == _paths.end())
+        return;
+
+    auto dir = _dirs.find(it->second);
+    if (dir != _dirs.end()) {
+        std::vector<std::string>& paths = dir->second;
+        for (size_t i = 0; i < paths.size(); ++i) {
+            if (paths[i] == path) {
+                paths.erase(paths.begin() + (ptrdiff_t)i);
+                break;
+            }
+        }
+    }
+
+    _paths.erase(it);
+}
+
+/**
+ * Adds every watched path below the given ones, which have been moved or
+ * removed, to the list of changed directories and stops watching it under that
+ * path. The lock must be held.
+ */
+void DirWatcher::unwatchBelow(const std::vector<std::string>& moved,
+        std::vector<std::string>& dirs) {
+
+    const std::unordered_set<std::string> gone(moved.begin(), moved.end());
+
+    std::vector<std::string> below;
+
+    for (auto&& p: _paths) {
+        const std::string& path = p.first;
+
+        for (size_t len = path.size(); ; ) {
+            if (gone.count(path.substr(0, len))) {
+                below.push_back(path);
+                break;
+            }
+
+            const size_t parent = Path(path.data(), len).dirname().length;
+            if (parent == len)
+                break;
+
+            len = parent;
+        }
+    }
+
+    for (auto&& path: below) {
+        unwatch(path);
+        dirs.push_back(std::move(path));
+    }
+}
+
+bool DirWatcher::changes(std::vector<std::string>& dirs) {
+    if (_fd < 0) return false;
+
+    alignas(struct inotify_event) char buf[64 * 1024];
+
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    // Entries that were renamed or removed. Whatever is watched below them
+    // isn't there any more.
+    std::vector<std::string> moved;
+
+    while (true) {
+        const ssize_t n = read(_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n < 0 && errno == EAGAIN)
+            break;
+
+        if (n <= 0) {
+            // Something is wrong with the watcher. Stop trusting it.
+            close(_fd);
+            _fd = -1;
+            _dirs.clear();
+            _paths.clear();
+            return false;
+        }
+
+        for (ssize_t i = 0; i < n; ) {
+            const struct inotify_event* e =
+                (const struct inotify_event*)(buf + i);
+            i += (ssize_t)(sizeof(struct inotify_event) + e->len);
+
+            if (e->mask & IN_Q_OVERFLOW) {
+                close(_fd);
+                _fd = -1;
+                _dirs.clear();
+                _paths.clear();
+                return false;
+            }
+
+            auto it = _dirs.find(e->wd);
+            if (it == _dirs.end())
+                continue;
+
+            for (auto&& dir: it->second) {
+                if (e->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                            IN_MOVED_TO)) {
+                    dirs.push_back(dir);
+
+                    // The entry may be a directory that is cached too, perhaps
+                    // as one that didn't exist. It may also have been a
+                    // symlink to one.
+                    if (e->len > 0) {
+                        std::string child = dir;
+                        Path(e->name).join(child);
+
+                        if (e->mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+                            moved.push_back(child);
+
+                        dirs.push_back(std::move(child));
+                    }
+                }
+
+                if (e->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT |
+                            IN_IGNORED)) {
+                    dirs.push_back(dir);
+                }
+
+                if (e->mask & IN_MOVE_SELF)
+                    moved.push_back(dir);
+            }
+
+            // The watch is gone once the directory is.
+            if (e->mask & IN_IGNORED) {
+                for (auto&& dir: it->second)
+                    _paths.erase(dir);
+
+                _dirs.erase(it);
+            }
+        }
+    }
+
+    if (!moved.empty())
+        unwatchBelow(moved, dirs);
+
+    return true;
+}
+
+#else // __linux__
+
+DirWatcher::DirWatcher() : _fd(-1) {
+}
+
+DirWatcher::~DirWatcher() {
+}
+
+bool DirWatcher::watch(const std::string& path) {
+    (void)path;
+    return false;
+}
+
+bool DirWatcher::changes(std::vector<std::string>& dirs) {
+    (void)dirs;
+    return true;
+}
+
+#endif // !__linux__
@@ -0,0 +1,71 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Watches directories for changes.
+ */
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Watches directories for entries being added, removed, or renamed.
+ *
+ * This uses inotify on Linux. Elsewhere, nothing can be watched and every
+ * directory has to be assumed to have changed.
+ */
+class DirWatcher
+{
+private:
+    int _fd;
+
+    std::mutex _mutex;
+
+    // Watched paths by watch descriptor. The same directory can be watched
+    // under more than one path (e.g., through a symlink), in which case each
+    // path has the same watch descriptor.
+    std::unordered_map<int, std::vector<std::string>> _dirs;
+
+    // Watch descriptor of every watched path.
+    std::unordered_map<std::string, int> _paths;
+
+public:
+    DirWatcher();
+    ~DirWatcher();
+
+    DirWatcher(const DirWatcher&) = delete;
+    DirWatcher& operator=(const DirWatcher&) = delete;
+
+    /**
+     * Starts watching the given directory. Its parent directories are watched
+     * too, since nothing in it changes if one of them is moved. Returns false
+     * if it can't be watched, in which case it must be assumed to change at
+     * any time.
+     *
+     * This function is thread safe.
+     */
+    bool watch(const std::string& path);
+
+    /**
+     * Adds the directories that have changed since the last call to the given
+     * list. A directory whose entry was added or removed is also in the list
+     * along with its parent. So is every watched directory below an entry that
+     * was removed or renamed, which is no longer watched under that path.
+     *
+     * Returns false if changes may have been missed. Every directory must then
+     * be assumed to have changed. Once that happens, nothing is watched any
+     * more.
+     */
+    bool changes(std::vector<std::string>& dirs);
+
+private:
+    bool watchOne(const std::string& path);
+    void unwatch(const std::string& path);
+    void unwatchBelow(const std::vector<std::string>& moved,
+            std::vector<std::string>& dirs);
+};
@@ -13,6 +13,8 @@
 
 #include <lua.hpp>
 
+#include "sha256.h"
+
 // Helper macro for adding new modules
 #define SCRIPT(module, path, name) \
     {(module), (path), scripts_ ## name ## _lua, sizeof(scripts_ ## name ## _lua)}
@@ -76,7 +78,13 @@ const Script* find_embedded(const char* name) {
 }
 
 int Script::load(lua_State* L) const {
-    return luaL_loadbuffer(L, (const char*)data, length, name);
+    // Scripts are embedded either as source or as precompiled bytecode,
+    // depending on how this was built. Only accept the one that it is.
+    const bool bytecode = length > 0 &&
+        *(const char*)data == LUA_SIGNATURE[0];
+
+    return luaL_loadbufferx(L, (const char*)data, length, name,
+            bytecode ? "b" : "t");
 }
 
 } // namespace
@@ -118,3 +126,13 @@ int load_init(lua_State* L) {
 int load_shutdown(lua_State* L) {
     return script_shutdown.load(L);
 }
+
+void hash_embedded(Sha256& h) {
+    h.update(script_init.data, script_init.length);
+    h.update(script_shutdown.data, script_shutdown.length);
+
+    for (size_t i = 0; i < embedded_len; ++i) {
+        h.update(embedded[i].name, strlen(embedded[i].name) + 1);
+        h.update(embedded[i].data, embedded[i].length);
+    }
+}
@@ -10,6 +10,8 @@
 
 struct lua_State {};
 
+class Sha256;
+
 int embedded_searcher(lua_State *L);
 
 int load_embedded(lua_State* L, const char* name);
@@ -23,3 +25,9 @@ int load_init(lua_State* L);
  * Loads the embedded shutdown script.
  */
 int load_shutdown(lua_State* L);
+
+/**
+ * Adds all of the embedded scripts to a checksum. This changes whenever any of
+ * them does.
+ */
+void hash_embedded(Sha256& h);
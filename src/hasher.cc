@@ -0,0 +1,131 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Computes checksums of inputs for the parent build system.
+ */
+#ifdef _WIN32
+#   define _CRT_SECURE_NO_WARNINGS
+#   include <windows.h>
+#   include <codecvt>
+#   include <locale>
+#else
+#   include <sys/types.h>
+#   include <sys/stat.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hasher.h"
+#include "deps.h"
+#include "dircache.h"
+#include "sha256.h"
+#include "profile.h"
+
+bool isDir(const std::string& path) {
+#ifdef _WIN32
+    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
+    const DWORD attrs = GetFileAttributesW(converter.from_bytes(path).c_str());
+    return attrs != INVALID_FILE_ATTRIBUTES &&
+           (attrs & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+}
+
+namespace {
+
+/**
+ * Reads and hashes a file and then reports it.
+ */
+void hashFile(ImplicitDeps* deps, DirCache* dirCache, const std::string& path) {
+    if (isDir(path)) {
+        // Listing the directory reports it.
+        dirCache->dirEntries(path);
+        return;
+    }
+
+    profile::Span span(profile::hash, path.data(), path.size());
+
+    uint8_t checksum[Sha256::digestLength];
+
+    const uint32_t status = checksumFile(path, checksum);
+    deps->addInput(path.data(), path.length(), status, checksum);
+}
+
+}
+
+uint32_t checksumFile(const std::string& path, uint8_t checksum[32]) {
+    memset(checksum, 0, Sha256::digestLength);
+
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f)
+        return errno == ENOENT ? 1 : 0;
+
+    Sha256 h;
+
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        h.update(buf, n);
+
+    const bool ok = ferror(f) == 0;
+    fclose(f);
+
+    if (!ok)
+        return 0;
+
+    h.finish(checksum);
+    return 2;
+}
+
+InputHasher::InputHasher(ImplicitDeps* deps, DirCache* dirCache,
+        ThreadPool& pool)
+    : _deps(deps), _dirCache(dirCache), _group(pool) {
+}
+
+InputHasher::~InputHasher() {
+    wait();
+}
+
+bool InputHasher::enabled() const {
+    return _deps && _deps->enabled();
+}
+
+void InputHasher::add(const char* path, size_t length) {
+    if (!enabled()) return;
+
+    ImplicitDeps* deps = _deps;
+    DirCache* dirCache = _dirCache;
+    std::string p(path, length);
+
+    _group.run([deps, dirCache, p] {
+        hashFile(deps, dirCache, p);
+    });
+}
+
+void InputHasher::add(const char* path, size_t length,
+        std::shared_ptr<const std::string> contents) {
+    if (!enabled()) return;
+
+    ImplicitDeps* deps = _deps;
+    std::string p(path, length);
+
+    _group.run([deps, p, contents] {
+        profile::Span span(profile::hash, p.data(), p.size());
+
+        uint8_t checksum[Sha256::digestLength];
+        Sha256::hash(contents->data(), contents->size(), checksum);
+        deps->addInput(p.data(), p.length(), 2, checksum);
+    });
+}
+
+void InputHasher::wait() {
+    _group.wait();
+}
@@ -0,0 +1,84 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Computes checksums of inputs for the parent build system.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+
+#include "threadpool.h"
+
+class ImplicitDeps;
+class DirCache;
+
+/**
+ * Returns true if the given path is a directory.
+ */
+bool isDir(const std::string& path);
+
+/**
+ * Computes the checksum of a file's contents. Returns the status to report the
+ * file with (see Dependency): 1 if it doesn't exist, 2 if the checksum was
+ * computed, or 0 if it couldn't be read.
+ */
+uint32_t checksumFile(const std::string& path, uint8_t checksum[32]);
+
+/**
+ * Reports inputs to the parent build system along with their checksums. The
+ * checksums are computed on the thread pool while the scripts keep running.
+ * This way, the parent build system doesn't need to read every input again.
+ *
+ * If inputs are neither sent to a parent build system nor recorded, nothing is
+ * done.
+ */
+class InputHasher {
+private:
+    ImplicitDeps* _deps;
+
+    // Directories are listed (and reported) through here.
+    DirCache* _dirCache;
+
+    // Checksums still being computed.
+    TaskGroup _group;
+
+public:
+    InputHasher(ImplicitDeps* deps, DirCache* dirCache, ThreadPool& pool);
+
+    /**
+     * Waits for any remaining checksums.
+     */
+    ~InputHasher();
+
+    InputHasher(const InputHasher&) = delete;
+    InputHasher& operator=(const InputHasher&) = delete;
+
+    /**
+     * Returns true if inputs are being reported at all. If not, there is no
+     * point in keeping file contents around for this.
+     */
+    bool enabled() const;
+
+    /**
+     * Reports a file or directory. The file is read on the thread pool.
+     */
+    void add(const char* path, size_t length);
+
+    /**
+     * Reports a file whose contents have already been read.
+     */
+    void add(const char* path, size_t length,
+            std::shared_ptr<const std::string> contents);
+
+    /**
+     * Waits for all checksums to be computed and reported.
+     */
+    void wait();
+};
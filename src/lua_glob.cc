@@ -10,36 +10,37 @@
 #include <string.h>
 #include <ctype.h>
 
-#include <algorithm>
-#include <mutex>
+#include <deque>
 #include <string>
-#include <set>
+#include <vector>
 
 #include "lua.hpp"
 
 #include "lua_glob.h"
 #include "path.h"
 #include "lua_globals.h"
+#include "profile.h"
 
-int lua_glob(lua_State* L) {
+namespace {
 
-    DirCache& dirCache = lua_globals::dirCache(L);
-    ThreadPool& pool = lua_globals::threadPool(L);
+/**
+ * Adds a glob expression. Expressions starting with '!' are exclusions.
+ */
+void addExpr(std::vector<GlobExpr>& exprs, const char* path, size_t len) {
+    if (len > 0 && path[0] == '!')
+        exprs.push_back(GlobExpr {Path(path+1, len-1), true});
+    else
+        exprs.push_back(GlobExpr {Path(path, len), false});
+}
 
-    std::mutex mutex;
-    std::set<std::string> paths;
+}
 
-    // Adds a path to the set.
-    MatchCallback include = [&] (Path path) {
-        std::lock_guard<std::mutex> lock(mutex);
-        paths.emplace(path.path, path.length);
-    };
+int lua_glob(lua_State* L) {
 
-    // Removes a path from the set.
-    MatchCallback exclude = [&] (Path path) {
-        std::lock_guard<std::mutex> lock(mutex);
-        paths.erase(std::string(path.path, path.length));
-    };
+    profile::Span span(profile::glob);
+
+    DirCache& dirCache = lua_globals::dirCache(L);
+    ThreadPool& pool = lua_globals::threadPool(L);
 
     int argc = lua_gettop(L);
 
@@ -57,6 +58,11 @@ int lua_glob(lua_State* L) {
     size_t len;
     const char* path;
 
+    // Note that strings stay alive while they are referenced by the arguments.
+    // Anything else converted to a string needs to be kept around.
+    std::vector<GlobExpr> exprs;
+    std::deque<std::string> converted;
+
     for (int i = 1; i <= argc; ++i) {
         const int type = lua_type(L, i);
 
@@ -70,10 +76,12 @@ int lua_glob(lua_State* L) {
 
                 path = lua_tolstring(L, -1, &len);
                 if (path) {
-                    if (len > 0 && path[0] == '!')
-                        dirCache.glob(root, Path(path+1, len-1), exclude, &pool);
-                    else
-                        dirCache.glob(root, Path(path, len), include, &pool);
+                    if (lua_type(L, -1) != LUA_TSTRING) {
+                        converted.emplace_back(path, len);
+                        path = converted.back().data();
+                    }
+
+                    addExpr(exprs, path, len);
                 }
 
                 lua_pop(L, 1); // Pop path
@@ -81,16 +89,15 @@ int lua_glob(lua_State* L) {
         }
         else if (type == LUA_TSTRING) {
             path = luaL_checklstring(L, i, &len);
-
-            if (len > 0 && path[0] == '!')
-                dirCache.glob(root, Path(path+1, len-1), exclude, &pool);
-            else
-                dirCache.glob(root, Path(path, len), include, &pool);
+            addExpr(exprs, path, len);
         }
     }
 
+    const DirCache::GlobResult result = dirCache.glob(root, exprs, &pool);
+    const std::vector<std::string>& paths = *result;
+
     // Construct the Lua table.
-    lua_newtable(L);
+    lua_createtable(L, (int)paths.size(), 0);
     lua_Integer n = 1;
 
     for (auto&& p: paths) {
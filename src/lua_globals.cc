@@ -44,4 +44,21 @@ DirCache& dirCache(lua_State* L) {
     return *dirCache;
 }
 
+InputHasher& inputHasher(lua_State* L) {
+    // Get the input hasher object.
+    lua_getglobal(L, "__INPUT_HASHER");
+    InputHasher* hasher = (InputHasher*)lua_topointer(L, -1);
+    lua_pop(L, 1); // Pop __INPUT_HASHER
+
+    if (!hasher) {
+        // This would probably only happen if someone messes with this global
+        // variable in a Lua script.
+        luaL_error(L, "__INPUT_HASHER does not point to any object");
+
+        // Never returns.
+    }
+
+    return *hasher;
+}
+
 }
@@ -10,6 +10,7 @@
 
 #include "threadpool.h"
 #include "dircache.h"
+#include "hasher.h"
 
 namespace lua_globals {
 
@@ -26,4 +27,9 @@ ThreadPool& threadPool(lua_State* L);
  */
 DirCache& dirCache(lua_State* L);
 
+/**
+ * Like threadPool, but returns the input hasher object.
+ */
+InputHasher& inputHasher(lua_State* L);
+
 }
@@ -0,0 +1,404 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Importing build scripts in parallel.
+ */
+#include "lua.hpp"
+
+#include <algorithm>
+
+#include "lua_import.h"
+#include "lua_serialize.h"
+#include "profile.h"
+
+namespace {
+
+/**
+ * Pushes the list of targets added so far.
+ */
+void push_targets(lua_State* L) {
+    lua_getglobal(L, "require");
+    lua_pushstring(L, "rules");
+    lua_call(L, 1, 1);
+
+    lua_getfield(L, -1, "targets");
+    lua_remove(L, -2);
+    lua_call(L, 0, 1);
+}
+
+}
+
+namespace buttonlua {
+
+struct Importer::Job {
+    // True if the job is to generate rules rather than to import a script.
+    bool generate;
+
+    // Script to import, as given to import().
+    std::string file;
+
+    // Serialized globals of the main script.
+    std::string globals;
+
+    // Rules added by the script.
+    Rules rules;
+
+    // Serialized list of targets. These are either the targets added by the
+    // imported script or the targets to generate rules for.
+    std::string targets;
+
+    bool failed;
+    std::string error;
+
+    Job(RuleFormat format, bool generate)
+        : generate(generate), rules(format), failed(false) {}
+};
+
+Importer::Importer(const Context& ctx, RuleFormat format, size_t threads,
+        bool neverFree)
+    : _ctx(ctx), _format(format), _neverFree(neverFree), _pool(threads),
+      _group(_pool) {
+}
+
+Importer::~Importer() {
+    _group.wait();
+}
+
+void Importer::baseline(lua_State* L) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        if (lua_type(L, -2) == LUA_TSTRING)
+            _baseline.insert(lua_tostring(L, -2));
+
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, 1);
+
+    // This is different for every script.
+    _baseline.erase("SCRIPT_DIR");
+
+    _modules.update(L);
+
+    lua_getglobal(L, "require");
+    lua_pushlightuserdata(L, &_modules);
+    lua_pushcclosure(L, require, 2);
+    lua_setglobal(L, "require");
+}
+
+/**
+ * Serializes whatever globals the main script has set up, followed by the
+ * changes it has made to modules. Any that can't be copied are left out.
+ */
+void Importer::copyGlobals(lua_State* L, std::string& buf) {
+    // Modules not loaded with require() are only found now.
+    _modules.update(L);
+
+    Serializer s(L, buf, &_modules);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        if (lua_type(L, -2) == LUA_TSTRING &&
+                _baseline.count(lua_tostring(L, -2)) == 0) {
+            const size_t mark = buf.size();
+            if (!s.add(-2) || !s.add(-1))
+                buf.resize(mark);
+        }
+
+        lua_pop(L, 1);
+    }
+
+    // The end of the globals
+    lua_pushnil(L);
+    s.add(-1);
+    lua_pop(L, 2);
+
+    s.changes();
+}
+
+/**
+ * Calls the original require() given as an upvalue and then indexes what it
+ * loaded, before the caller gets a chance to change it.
+ */
+int Importer::require(lua_State* L) {
+    ModuleIndex* modules = (ModuleIndex*)lua_touserdata(L, lua_upvalueindex(2));
+
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+
+    modules->update(L);
+
+    return lua_gettop(L);
+}
+
+void Importer::start(Job* job) {
+    _group.run([this, job] { run(*job); });
+}
+
+/**
+ * Waits for all jobs. Raises an error for the first one that failed.
+ */
+void Importer::finish(lua_State* L) {
+    _group.wait();
+
+    for (auto&& job: _jobs) {
+        if (job->failed)
+            luaL_error(L, "%s", job->error.c_str());
+    }
+}
+
+/**
+ * Appends the rules of all jobs, in order.
+ */
+void Importer::append(Rules& rules) {
+    for (auto&& job: _jobs)
+        rules.append(job->rules);
+
+    _jobs.clear();
+}
+
+int Importer::import(lua_State* L) {
+    size_t len;
+    const char* file = luaL_checklstring(L, 1, &len);
+
+    Job* job = new Job(_format, false);
+    _jobs.push_back(std::unique_ptr<Job>(job));
+
+    job->file.assign(file, len);
+
+    copyGlobals(L, job->globals);
+
+    // The targets get spliced in here later. This keeps them in the same
+    // order as if the script had been imported right now.
+    push_targets(L);
+    lua_pushlightuserdata(L, job);
+    lua_rawseti(L, -2, (lua_Integer)lua_rawlen(L, -2) + 1);
+    lua_pop(L, 1);
+
+    start(job);
+
+    return 0;
+}
+
+void Importer::wait(lua_State* L, Rules& rules) {
+    if (_jobs.empty())
+        return;
+
+    finish(L);
+
+    push_targets(L);
+    const int targets = lua_gettop(L);
+
+    lua_newtable(L);
+    const int merged = lua_gettop(L);
+
+    const size_t len = lua_rawlen(L, targets);
+    lua_Integer n = 0;
+
+    for (size_t i = 1; i <= len; ++i) {
+        lua_rawgeti(L, targets, (lua_Integer)i);
+
+        if (lua_type(L, -1) != LUA_TLIGHTUSERDATA) {
+            lua_rawseti(L, merged, ++n);
+            continue;
+        }
+
+        const Job* job = (const Job*)lua_touserdata(L, -1);
+        lua_pop(L, 1);
+
+        Deserializer d(L, job->targets.data(), job->targets.size());
+        d.next();
+
+        const size_t count = lua_rawlen(L, -1);
+        for (size_t j = 1; j <= count; ++j) {
+            lua_rawgeti(L, -1, (lua_Integer)j);
+            lua_rawseti(L, merged, ++n);
+        }
+
+        lua_pop(L, 2); // Pop the list and the references
+    }
+
+    // The rules module holds on to the same list, so it is updated in place.
+    for (lua_Integer i = 1; i <= n || i <= (lua_Integer)len; ++i) {
+        lua_rawgeti(L, merged, i);
+        lua_rawseti(L, targets, i);
+    }
+
+    lua_pop(L, 2);
+
+    append(rules);
+}
+
+void Importer::generate(lua_State* L, Rules& rules) {
+    wait(L, rules);
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    const size_t len = lua_rawlen(L, 1);
+    if (len == 0)
+        return;
+
+    // A few chunks per thread evens out targets that take longer than
+    // others. The chunks are contiguous so that appending them in order keeps
+    // the rules in order.
+    const size_t chunks = std::min(len, std::max<size_t>(_pool.size(), 1) * 4);
+
+    std::string globals;
+    copyGlobals(L, globals);
+
+    for (size_t c = 0; c < chunks; ++c) {
+        const size_t begin = len * c / chunks;
+        const size_t end = len * (c + 1) / chunks;
+
+        Job* job = new Job(_format, true);
+        _jobs.push_back(std::unique_ptr<Job>(job));
+
+        job->globals = globals;
+
+        lua_createtable(L, (int)(end - begin), 0);
+        for (size_t i = begin; i < end; ++i) {
+            lua_rawgeti(L, 1, (lua_Integer)i + 1);
+            lua_rawseti(L, -2, (lua_Integer)(i - begin) + 1);
+        }
+
+        bool ok;
+
+        {
+            Serializer s(L, job->targets, &_modules);
+            ok = s.add(-1, true);
+
+            if (!ok)
+                lua_pushfstring(L, "cannot generate rules in parallel: %s",
+                        s.error().c_str());
+        }
+
+        if (!ok)
+            lua_error(L);
+
+        lua_pop(L, 1);
+
+        start(job);
+    }
+
+    finish(L);
+    append(rules);
+}
+
+void Importer::run(Job& job) {
+    profile::Span span(profile::import, job.file.data(), job.file.size());
+
+    LuaAllocator allocator(_neverFree);
+
+    lua_State* L = new_state(allocator);
+    if (!L) {
+        job.failed = true;
+        job.error = "not enough memory for another Lua state";
+        return;
+    }
+
+    if (init(L) != 0) {
+        job.failed = true;
+        job.error = "failed to initialize another Lua state";
+        lua_close(L);
+        return;
+    }
+
+    register_globals(L, _ctx, job.rules, NULL);
+
+    lua_pushcfunction(L, runJob);
+    lua_pushlightuserdata(L, &job);
+
+    if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+        const char* msg = lua_tostring(L, -1);
+        job.failed = true;
+        job.error = msg ? msg : "unknown error";
+    }
+
+    lua_close(L);
+
+    profile::peak(profile::luaPeak, allocator.peak());
+}
+
+/**
+ * Runs a job in its own Lua state. The job is the only argument.
+ */
+int Importer::runJob(lua_State* L) {
+    Job& job = *(Job*)lua_touserdata(L, 1);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+    const int globals = lua_gettop(L);
+
+    {
+        Deserializer d(L, job.globals.data(), job.globals.size());
+
+        while (true) {
+            d.next(); // Key
+            if (lua_type(L, -1) == LUA_TNIL) {
+                lua_pop(L, 1);
+                break;
+            }
+
+            d.next(); // Value
+            lua_rawset(L, globals);
+        }
+
+        d.changes();
+    }
+
+    const int changes = lua_gettop(L);
+
+    if (job.generate) {
+        Deserializer d(L, job.targets.data(), job.targets.size());
+        d.next();
+
+        // Anything the targets refer to has been found by now, so the modules
+        // can be changed.
+        Deserializer::applyChanges(L, changes);
+
+        // Generate the rules for each target.
+        const size_t len = lua_rawlen(L, -1);
+        for (size_t i = 1; i <= len; ++i) {
+            lua_rawgeti(L, -1, (lua_Integer)i);
+            lua_getfield(L, -1, "rules");
+            lua_insert(L, -2);
+            lua_call(L, 1, 0);
+        }
+
+        return 0;
+    }
+
+    Deserializer::applyChanges(L, changes);
+    lua_settop(L, 1);
+
+    lua_getglobal(L, "import");
+    lua_pushlstring(L, job.file.data(), job.file.size());
+    lua_call(L, 1, 0);
+
+    push_targets(L);
+
+    bool ok;
+
+    {
+        Serializer s(L, job.targets);
+        ok = s.add(-1, true);
+
+        if (!ok)
+            lua_pushfstring(L, "cannot import '%s' in parallel: %s",
+                    job.file.c_str(), s.error().c_str());
+    }
+
+    if (!ok)
+        lua_error(L);
+
+    return 0;
+}
+
+}
@@ -0,0 +1,133 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Importing build scripts in parallel.
+ */
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "threadpool.h"
+#include "rules.h"
+#include "button-lua.h"
+#include "lua_serialize.h"
+
+namespace buttonlua {
+
+/**
+ * Runs imported build scripts in parallel, each in its own Lua state.
+ *
+ * import() returns right away in the main script. The imported script runs
+ * with a copy of the main script's globals, so anything set up before the
+ * import is still there. Modules are loaded again in the imported script's
+ * state, after which any fields the main script has changed in them since it
+ * loaded them are changed there too (see ModuleIndex). The targets it adds are
+ * later copied back into the main state (see Serializer for what can be
+ * copied) and its rules are kept aside. Both are merged in the order the
+ * scripts were imported in, so the output is exactly the same as if they had
+ * been imported one after another.
+ *
+ * This comes with a few restrictions. Globals set by an imported script, and
+ * changes it makes to modules, are not seen by the rest of the build. Changes
+ * the main script makes to a module's local variables are not seen by imported
+ * scripts. Scripts imported by an imported script are imported as usual, in
+ * the same Lua state.
+ *
+ * Once all targets are known, their rules can also be generated in parallel.
+ * The targets are split up into chunks that each get their own Lua state, and
+ * the rules of each chunk are appended in order. Unlike rules.resolve(), this
+ * resolves the dependencies of every target before any rules are generated, so
+ * the dependencies of a dependency are always resolved too.
+ *
+ * Imports run on their own thread pool. Scripts waiting on a glob help out
+ * with other tasks in the meantime, which must never be another whole import.
+ */
+class Importer
+{
+private:
+    struct Job;
+
+    const Context _ctx;
+    const RuleFormat _format;
+
+    // Whether the Lua states never free small blocks of memory.
+    const bool _neverFree;
+
+    // Names of the globals that every Lua state has to begin with. These are
+    // not copied.
+    std::unordered_set<std::string> _baseline;
+
+    // Modules loaded by the main state, as they were when they were loaded.
+    ModuleIndex _modules;
+
+    ThreadPool _pool;
+    TaskGroup _group;
+
+    // Imports that have not been merged yet, in order.
+    std::vector<std::unique_ptr<Job>> _jobs;
+
+public:
+    Importer(const Context& ctx, RuleFormat format, size_t threads,
+            bool neverFree = false);
+
+    /**
+     * Waits for any remaining imports. Their results are thrown away.
+     */
+    ~Importer();
+
+    Importer(const Importer&) = delete;
+    Importer& operator=(const Importer&) = delete;
+
+    /**
+     * Remembers the globals and modules of the main Lua state before it runs
+     * any script. From then on, modules loaded with require() are indexed as
+     * soon as they are loaded.
+     */
+    void baseline(lua_State* L);
+
+    /**
+     * Starts importing the script given at the bottom of the stack. This has
+     * the same interface as the import() function in Lua.
+     */
+    int import(lua_State* L);
+
+    /**
+     * Returns true if there are imports that have not been merged yet.
+     */
+    bool pending() const {
+        return !_jobs.empty();
+    }
+
+    /**
+     * Waits for all the imports started so far and merges them into the main
+     * state and the given rules. Raises a Lua error if any of them failed.
+     */
+    void wait(lua_State* L, Rules& rules);
+
+    /**
+     * Generates the rules for the list of targets at the bottom of the stack
+     * and appends them to the given rules, in order. The dependencies of the
+     * targets must already be resolved. Each target's rules() method only
+     * sees the globals of the main script, the changes it made to modules,
+     * the target itself, and what it refers to.
+     */
+    void generate(lua_State* L, Rules& rules);
+
+private:
+    void copyGlobals(lua_State* L, std::string& buf);
+    void start(Job* job);
+    void finish(lua_State* L);
+    void append(Rules& rules);
+
+    void run(Job& job);
+    static int runJob(lua_State* L);
+    static int require(lua_State* L);
+};
+
+}
@@ -0,0 +1,172 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Loading of Lua scripts from disk.
+ */
+#ifdef _WIN32
+#   define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <memory>
+#include <string>
+
+#include "lua.hpp"
+
+#include "lua_load.h"
+#include "lua_globals.h"
+#include "hasher.h"
+
+namespace {
+
+/**
+ * Reads an entire file into memory.
+ */
+bool readFile(const char* filename, std::string& contents) {
+    FILE* f = fopen(filename, "rb");
+    if (!f) return false;
+
+    char buf[1 << 14];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        contents.append(buf, n);
+
+    const bool ok = ferror(f) == 0;
+    fclose(f);
+
+    return ok;
+}
+
+/**
+ * Skips the parts of a file that luaL_loadfilex also skips: a UTF-8 BOM and a
+ * first line starting with '#'. The newline is kept so that line numbers stay
+ * the same.
+ */
+const char* skipHeader(const char* p, const char* end) {
+    if (end - p >= 3 && memcmp(p, "\xEF\xBB\xBF", 3) == 0)
+        p += 3;
+
+    if (p < end && *p == '#') {
+        while (p < end && *p != '\n')
+            ++p;
+
+        // A precompiled chunk can follow the comment.
+        if (end - p > 1 && p[1] == LUA_SIGNATURE[0])
+            ++p;
+    }
+
+    return p;
+}
+
+/**
+ * Same as what the base library's loadfile does after loading.
+ */
+int loadResult(lua_State* L, int status, int env) {
+    if (status == LUA_OK) {
+        if (env != 0) {
+            // The environment is the first upvalue of the main chunk.
+            lua_pushvalue(L, env);
+            if (!lua_setupvalue(L, -2, 1))
+                lua_pop(L, 1);
+        }
+
+        return 1;
+    }
+
+    // Return nil plus the error message.
+    lua_pushnil(L);
+    lua_insert(L, -2);
+    return 2;
+}
+
+}
+
+int load_file(lua_State* L, const char* filename, const char* mode) {
+    InputHasher& hasher = lua_globals::inputHasher(L);
+
+    std::shared_ptr<std::string> contents = std::make_shared<std::string>();
+
+    if (!readFile(filename, *contents)) {
+        lua_pushfstring(L, "cannot open %s: %s", filename, strerror(errno));
+
+        // The file still needs to be reported so that the script is rerun if
+        // it shows up.
+        hasher.add(filename, strlen(filename));
+        return LUA_ERRFILE;
+    }
+
+    // The checksum is computed on the thread pool while Lua parses the same
+    // bytes.
+    hasher.add(filename, strlen(filename), contents);
+
+    const char* begin = contents->data();
+    const char* end = begin + contents->size();
+    const char* p = skipHeader(begin, end);
+
+    lua_pushfstring(L, "@%s", filename);
+    const int status = luaL_loadbufferx(L, p, (size_t)(end - p),
+            lua_tostring(L, -1), mode);
+    lua_remove(L, -2); // Pop chunk name
+
+    return status;
+}
+
+int lua_loadfile(lua_State* L) {
+    const char* filename = luaL_optstring(L, 1, NULL);
+    const char* mode = luaL_optstring(L, 2, NULL);
+    const int env = !lua_isnone(L, 3) ? 3 : 0;
+
+    // Reading from stdin is left to Lua.
+    const int status = filename ? load_file(L, filename, mode)
+                                : luaL_loadfilex(L, NULL, mode);
+
+    return loadResult(L, status, env);
+}
+
+int lua_dofile(lua_State* L) {
+    const char* filename = luaL_optstring(L, 1, NULL);
+    lua_settop(L, 1);
+
+    const int status = filename ? load_file(L, filename)
+                                : luaL_loadfile(L, NULL);
+    if (status != LUA_OK)
+        return lua_error(L);
+
+    lua_call(L, 0, LUA_MULTRET);
+    return lua_gettop(L) - 1;
+}
+
+int lua_file_searcher(lua_State* L) {
+    const char* name = luaL_checkstring(L, 1);
+
+    // Let package.searchpath find the file so that package.path is handled the
+    // same way as the standard searcher.
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "searchpath");
+    lua_pushvalue(L, 1);
+    lua_getfield(L, -3, "path");
+
+    if (lua_type(L, -1) != LUA_TSTRING)
+        return luaL_error(L, "'package.path' must be a string");
+
+    lua_call(L, 2, 2);
+
+    if (lua_isnil(L, -2))
+        return 1; // Error message listing the files tried
+
+    const char* filename = lua_tostring(L, -2);
+
+    if (load_file(L, filename) == LUA_OK) {
+        lua_pushstring(L, filename);
+        return 2;
+    }
+
+    return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s",
+            name, filename, lua_tostring(L, -1));
+}
@@ -0,0 +1,36 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Loading of Lua scripts from disk.
+ */
+#pragma once
+
+struct lua_State;
+
+/**
+ * Loads a Lua script from disk. The file is read into memory once and those
+ * same bytes are both checksummed for the parent build system and handed to
+ * Lua.
+ *
+ * This has the same interface as luaL_loadfilex and, just like it, pushes
+ * either the compiled chunk or an error message.
+ */
+int load_file(lua_State* L, const char* filename, const char* mode = nullptr);
+
+/**
+ * Replacement for the standard loadfile function.
+ */
+int lua_loadfile(lua_State* L);
+
+/**
+ * Replacement for the standard dofile function.
+ */
+int lua_dofile(lua_State* L);
+
+/**
+ * Replacement for the standard Lua file searcher (package.searchers[2]).
+ */
+int lua_file_searcher(lua_State* L);
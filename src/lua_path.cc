@@ -8,6 +8,8 @@
  */
 #include "lua_path.h"
 
+#include <string>
+
 #include "path.h"
 
 #include "lua.hpp"
@@ -153,9 +155,117 @@ static int path_norm(lua_State* L) {
     size_t len;
     const char* path = luaL_checklstring(L, 1, &len);
 
-    auto buf = Path(path, len).norm();
+    const Path p(path, len);
+
+    // Most paths are already normalized. Return the same string.
+    if (p.isNorm()) {
+        lua_settop(L, 1);
+        return 1;
+    }
+
+    luaL_Buffer b;
+    char* buf = luaL_buffinitsize(L, &b, len + 1);
+    luaL_pushresultsize(&b, p.norm(buf));
+
+    return 1;
+}
+
+/**
+ * Normalizes the joining of a base path with every path in a table, with an
+ * optional suffix appended to each. That is, for each path p, this is the same
+ * as norm(join(base, p .. suffix)). Returns a new table.
+ */
+template<class Path>
+static int path_joinnorm(lua_State* L) {
+    size_t baselen, suffixlen;
+    const char* base = luaL_checklstring(L, 1, &baselen);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    const char* suffix = luaL_optlstring(L, 3, "", &suffixlen);
+
+    const lua_Integer n = (lua_Integer)lua_rawlen(L, 2);
+
+    lua_createtable(L, (int)n, 0);
+
+    lua_Integer bad = 0;
+
+    {
+        // Reused for every path so that only the resulting strings need to be
+        // allocated.
+        std::string joined, normed;
+
+        for (lua_Integer i = 1; i <= n; ++i) {
+            lua_rawgeti(L, 2, i);
+
+            size_t len;
+            const char* path = lua_tolstring(L, -1, &len);
+            if (!path) {
+                bad = i;
+                break;
+            }
+
+            joined.assign(base, baselen);
+            Path(path, len).join(joined);
+            joined.append(suffix, suffixlen);
+
+            Path(joined.data(), joined.size()).norm(normed);
+
+            lua_pop(L, 1);
+            lua_pushlstring(L, normed.data(), normed.size());
+            lua_rawseti(L, -2, i);
+        }
+    }
+
+    // Errors don't unwind the stack, so this must be done outside of the
+    // block above.
+    if (bad)
+        return luaL_error(L, "bad path at index %d (string expected, got %s)",
+                (int)bad, luaL_typename(L, -1));
+
+    return 1;
+}
+
+/**
+ * Changes the extension of every path in a table. Returns a new table.
+ */
+template<class Path>
+static int path_setexts(lua_State* L) {
+    size_t extlen;
+    luaL_checktype(L, 1, LUA_TTABLE);
+    const char* ext = luaL_checklstring(L, 2, &extlen);
+
+    const lua_Integer n = (lua_Integer)lua_rawlen(L, 1);
+
+    lua_createtable(L, (int)n, 0);
+
+    lua_Integer bad = 0;
+
+    {
+        std::string buf;
+
+        for (lua_Integer i = 1; i <= n; ++i) {
+            lua_rawgeti(L, 1, i);
+
+            size_t len;
+            const char* path = lua_tolstring(L, -1, &len);
+            if (!path) {
+                bad = i;
+                break;
+            }
+
+            const Split<Path> s = Path(path, len).splitExtension();
+
+            buf.assign(s.head.path, s.head.length);
+            buf.append(ext, extlen);
+
+            lua_pop(L, 1);
+            lua_pushlstring(L, buf.data(), buf.size());
+            lua_rawseti(L, -2, i);
+        }
+    }
 
-    lua_pushlstring(L, buf.data(), buf.length());
+    if (bad)
+        return luaL_error(L, "bad path at index %d (string expected, got %s)",
+                (int)bad, luaL_typename(L, -1));
 
     return 1;
 }
@@ -179,8 +289,10 @@ static const luaL_Reg pathlib_posix[] = {
     {"splitext", path_splitext<PosixPath>},
     {"getext", path_getext<PosixPath>},
     {"setext", path_setext<PosixPath>},
+    {"setexts", path_setexts<PosixPath>},
     {"components", path_components<PosixPath>},
     {"norm", path_norm<PosixPath>},
+    {"joinnorm", path_joinnorm<PosixPath>},
     {"matches", path_matches<PosixPath>},
     {NULL, NULL}
 };
@@ -195,8 +307,10 @@ static const luaL_Reg pathlib_win[] = {
     {"splitext", path_splitext<WinPath>},
     {"getext", path_getext<WinPath>},
     {"setext", path_setext<WinPath>},
+    {"setexts", path_setexts<WinPath>},
     {"components", path_components<WinPath>},
     {"norm", path_norm<WinPath>},
+    {"joinnorm", path_joinnorm<WinPath>},
     {"matches", path_matches<WinPath>},
     {NULL, NULL}
 };
@@ -0,0 +1,955 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Serialization of Lua values so that they can be moved from one Lua state to
+ * another.
+ */
+#include "lua.hpp"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "lua_serialize.h"
+#include "output.h"
+
+namespace {
+
+/**
+ * Identifies the type of each serialized value.
+ */
+enum Tag : char {
+    tagNil,
+    tagFalse,
+    tagTrue,
+    tagInteger,
+    tagNumber,
+    tagString,
+    tagTable,    // Array items, key/value pairs, tagEnd, then the metatable.
+    tagEnd,
+    tagRef,      // A table or function that was already serialized.
+    tagGlobals,  // The global table.
+    tagModule,   // A table or function that belongs to a module.
+    tagCFunction,
+    tagLFunction, // Bytecode followed by the upvalues.
+};
+
+/**
+ * Steps in the path to a value that belongs to a module.
+ */
+enum Step : char {
+    stepEnd,
+    stepField,
+    stepMetatable,
+    stepUpvalue,
+};
+
+void appendU32(std::string& buf, uint32_t x) {
+    char p[4] = {
+        (char)(x & 0xFF),
+        (char)((x >> 8) & 0xFF),
+        (char)((x >> 16) & 0xFF),
+        (char)((x >> 24) & 0xFF),
+    };
+
+    buf.append(p, 4);
+}
+
+void appendString(std::string& buf, const char* s, size_t len) {
+    appendU32(buf, (uint32_t)len);
+    buf.append(s, len);
+}
+
+int dumpWriter(lua_State* L, const void* p, size_t size, void* ud) {
+    ((std::string*)ud)->append((const char*)p, size);
+    return 0;
+}
+
+struct Chunk {
+    const char* data;
+    size_t length;
+};
+
+const char* chunkReader(lua_State* L, void* ud, size_t* size) {
+    Chunk* chunk = (Chunk*)ud;
+
+    *size = chunk->length;
+    chunk->length = 0;
+
+    return *size ? chunk->data : NULL;
+}
+
+/**
+ * Queues up the table or function at the top of the stack to be searched, if
+ * it hasn't been seen before. The values still to be searched are kept in the
+ * table at the given index of the stack, along with their paths. The visitor
+ * is called with the value at the top of the stack and returns false if it
+ * was already seen.
+ */
+template <typename Visit>
+void enqueue(lua_State* L, int queue, std::vector<std::string>& paths,
+        const std::string& path, Visit& visit) {
+
+    const int type = lua_type(L, -1);
+    if (type != LUA_TTABLE && type != LUA_TFUNCTION)
+        return;
+
+    if (!visit(path))
+        return;
+
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, queue, (lua_Integer)paths.size() + 1);
+    paths.push_back(path);
+}
+
+/**
+ * Queues up the modules in package.loaded, at the given index of the stack,
+ * whose names are accepted by the filter.
+ */
+template <typename Filter, typename Visit>
+void enqueueModules(lua_State* L, int loaded, int queue,
+        std::vector<std::string>& paths, Filter& filter, Visit& visit) {
+
+    lua_pushnil(L);
+    while (lua_next(L, loaded)) {
+        if (lua_type(L, -2) == LUA_TSTRING) {
+            size_t len;
+            const char* name = lua_tolstring(L, -2, &len);
+
+            if (filter(name, len)) {
+                std::string path;
+                appendString(path, name, len);
+                enqueue(L, queue, paths, path, visit);
+            }
+        }
+
+        lua_pop(L, 1);
+    }
+}
+
+/**
+ * Searches everything that can be reached from the queued up values through
+ * fields, metatables, and upvalues. This is breadth first so that each value
+ * is found by its shortest path.
+ */
+template <typename Visit>
+void search(lua_State* L, int queue, std::vector<std::string>& paths,
+        Visit& visit) {
+
+    for (size_t i = 0; i < paths.size(); ++i) {
+        const std::string path = paths[i];
+
+        lua_rawgeti(L, queue, (lua_Integer)i + 1);
+
+        if (lua_type(L, -1) == LUA_TTABLE) {
+            if (lua_getmetatable(L, -1)) {
+                enqueue(L, queue, paths, path + (char)stepMetatable, visit);
+                lua_pop(L, 1);
+            }
+
+            lua_pushnil(L);
+            while (lua_next(L, -2)) {
+                if (lua_type(L, -2) == LUA_TSTRING) {
+                    size_t len;
+                    const char* key = lua_tolstring(L, -2, &len);
+
+                    std::string child = path + (char)stepField;
+                    appendString(child, key, len);
+                    enqueue(L, queue, paths, child, visit);
+                }
+
+                lua_pop(L, 1);
+            }
+        }
+        else {
+            for (int j = 1; lua_getupvalue(L, -1, j); ++j) {
+                std::string child = path + (char)stepUpvalue;
+                appendU32(child, (uint32_t)j);
+                enqueue(L, queue, paths, child, visit);
+                lua_pop(L, 1);
+            }
+        }
+
+        lua_pop(L, 1);
+    }
+}
+
+}
+
+void ModuleIndex::update(lua_State* L) {
+    if (!lua_checkstack(L, 12))
+        return;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+    if (lua_type(L, -1) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        return;
+    }
+
+    const int loaded = lua_gettop(L);
+
+    push(L);
+    const int objects = lua_gettop(L);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+    const void* globals = lua_topointer(L, -1);
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    const int queue = lua_gettop(L);
+    std::vector<std::string> paths;
+
+    std::vector<std::string> names;
+
+    auto filter = [&](const char* name, size_t len) {
+        names.emplace_back(name, len);
+        if (_names.insert(names.back()).second)
+            return true;
+
+        names.pop_back();
+        return false;
+    };
+
+    auto visit = [&](const std::string& path) {
+        const void* p = lua_topointer(L, -1);
+        if (p == globals || !_paths.emplace(p, path).second)
+            return false;
+
+        // Nothing else can have the same address as long as it is alive.
+        lua_pushvalue(L, -1);
+        lua_pushboolean(L, 1);
+        lua_rawset(L, objects);
+        return true;
+    };
+
+    enqueueModules(L, loaded, queue, paths, filter, visit);
+    search(L, queue, paths, visit);
+
+    lua_pop(L, 1); // Pop the queue
+
+    for (auto&& name: names) {
+        lua_pushlstring(L, name.data(), name.size());
+        lua_rawget(L, loaded);
+        copyFields(L, objects, loaded);
+    }
+
+    lua_pop(L, 2); // Pop the objects and _LOADED
+}
+
+/**
+ * Copies the fields of the module at the top of the stack, and of every table
+ * that can be reached from it through fields, into the table of objects. The
+ * module is popped. The index of package.loaded is also given.
+ */
+void ModuleIndex::copyFields(lua_State* L, int objects, int loaded) {
+    const void* skip = lua_topointer(L, loaded);
+
+    lua_newtable(L);
+    lua_insert(L, -2);
+
+    const int stack = lua_gettop(L) - 1;
+    lua_Integer n = 0;
+
+    lua_rawseti(L, stack, ++n);
+
+    while (n > 0) {
+        lua_rawgeti(L, stack, n);
+        lua_pushnil(L);
+        lua_rawseti(L, stack, n--);
+
+        const int t = lua_gettop(L);
+
+        // Only tables that have a path can be found again. The fields of any
+        // table are copied only once. Modules loaded later would count as
+        // changes to package.loaded, so that is left out.
+        if (lua_type(L, t) != LUA_TTABLE || lua_topointer(L, t) == skip ||
+                !find(lua_topointer(L, t))) {
+            lua_pop(L, 1);
+            continue;
+        }
+
+        lua_pushvalue(L, t);
+        lua_rawget(L, objects);
+        const bool copied = lua_type(L, -1) == LUA_TTABLE;
+        lua_pop(L, 1);
+
+        if (copied) {
+            lua_pop(L, 1);
+            continue;
+        }
+
+        lua_newtable(L);
+        const int copy = lua_gettop(L);
+
+        lua_pushnil(L);
+        while (lua_next(L, t)) {
+            lua_pushvalue(L, -2);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, copy);
+
+            if (lua_type(L, -2) == LUA_TSTRING &&
+                    lua_type(L, -1) == LUA_TTABLE) {
+                lua_pushvalue(L, -1);
+                lua_rawseti(L, stack, ++n);
+            }
+
+            lua_pop(L, 1);
+        }
+
+        lua_pushvalue(L, t);
+        lua_pushvalue(L, copy);
+        lua_rawset(L, objects);
+
+        lua_pop(L, 2); // Pop the copy and the table
+    }
+
+    lua_pop(L, 1); // Pop the stack
+}
+
+const std::string* ModuleIndex::find(const void* p) const {
+    auto it = _paths.find(p);
+    return it == _paths.end() ? NULL : &it->second;
+}
+
+void ModuleIndex::push(lua_State* L) const {
+    lua_rawgetp(L, LUA_REGISTRYINDEX, this);
+    if (lua_type(L, -1) == LUA_TTABLE)
+        return;
+
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, this);
+}
+
+Serializer::Serializer(lua_State* L, std::string& buf,
+        const ModuleIndex* index)
+    : L(L), _buf(buf), _indexed(false), _index(index) {
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+    _globals = lua_topointer(L, -1);
+    lua_pop(L, 1);
+}
+
+bool Serializer::add(int index, bool copy) {
+    const size_t length = _buf.size();
+    const uint32_t refs = (uint32_t)_refs.size();
+
+    if (!value(lua_absindex(L, index), copy)) {
+        rollback(length, refs);
+        return false;
+    }
+
+    return true;
+}
+
+void Serializer::rollback(size_t length, uint32_t refs) {
+    _buf.resize(length);
+
+    for (auto it = _refs.begin(); it != _refs.end(); ) {
+        if (it->second >= refs)
+            it = _refs.erase(it);
+        else
+            ++it;
+    }
+}
+
+bool Serializer::value(int index, bool copy) {
+    index = lua_absindex(L, index);
+
+    const int type = lua_type(L, index);
+
+    switch (type) {
+        case LUA_TNIL:
+            _buf.push_back(tagNil);
+            return true;
+
+        case LUA_TBOOLEAN:
+            _buf.push_back(lua_toboolean(L, index) ? tagTrue : tagFalse);
+            return true;
+
+        case LUA_TNUMBER:
+            number(index);
+            return true;
+
+        case LUA_TSTRING: {
+            size_t len;
+            const char* s = lua_tolstring(L, index, &len);
+            _buf.push_back(tagString);
+            appendString(_buf, s, len);
+            return true;
+        }
+
+        case LUA_TTABLE:
+        case LUA_TFUNCTION:
+            return reference(index, copy);
+    }
+
+    _error = std::string("cannot copy a ") + lua_typename(L, type) + " value";
+    return false;
+}
+
+void Serializer::number(int index) {
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger(L, index)) {
+        const uint64_t x = (uint64_t)lua_tointeger(L, index);
+        _buf.push_back(tagInteger);
+        appendU32(_buf, (uint32_t)x);
+        appendU32(_buf, (uint32_t)(x >> 32));
+        return;
+    }
+#endif
+
+    const lua_Number n = lua_tonumber(L, index);
+    _buf.push_back(tagNumber);
+    _buf.append((const char*)&n, sizeof(n));
+}
+
+bool Serializer::reference(int index, bool copy) {
+    const void* p = lua_topointer(L, index);
+
+    if (p == _globals) {
+        _buf.push_back(tagGlobals);
+        return true;
+    }
+
+    if (lua_iscfunction(L, index)) {
+        // C functions without upvalues can just be pushed again.
+        if (!lua_getupvalue(L, index, 1)) {
+            const lua_CFunction f = lua_tocfunction(L, index);
+            _buf.push_back(tagCFunction);
+            _buf.append((const char*)&f, sizeof(f));
+            return true;
+        }
+
+        lua_pop(L, 1);
+    }
+
+    auto it = _refs.find(p);
+    if (it != _refs.end()) {
+        _buf.push_back(tagRef);
+        appendU32(_buf, it->second);
+        return true;
+    }
+
+    if (!copy) {
+        const std::string* path = findModule(p);
+        if (path) {
+            _refs.emplace(p, (uint32_t)_refs.size());
+            _buf.push_back(tagModule);
+            _buf.append(*path);
+            _buf.push_back(stepEnd);
+            return true;
+        }
+    }
+
+    if (!lua_checkstack(L, 4)) {
+        _error = "value is too deeply nested";
+        return false;
+    }
+
+    if (lua_type(L, index) == LUA_TTABLE) {
+        _refs.emplace(p, (uint32_t)_refs.size());
+        return table(index);
+    }
+
+    return function(index);
+}
+
+bool Serializer::table(int index) {
+    _buf.push_back(tagTable);
+
+    const size_t n = lua_rawlen(L, index);
+    appendU32(_buf, (uint32_t)n);
+
+    for (size_t i = 1; i <= n; ++i) {
+        lua_rawgeti(L, index, (lua_Integer)i);
+        const bool ok = value(-1, false);
+        lua_pop(L, 1);
+
+        if (!ok) return false;
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, index)) {
+        if (lua_type(L, -2) == LUA_TNUMBER) {
+            // Skip what was already done as part of the array.
+            const lua_Number k = lua_tonumber(L, -2);
+            if (k >= 1 && k <= (lua_Number)n && k == (lua_Number)(size_t)k) {
+                lua_pop(L, 1);
+                continue;
+            }
+        }
+
+        if (!value(-2, false) || !value(-1, false)) {
+            lua_pop(L, 2);
+            return false;
+        }
+
+        lua_pop(L, 1);
+    }
+
+    _buf.push_back(tagEnd);
+
+    if (!lua_getmetatable(L, index)) {
+        _buf.push_back(tagNil);
+        return true;
+    }
+
+    const bool ok = value(-1, false);
+    lua_pop(L, 1);
+    return ok;
+}
+
+bool Serializer::function(int index) {
+    if (lua_iscfunction(L, index)) {
+        _error = "cannot copy a C function with upvalues";
+        return false;
+    }
+
+    std::string code;
+
+    lua_pushvalue(L, index);
+#if LUA_VERSION_NUM >= 503
+    const int ret = lua_dump(L, dumpWriter, &code, 0);
+#else
+    const int ret = lua_dump(L, dumpWriter, &code);
+#endif
+    lua_pop(L, 1);
+
+    if (ret != 0) {
+        _error = "cannot copy a function";
+        return false;
+    }
+
+    // The function must be numbered before its upvalues in case it refers to
+    // itself.
+    _refs.emplace(lua_topointer(L, index), (uint32_t)_refs.size());
+
+    _buf.push_back(tagLFunction);
+    appendString(_buf, code.data(), code.size());
+
+    int n = 0;
+    while (lua_getupvalue(L, index, n + 1)) {
+        lua_pop(L, 1);
+        ++n;
+    }
+
+    appendU32(_buf, (uint32_t)n);
+
+    for (int i = 1; i <= n; ++i) {
+        lua_getupvalue(L, index, i);
+        const bool ok = value(-1, false);
+        lua_pop(L, 1);
+
+        if (!ok) return false;
+    }
+
+    return true;
+}
+
+const std::string* Serializer::findModule(const void* p) {
+    if (_index)
+        return _index->find(p);
+
+    if (!_indexed)
+        indexModules();
+
+    auto it = _modules.find(p);
+    return it == _modules.end() ? NULL : &it->second;
+}
+
+void Serializer::indexModules() {
+    _indexed = true;
+
+    if (!lua_checkstack(L, 8))
+        return;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+    if (lua_type(L, -1) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        return;
+    }
+
+    lua_newtable(L);
+    const int queue = lua_gettop(L);
+    std::vector<std::string> paths;
+
+    auto filter = [](const char*, size_t) {
+        return true;
+    };
+
+    auto visit = [this](const std::string& path) {
+        const void* p = lua_topointer(L, -1);
+        return p != _globals && _modules.emplace(p, path).second;
+    };
+
+    enqueueModules(L, queue - 1, queue, paths, filter, visit);
+    search(L, queue, paths, visit);
+
+    lua_pop(L, 2); // Pop the queue and _LOADED
+}
+
+void Serializer::changes() {
+    if (_index && lua_checkstack(L, 8)) {
+        _index->push(L);
+        const int objects = lua_gettop(L);
+
+        lua_pushnil(L);
+        while (lua_next(L, objects)) {
+            if (lua_type(L, -1) == LUA_TTABLE) {
+                const int copy = lua_gettop(L);
+                const int table = copy - 1;
+
+                // Fields that were added or changed
+                lua_pushnil(L);
+                while (lua_next(L, table)) {
+                    lua_pushvalue(L, -2);
+                    lua_rawget(L, copy);
+
+                    if (!lua_rawequal(L, -1, -2))
+                        change(table, -3, -2);
+
+                    lua_pop(L, 2);
+                }
+
+                // Fields that were removed
+                lua_pushnil(L);
+                while (lua_next(L, copy)) {
+                    lua_pushvalue(L, -2);
+                    lua_rawget(L, table);
+
+                    if (lua_type(L, -1) == LUA_TNIL)
+                        change(table, -3, -1);
+
+                    lua_pop(L, 2);
+                }
+            }
+
+            lua_pop(L, 1);
+        }
+
+        lua_pop(L, 1);
+    }
+
+    _buf.push_back(tagFalse);
+}
+
+/**
+ * Serializes a change to a field of a module's table, unless the key or the
+ * value can't be. Each change is the value, the table, and the key.
+ */
+void Serializer::change(int table, int key, int value) {
+    key = lua_absindex(L, key);
+    value = lua_absindex(L, value);
+
+    // Other keys might not be serializable and would be too hard to undo.
+    const int type = lua_type(L, key);
+    if (type != LUA_TSTRING && type != LUA_TNUMBER && type != LUA_TBOOLEAN)
+        return;
+
+    _buf.push_back(tagTrue);
+
+    if (!add(value)) {
+        _buf.pop_back();
+        return;
+    }
+
+    add(table);
+    add(key);
+}
+
+Deserializer::Deserializer(lua_State* L, const char* data, size_t length)
+    : L(L), _p(data), _end(data + length), _nrefs(0) {
+
+    lua_newtable(L);
+    _refs = lua_gettop(L);
+}
+
+void Deserializer::next() {
+    luaL_checkstack(L, 4, "value is too deeply nested");
+
+    need(1);
+    const char tag = *_p++;
+
+    switch (tag) {
+        case tagNil:
+            lua_pushnil(L);
+            break;
+
+        case tagFalse:
+        case tagTrue:
+            lua_pushboolean(L, tag == tagTrue);
+            break;
+
+        case tagInteger: {
+            const uint64_t lo = u32();
+            const uint64_t x = lo | ((uint64_t)u32() << 32);
+#if LUA_VERSION_NUM >= 503
+            lua_pushinteger(L, (lua_Integer)x);
+#else
+            lua_pushnumber(L, (lua_Number)(int64_t)x);
+#endif
+            break;
+        }
+
+        case tagNumber: {
+            lua_Number n;
+            need(sizeof(n));
+            memcpy(&n, _p, sizeof(n));
+            _p += sizeof(n);
+            lua_pushnumber(L, n);
+            break;
+        }
+
+        case tagString: {
+            const size_t len = u32();
+            need(len);
+            lua_pushlstring(L, _p, len);
+            _p += len;
+            break;
+        }
+
+        case tagTable:
+            table();
+            break;
+
+        case tagRef:
+            lua_rawgeti(L, _refs, (lua_Integer)u32() + 1);
+            break;
+
+        case tagGlobals:
+            lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+            break;
+
+        case tagModule:
+            if (!module())
+                lua_error(L);
+            addRef();
+            break;
+
+        case tagCFunction: {
+            lua_CFunction f;
+            need(sizeof(f));
+            memcpy(&f, _p, sizeof(f));
+            _p += sizeof(f);
+            lua_pushcfunction(L, f);
+            break;
+        }
+
+        case tagLFunction:
+            function();
+            break;
+
+        default:
+            malformed();
+    }
+}
+
+void Deserializer::changes() {
+    lua_newtable(L);
+    const int list = lua_gettop(L);
+    lua_Integer n = 0;
+
+    while (true) {
+        need(1);
+        const char tag = *_p++;
+
+        if (tag == tagFalse)
+            break;
+
+        if (tag != tagTrue)
+            malformed();
+
+        lua_createtable(L, 3, 0);
+        next(); // Value
+        lua_rawseti(L, -2, 3);
+        next(); // Table
+        lua_rawseti(L, -2, 1);
+        next(); // Key
+        lua_rawseti(L, -2, 2);
+
+        lua_rawseti(L, list, ++n);
+    }
+}
+
+void Deserializer::applyChanges(lua_State* L, int index) {
+    index = lua_absindex(L, index);
+
+    for (lua_Integer i = 1; ; ++i) {
+        lua_rawgeti(L, index, i);
+        if (lua_type(L, -1) == LUA_TNIL) {
+            lua_pop(L, 1);
+            break;
+        }
+
+        lua_rawgeti(L, -1, 1);
+
+        if (lua_type(L, -1) == LUA_TTABLE) {
+            lua_rawgeti(L, -2, 2);
+            lua_rawgeti(L, -3, 3);
+            lua_rawset(L, -3);
+        }
+
+        lua_pop(L, 2);
+    }
+}
+
+void Deserializer::malformed() {
+    luaL_error(L, "malformed serialized value");
+}
+
+void Deserializer::need(size_t n) {
+    if ((size_t)(_end - _p) < n)
+        malformed();
+}
+
+uint32_t Deserializer::u32() {
+    need(4);
+    const uint32_t x = getU32(_p);
+    _p += 4;
+    return x;
+}
+
+/**
+ * Remembers the value at the top of the stack for later references.
+ */
+void Deserializer::addRef() {
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, _refs, ++_nrefs);
+}
+
+void Deserializer::table() {
+    const uint32_t n = u32();
+
+    lua_createtable(L, (int)n, 0);
+    addRef();
+
+    for (uint32_t i = 1; i <= n; ++i) {
+        next();
+        lua_rawseti(L, -2, (lua_Integer)i);
+    }
+
+    while (true) {
+        need(1);
+        if (*_p == tagEnd) {
+            ++_p;
+            break;
+        }
+
+        next(); // Key
+        next(); // Value
+        lua_rawset(L, -3);
+    }
+
+    next(); // Metatable
+    if (lua_type(L, -1) == LUA_TNIL)
+        lua_pop(L, 1);
+    else
+        lua_setmetatable(L, -2);
+}
+
+void Deserializer::function() {
+    Chunk chunk;
+    chunk.length = u32();
+    chunk.data = _p;
+    need(chunk.length);
+    _p += chunk.length;
+
+    if (lua_load(L, chunkReader, &chunk, "=?", "b") != LUA_OK)
+        lua_error(L);
+
+    addRef();
+
+    const uint32_t n = u32();
+    for (uint32_t i = 1; i <= n; ++i) {
+        next();
+        if (!lua_setupvalue(L, -2, (int)i))
+            lua_pop(L, 1);
+    }
+}
+
+/**
+ * Pushes a value that belongs to a module, loading the module if needed. If it
+ * can't be found, pushes an error message instead and returns false.
+ */
+bool Deserializer::module() {
+    const size_t len = u32();
+    need(len);
+    lua_pushlstring(L, _p, len);
+    _p += len;
+
+    // The name is kept around for error messages.
+    const int name = lua_gettop(L);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+    lua_pushvalue(L, name);
+    lua_rawget(L, -2);
+    lua_remove(L, -2);
+
+    if (lua_type(L, -1) == LUA_TNIL) {
+        lua_pop(L, 1);
+        lua_getglobal(L, "require");
+        lua_pushvalue(L, name);
+        lua_call(L, 1, 1);
+    }
+
+    while (true) {
+        need(1);
+        const char step = *_p++;
+
+        if (step == stepEnd)
+            break;
+
+        bool found = false;
+
+        switch (step) {
+            case stepField: {
+                const size_t keyLen = u32();
+                need(keyLen);
+
+                if (lua_type(L, -1) == LUA_TTABLE) {
+                    lua_pushlstring(L, _p, keyLen);
+                    lua_rawget(L, -2);
+                    found = true;
+                }
+
+                _p += keyLen;
+                break;
+            }
+
+            case stepMetatable:
+                found = lua_getmetatable(L, -1) != 0;
+                break;
+
+            case stepUpvalue:
+                found = lua_getupvalue(L, -1, (int)u32()) != NULL;
+                break;
+
+            default:
+                malformed();
+        }
+
+        if (!found)
+            lua_pushnil(L);
+
+        lua_remove(L, -2);
+    }
+
+    const int type = lua_type(L, -1);
+    if (type != LUA_TTABLE && type != LUA_TFUNCTION) {
+        lua_settop(L, name - 1);
+        lua_pushfstring(L, "a value from module '%s' could not be found "
+                "in this state", lua_tostring(L, name));
+        return false;
+    }
+
+    lua_remove(L, name);
+    return true;
+}
@@ -0,0 +1,209 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Serialization of Lua values so that they can be moved from one Lua state to
+ * another.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+struct lua_State;
+
+/**
+ * Remembers where every table and function that belongs to a module was right
+ * after the module was loaded, and what the fields of its tables were at the
+ * time.
+ *
+ * Another Lua state that loads the same module finds the same values along the
+ * same paths, no matter what this state has done to the module since. Keeping
+ * the fields around also makes it possible to tell what has been changed (see
+ * Serializer::changes()). Only the tables that can be reached through fields
+ * are checked for changes. Changes to tables and local variables that a module
+ * only refers to from its functions are not found.
+ *
+ * Everything that is indexed is kept alive until the Lua state is closed.
+ */
+class ModuleIndex
+{
+private:
+    // Path to every table and function, as in the Serializer.
+    std::unordered_map<const void*, std::string> _paths;
+
+    // Names of the modules indexed so far.
+    std::unordered_set<std::string> _names;
+
+public:
+    /**
+     * Indexes the modules in package.loaded that are not indexed yet. This
+     * should be called right after a module is loaded.
+     */
+    void update(lua_State* L);
+
+    /**
+     * Returns the path to the given table or function, or NULL if it doesn't
+     * belong to a module.
+     */
+    const std::string* find(const void* p) const;
+
+    /**
+     * Pushes a table that maps every indexed table and function to true or,
+     * for tables that can be reached through fields, to a copy of their
+     * fields from when they were indexed.
+     */
+    void push(lua_State* L) const;
+
+private:
+    void copyFields(lua_State* L, int objects, int loaded);
+};
+
+/**
+ * Serializes Lua values into a buffer. This does not raise any Lua errors.
+ *
+ * Nil, booleans, numbers, strings, and tables (including their metatables) are
+ * copied. Tables that are referenced more than once, or that refer to
+ * themselves, are still shared afterwards. This holds across all the values
+ * added to the same serializer. Lua functions are copied along with their
+ * upvalues. C functions are copied if they don't have upvalues. Anything else
+ * can't be serialized.
+ *
+ * Tables and functions that belong to a loaded module (i.e., that can be
+ * reached from package.loaded through fields, metatables, and upvalues) are
+ * not copied. Instead, they refer to the same module in the other state, which
+ * is loaded there if needed. Otherwise, checks like getmetatable(t) == foo_mt
+ * would no longer work. The global table always refers to the other state's
+ * global table.
+ *
+ * By default, the paths to these are found when they are first needed. With a
+ * ModuleIndex, the paths from when each module was loaded are used instead.
+ *
+ * The serialized data may refer to C functions by address and so must only be
+ * deserialized by the same process.
+ */
+class Serializer
+{
+private:
+    lua_State* L;
+    std::string& _buf;
+    std::string _error;
+
+    const void* _globals;
+
+    // Tables and functions serialized so far, along with the order they were
+    // first seen in. The deserializer numbers them in the same order.
+    std::unordered_map<const void*, uint32_t> _refs;
+
+    // Path to every table and function that belongs to a module. This is only
+    // found once it is first needed, unless there is an index.
+    std::unordered_map<const void*, std::string> _modules;
+    bool _indexed;
+
+    const ModuleIndex* _index;
+
+public:
+    /**
+     * Values are appended to the given buffer. The index, if any, must
+     * outlive the serializer.
+     */
+    Serializer(lua_State* L, std::string& buf,
+            const ModuleIndex* index = NULL);
+
+    /**
+     * Serializes the value at the given index of the stack. If copy is true,
+     * the value itself (but not necessarily what it refers to) is copied even
+     * if it belongs to a module.
+     *
+     * Returns false if the value can't be serialized, in which case the buffer
+     * is left as it was and error() says why.
+     */
+    bool add(int index, bool copy = false);
+
+    /**
+     * Serializes the fields that have changed in the tables of the index since
+     * they were indexed. Changes to fields that can't be serialized are left
+     * out. This does nothing without an index.
+     */
+    void changes();
+
+    const std::string& error() const {
+        return _error;
+    }
+
+private:
+    bool value(int index, bool copy);
+    void number(int index);
+    bool reference(int index, bool copy);
+    bool table(int index);
+    bool function(int index);
+
+    const std::string* findModule(const void* p);
+    void indexModules();
+    void change(int table, int key, int value);
+
+    void rollback(size_t length, uint32_t refs);
+};
+
+/**
+ * Reads back the values of a serializer, in the same order they were added.
+ *
+ * A table used to keep track of references is pushed onto the stack when this
+ * is constructed. It must be left there, just below any values that are read,
+ * until all of the values have been read.
+ */
+class Deserializer
+{
+private:
+    lua_State* L;
+    const char* _p;
+    const char* _end;
+
+    // Index of the table of references.
+    int _refs;
+    int _nrefs;
+
+public:
+    Deserializer(lua_State* L, const char* data, size_t length);
+
+    /**
+     * Returns true if there are no values left.
+     */
+    bool done() const {
+        return _p == _end;
+    }
+
+    /**
+     * Pushes the next value. Raises a Lua error if the data is malformed or if
+     * a module that is referred to can't be found.
+     */
+    void next();
+
+    /**
+     * Pushes a list of the changes serialized by Serializer::changes(). They
+     * are only read, not made, so that values after them are still found where
+     * they were in the other state.
+     */
+    void changes();
+
+    /**
+     * Makes the changes in the list at the given index of the stack.
+     */
+    static void applyChanges(lua_State* L, int index);
+
+private:
+    void malformed();
+    void need(size_t n);
+    uint32_t u32();
+    void addRef();
+    void table();
+    void function();
+    bool module();
+};
@@ -0,0 +1,217 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Additions to the table library.
+ *
+ * Rule scripts use these on every list of sources, flags, and dependencies, so
+ * they work on the tables directly instead of going through table.insert and
+ * ipairs. Like ipairs, a list ends at its first nil.
+ */
+#include "lua_table.h"
+
+#include "lua.hpp"
+
+namespace {
+
+/**
+ * Returns the index of the first nil argument at or after the given one, or one
+ * past the last argument. Like ipairs({...}), the arguments after a nil are
+ * ignored.
+ */
+int argsEnd(lua_State* L, int first) {
+    const int top = lua_gettop(L);
+
+    int i = first;
+    while (i <= top && !lua_isnil(L, i))
+        ++i;
+
+    return i;
+}
+
+/**
+ * Returns how many items appending the given value adds. This is only used to
+ * size the table up front, so it doesn't need to be exact.
+ */
+lua_Integer itemCount(lua_State* L, int v) {
+    if (lua_type(L, v) == LUA_TTABLE)
+        return (lua_Integer)lua_rawlen(L, v);
+    return 1;
+}
+
+/**
+ * Appends a value to the list at index t, which has n items so far. The items
+ * of a table are appended one by one. Anything else is appended as is. Returns
+ * the new number of items.
+ */
+lua_Integer appendValue(lua_State* L, int t, lua_Integer n, int v) {
+    if (lua_type(L, v) != LUA_TTABLE) {
+        lua_pushvalue(L, v);
+        lua_rawseti(L, t, ++n);
+        return n;
+    }
+
+    // A list appended to itself only gets the items it had to begin with.
+    const bool self = lua_rawequal(L, t, v) != 0;
+    const lua_Integer length = n;
+
+    for (lua_Integer i = 1; !self || i <= length; ++i) {
+        lua_rawgeti(L, v, i);
+        if (lua_type(L, -1) == LUA_TNIL) {
+            lua_pop(L, 1);
+            break;
+        }
+
+        lua_rawseti(L, t, ++n);
+    }
+
+    return n;
+}
+
+/**
+ * table.append(t, ...)
+ *
+ * Appends the given values to t and returns it.
+ */
+int table_append(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    const int end = argsEnd(L, 2);
+
+    lua_Integer n = (lua_Integer)lua_rawlen(L, 1);
+    for (int i = 2; i < end; ++i)
+        n = appendValue(L, 1, n, i);
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+/**
+ * table.join(...)
+ *
+ * Returns a new list of all the given values.
+ */
+int table_join(lua_State* L) {
+    const int end = argsEnd(L, 1);
+
+    lua_Integer count = 0;
+    for (int i = 1; i < end; ++i)
+        count += itemCount(L, i);
+
+    lua_createtable(L, (int)count, 0);
+    const int t = lua_gettop(L);
+
+    lua_Integer n = 0;
+    for (int i = 1; i < end; ++i)
+        n = appendValue(L, t, n, i);
+
+    return 1;
+}
+
+/**
+ * table.contains(t, value)
+ *
+ * Returns true if the given value is in the list. This is a linear search. For
+ * repeated lookups in the same list, use table.set instead.
+ */
+int table_contains(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 2);
+
+    for (lua_Integer i = 1; ; ++i) {
+        lua_rawgeti(L, 1, i);
+        if (lua_type(L, -1) == LUA_TNIL)
+            break;
+
+        if (lua_compare(L, -1, 2, LUA_OPEQ)) {
+            lua_pushboolean(L, 1);
+            return 1;
+        }
+
+        lua_pop(L, 1);
+    }
+
+    lua_pushboolean(L, 0);
+    return 1;
+}
+
+/**
+ * table.filter(t, pred)
+ *
+ * Returns a new list of the items in t that the predicate returns true for.
+ */
+int table_filter(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 2);
+
+    lua_newtable(L);
+
+    lua_Integer n = 0;
+
+    for (lua_Integer i = 1; ; ++i) {
+        lua_rawgeti(L, 1, i);
+        if (lua_type(L, -1) == LUA_TNIL) {
+            lua_pop(L, 1);
+            break;
+        }
+
+        lua_pushvalue(L, 2);
+        lua_pushvalue(L, -2);
+        lua_call(L, 1, 1);
+
+        const bool keep = lua_toboolean(L, -1) != 0;
+        lua_pop(L, 1);
+
+        if (keep)
+            lua_rawseti(L, 3, ++n);
+        else
+            lua_pop(L, 1);
+    }
+
+    return 1;
+}
+
+/**
+ * table.set(t)
+ *
+ * Returns a new table with the items of the list as keys, each mapped to true,
+ * so that membership can be checked with a single lookup.
+ */
+int table_set(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+
+    lua_createtable(L, 0, (int)lua_rawlen(L, 1));
+
+    for (lua_Integer i = 1; ; ++i) {
+        lua_rawgeti(L, 1, i);
+        if (lua_type(L, -1) == LUA_TNIL) {
+            lua_pop(L, 1);
+            break;
+        }
+
+        lua_pushboolean(L, 1);
+        lua_rawset(L, 2);
+    }
+
+    return 1;
+}
+
+const luaL_Reg tablelib[] = {
+    {"append", table_append},
+    {"join", table_join},
+    {"contains", table_contains},
+    {"filter", table_filter},
+    {"set", table_set},
+    {NULL, NULL}
+};
+
+}
+
+int luaopen_table_utils(lua_State* L) {
+    lua_getglobal(L, "table");
+    luaL_setfuncs(L, tablelib, 0);
+    return 1;
+}
@@ -0,0 +1,18 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Additions to the table library.
+ */
+#pragma once
+
+struct lua_State;
+
+/**
+ * Adds table.append, table.join, table.contains, table.filter, and table.set
+ * to the standard table library, which must already be open. Pushes the table
+ * library onto the stack.
+ */
+int luaopen_table_utils(lua_State* L);
@@ -0,0 +1,79 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Buffered output.
+ */
+#include "output.h"
+
+#include <stdlib.h>
+#include <new>
+
+OutputBuffer::OutputBuffer(FILE* f, size_t capacity)
+    : _f(f), _buf(NULL), _length(0), _capacity(capacity > 0 ? capacity : 1),
+      _written(0) {
+
+    _buf = (char*)malloc(_capacity);
+    if (!_buf) throw std::bad_alloc();
+}
+
+OutputBuffer::~OutputBuffer() {
+    flush();
+    free(_buf);
+}
+
+char* OutputBuffer::reserve(size_t length) {
+    if (length <= _capacity - _length)
+        return _buf + _length;
+
+    // Make room by emptying the buffer first, if we can.
+    flush();
+
+    if (length > _capacity - _length) {
+        size_t capacity = _capacity;
+        while (length > capacity - _length)
+            capacity *= 2;
+
+        char* buf = (char*)realloc(_buf, capacity);
+        if (!buf) throw std::bad_alloc();
+
+        _buf = buf;
+        _capacity = capacity;
+    }
+
+    return _buf + _length;
+}
+
+void OutputBuffer::writeSlow(const char* data, size_t length) {
+    if (_f) {
+        // Fill up what's left of the buffer so that we always flush in large
+        // chunks.
+        const size_t n = _capacity - _length;
+        memcpy(_buf + _length, data, n);
+        _length += n;
+        data += n;
+        length -= n;
+
+        flush();
+
+        // Anything bigger than the whole buffer can bypass it.
+        if (length >= _capacity) {
+            fwrite(data, 1, length, _f);
+            _written += length;
+            return;
+        }
+    }
+
+    memcpy(reserve(length), data, length);
+    _length += length;
+}
+
+void OutputBuffer::flush() {
+    if (!_f || _length == 0) return;
+
+    fwrite(_buf, 1, _length, _f);
+    _written += _length;
+    _length = 0;
+}
@@ -0,0 +1,174 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Buffered output.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+/**
+ * A large, owned output buffer. Writes are accumulated in memory and handed to
+ * the underlying file in big chunks. This avoids the overhead of going through
+ * stdio for every small piece of output.
+ *
+ * If no file is given, the buffer simply grows to hold everything written to
+ * it.
+ */
+class OutputBuffer
+{
+private:
+    // File to flush to. May be NULL.
+    FILE* _f;
+
+    char* _buf;
+    size_t _length;
+    size_t _capacity;
+
+    // Number of bytes handed to the file so far.
+    size_t _written;
+
+public:
+    static const size_t defaultCapacity = 1 << 20;
+
+    explicit OutputBuffer(FILE* f = NULL, size_t capacity = defaultCapacity);
+
+    /**
+     * Flushes any remaining output.
+     */
+    ~OutputBuffer();
+
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+    /**
+     * Writes a block of data.
+     */
+    void write(const char* data, size_t length) {
+        if (length <= _capacity - _length) {
+            memcpy(_buf + _length, data, length);
+            _length += length;
+        }
+        else {
+            writeSlow(data, length);
+        }
+    }
+
+    void write(const char* s) {
+        write(s, strlen(s));
+    }
+
+    /**
+     * Writes a single character.
+     */
+    void put(char c) {
+        if (_length == _capacity)
+            reserve(1);
+        _buf[_length++] = c;
+    }
+
+    /**
+     * Makes room for at least `length` more bytes and returns a pointer to the
+     * start of that space. Call `commit` afterwards with the number of bytes
+     * that were actually written.
+     */
+    char* reserve(size_t length);
+
+    void commit(size_t length) {
+        _length += length;
+    }
+
+    /**
+     * Writes everything buffered so far to the file. Does nothing if there is
+     * no file.
+     */
+    void flush();
+
+    /**
+     * Discards everything buffered so far.
+     */
+    void clear() {
+        _length = 0;
+    }
+
+    /**
+     * Discards everything past the given length.
+     */
+    void truncate(size_t length) {
+        if (length < _length)
+            _length = length;
+    }
+
+    char* data() {
+        return _buf;
+    }
+
+    const char* data() const {
+        return _buf;
+    }
+
+    size_t length() const {
+        return _length;
+    }
+
+    /**
+     * Returns the number of bytes written to the file so far, not counting
+     * what is still buffered.
+     */
+    size_t written() const {
+        return _written;
+    }
+
+private:
+    void writeSlow(const char* data, size_t length);
+};
+
+/**
+ * Stores a 32-bit integer in little-endian byte order.
+ */
+inline void setU32(char* p, uint32_t x) {
+    p[0] = (char)(x & 0xFF);
+    p[1] = (char)((x >> 8) & 0xFF);
+    p[2] = (char)((x >> 16) & 0xFF);
+    p[3] = (char)((x >> 24) & 0xFF);
+}
+
+/**
+ * Writes a 32-bit integer in little-endian byte order.
+ */
+inline void putU32(OutputBuffer& out, uint32_t x) {
+    setU32(out.reserve(4), x);
+    out.commit(4);
+}
+
+/**
+ * Writes a 64-bit integer in little-endian byte order.
+ */
+inline void putU64(OutputBuffer& out, uint64_t x) {
+    char* p = out.reserve(8);
+    setU32(p, (uint32_t)x);
+    setU32(p + 4, (uint32_t)(x >> 32));
+    out.commit(8);
+}
+
+/**
+ * Reads a 32-bit little-endian integer.
+ */
+inline uint32_t getU32(const char* p) {
+    const unsigned char* u = (const unsigned char*)p;
+    return (uint32_t)u[0] | ((uint32_t)u[1] << 8) |
+           ((uint32_t)u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+/**
+ * Reads a 64-bit little-endian integer.
+ */
+inline uint64_t getU64(const char* p) {
+    return (uint64_t)getU32(p) | ((uint64_t)getU32(p + 4) << 32);
+}
@@ -16,6 +16,8 @@
 
 #include "lua.hpp"
 
+#include "path/glob.h"
+
 /**
  * Helper struct for representing a split path.
  */
@@ -131,8 +133,27 @@ public:
      * directory separators are also removed.
      */
     std::string norm() const;
+
+    /**
+     * Same as above, but the contents of the given buffer are replaced with
+     * the normalized path. This allows the buffer to be reused.
+     */
     void norm(std::string& buf) const;
 
+    /**
+     * Same as above, but writes the normalized path to a buffer that must have
+     * room for at least length+1 characters. The normalized path is never
+     * longer than that. Returns the length of the normalized path. Nothing is
+     * allocated.
+     */
+    size_t norm(char* buf) const;
+
+    /**
+     * Returns true if the path is already normalized. That is, norm() would
+     * return the same path.
+     */
+    bool isNorm() const;
+
     /**
      * Joins this path to the end of the given buffer.
      */
@@ -162,6 +183,9 @@ public:
 
     /**
      * Returns true if the path matches the given glob pattern.
+     *
+     * The pattern is compiled every time. Use GlobPattern directly to match
+     * the same pattern many times.
      */
     bool matches(const PathImpl& pattern) const;
 };
@@ -175,6 +199,10 @@ int BasePath<PathImpl>::compare(const PathImpl& rhs) const {
     else if (lengthDiff > 0)
         return 1;
 
+    // Most comparisons are of equal paths.
+    if (PathImpl::equal(path, rhs.path, length))
+        return 0;
+
     int result = 0;
     for (size_t i = 0; i < length; ++i) {
         result = PathImpl::cmp(path[i], rhs.path[i]);
@@ -339,119 +367,134 @@ std::string BasePath<PathImpl>::norm() const {
 
 template<class PathImpl>
 void BasePath<PathImpl>::norm(std::string& buf) const {
+    if (isNorm()) {
+        buf.assign(path, length);
+        return;
+    }
+
+    buf.resize(length + 1);
+    buf.resize(norm(&buf[0]));
+}
+
+template<class PathImpl>
+size_t BasePath<PathImpl>::norm(char* buf) const {
+
+    const size_t root = rootLength();
 
-    // Stack of path components that we build up.
-    std::vector<PathImpl> stack;
+    // The root is kept as is, except for its path separators.
+    for (size_t i = 0; i < root; ++i)
+        buf[i] = PathImpl::isSep(path[i]) ? PathImpl::defaultSep : path[i];
+
+    // The components written so far act as a stack. Anything before "keep" is
+    // either the root or a run of ".." that can't be removed.
+    size_t n = root;
+    size_t keep = root;
+
+    for (size_t i = root; i < length; ) {
+        // Skip past the path separator(s)
+        if (PathImpl::isSep(path[i])) {
+            ++i;
+            continue;
+        }
+
+        const size_t start = i;
+        while (i < length && !PathImpl::isSep(path[i]))
+            ++i;
+
+        const PathImpl c(path + start, i - start);
 
-    for (auto&& c: components()) {
         if (c.isDot()) {
             // Filter out "." path components
             continue;
         }
-        else if (c.isDotDot() && !stack.empty() && !stack.back().isDotDot()) {
-            if (!stack.back().isabs())
-                stack.pop_back();
-        }
-        else {
-            stack.push_back(c);
+        else if (c.isDotDot()) {
+            if (n > keep) {
+                // Remove the last component along with its path separator.
+                while (n > keep && buf[n-1] != PathImpl::defaultSep)
+                    --n;
+
+                if (n > keep)
+                    --n;
+
+                continue;
+            }
+
+            // Can't go above the root.
+            if (root > 0)
+                continue;
         }
-    }
 
-    if (stack.empty()) {
-        PathImpl(".").join(buf);
-    }
-    else {
-        for (auto&& c: stack)
-            c.join(buf);
-    }
+        if (n > 0 && buf[n-1] != PathImpl::defaultSep)
+            buf[n++] = PathImpl::defaultSep;
+
+        memcpy(buf + n, c.path, c.length);
+        n += c.length;
 
-    // Normalize path separators. This should get optimized out for Posix paths.
-    for (auto& ch: buf) {
-        if (PathImpl::isSep(ch) && ch != PathImpl::defaultSep)
-            ch = PathImpl::defaultSep;
+        if (c.isDotDot())
+            keep = n;
     }
+
+    if (n == 0)
+        buf[n++] = '.';
+
+    return n;
 }
 
 template<class PathImpl>
-bool BasePath<PathImpl>::matches(const PathImpl& pattern) const {
-    size_t i = 0;
-
-    for (size_t j = 0; j < pattern.length; ++j) {
-        switch (pattern.path[j]) {
-            case '?': {
-                // Match any single character
-                if (i == length)
-                    return false;
-                ++i;
-                break;
-            }
+bool BasePath<PathImpl>::isNorm() const {
 
-            case '*': {
-                // Match 0 or more characters
-                if (j+1 == pattern.length)
-                    return true;
+    if (length == 0)
+        return false;
 
-                // Consume characters while looking ahead for matches
-                for (; i < length; ++i) {
-                    if (PathImpl(path+i, length-i).matches(
-                            PathImpl(pattern.path+j+1, pattern.length-j-1)))
-                        return true;
-                }
+    const size_t root = rootLength();
 
-                return false;
-            }
+    for (size_t i = 0; i < length; ++i) {
+        if (PathImpl::isSep(path[i]) && path[i] != PathImpl::defaultSep)
+            return false;
+    }
 
-            case '[': {
-                // Match any of the characters that appear in the square brackets
-                if (i == length) return false;
-
-                // Skip past the opening bracket
-                if (++j == pattern.length) return false;
-
-                // Invert the match?
-                bool invert = false;
-                if (pattern.path[j] == '!') {
-                    invert = true;
-                    if (++j == pattern.length)
-                        return false;
-                }
-
-                // Find the closing bracket
-                size_t end = j;
-                while (end < pattern.length && pattern.path[end] != ']')
-                    ++end;
-
-                // No matching bracket?
-                if (end == pattern.length) return false;
-
-                // Check each character between the brackets for a match
-                bool match = false;
-                while (j < end) {
-                    // Found a match
-                    if (!match && PathImpl::cmp(path[i], pattern.path[j]) == 0) {
-                        match = true;
-                    }
-
-                    ++j;
-                }
-
-                if (match == invert)
-                    return false;
-
-                ++i;
-                break;
-            }
+    if (root == length)
+        return true;
 
-            default: {
-                // Match the next character in the pattern
-                if (i == length || PathImpl::cmp(path[i], pattern.path[j]))
-                    return false;
-                ++i;
-                break;
-            }
+    // A root that doesn't end with a path separator (e.g., "\\server\share")
+    // is followed by exactly one.
+    size_t i = root;
+    if (root > 0 && path[root-1] != PathImpl::defaultSep)
+        ++i;
+
+    // Only a relative path can start with "..".
+    bool leading = root == 0;
+
+    for (;;) {
+        const size_t start = i;
+        while (i < length && !PathImpl::isSep(path[i]))
+            ++i;
+
+        const PathImpl c(path + start, i - start);
+
+        // Empty components come from repeated or trailing path separators.
+        if (c.length == 0)
+            return false;
+
+        if (c.isDot())
+            return length == 1;
+
+        if (c.isDotDot()) {
+            if (!leading)
+                return false;
         }
+        else {
+            leading = false;
+        }
+
+        if (i == length)
+            return true;
+
+        ++i; // Skip past the path separator
     }
+}
 
-    // If we ran out of pattern and out of path, then we have a complete match.
-    return i == length;
+template<class PathImpl>
+bool BasePath<PathImpl>::matches(const PathImpl& pattern) const {
+    return GlobPattern<PathImpl>(pattern).matches(path, length);
 }
@@ -0,0 +1,362 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Compiled glob patterns.
+ */
+#pragma once
+
+#include <stddef.h> // For size_t
+#include <stdint.h>
+#include <string.h> // For memcmp, memchr
+#include <vector>
+
+/**
+ * A glob pattern for a single path component, compiled ahead of time so that
+ * it can be matched against many names cheaply.
+ *
+ * The pattern is split up into fixed-length segments separated by '*'. The
+ * first segment must match at the start of the name, the last segment must
+ * match at the end, and the segments in between are found left to right. This
+ * takes linear time in the length of the name for most patterns and never
+ * backtracks more than one segment.
+ *
+ * Supported syntax:
+ *
+ *  - '?' matches any single character.
+ *  - '*' matches 0 or more characters.
+ *  - '[abc]' matches any one of the characters between the brackets.
+ *  - '[!abc]' matches any one character not between the brackets.
+ *
+ * A '[' without a closing ']' never matches anything.
+ */
+template<class PathImpl>
+class GlobPattern {
+private:
+
+    enum class Kind : uint8_t {
+        literal, // Matches one character.
+        any,     // Matches any one character.
+        set,     // Matches one character from a character class.
+    };
+
+    struct Unit {
+        Kind kind;
+        uint16_t set; // Index into _sets.
+    };
+
+    // A character class. One bit for every possible character.
+    struct CharSet {
+        uint64_t bits[4];
+
+        bool has(unsigned char c) const {
+            return (bits[c >> 6] >> (c & 63)) & 1;
+        }
+
+        void add(unsigned char c) {
+            bits[c >> 6] |= (uint64_t)1 << (c & 63);
+        }
+    };
+
+    // A run of units between stars.
+    struct Segment {
+        size_t begin;
+        size_t length;
+
+        // True if the segment only consists of literal characters.
+        bool literal;
+    };
+
+    std::vector<Unit> _units;
+
+    // Literal characters, one for each unit. This lets literal segments be
+    // compared in bulk.
+    std::vector<char> _chars;
+
+    std::vector<CharSet> _sets;
+    std::vector<Segment> _segments;
+
+    // True if there is at least one '*'. If not, there is exactly one segment
+    // that must match the whole name.
+    bool _star;
+
+    // Sum of all segment lengths. Shorter names can never match.
+    size_t _minLength;
+
+    // True if the pattern can't match anything.
+    bool _never;
+
+public:
+
+    GlobPattern() : _star(false), _minLength(0), _never(true) {}
+
+    explicit GlobPattern(const PathImpl& pattern);
+
+    /**
+     * Returns true if the given name matches the pattern.
+     */
+    bool matches(const char* s, size_t length) const;
+
+    bool matches(const PathImpl& name) const {
+        return matches(name.path, name.length);
+    }
+
+    /**
+     * Returns the number of literal characters that every matching name must
+     * start with and points to them. If the file system is not case sensitive,
+     * names may spell them differently.
+     */
+    size_t prefix(const char*& p) const {
+        if (_never || _segments.empty())
+            return 0;
+
+        const Segment& seg = _segments.front();
+
+        size_t n = 0;
+        while (n < seg.length && _units[seg.begin + n].kind == Kind::literal)
+            ++n;
+
+        p = _chars.data() + seg.begin;
+        return n;
+    }
+
+    /**
+     * Same as above, but for the characters every matching name must end with.
+     */
+    size_t suffix(const char*& p) const {
+        if (_never || _segments.empty())
+            return 0;
+
+        const Segment& seg = _segments.back();
+        const size_t end = seg.begin + seg.length;
+
+        size_t n = 0;
+        while (n < seg.length && _units[end - 1 - n].kind == Kind::literal)
+            ++n;
+
+        p = _chars.data() + end - n;
+        return n;
+    }
+
+private:
+    void beginSegment() {
+        Segment seg = {_units.size(), 0, true};
+        _segments.push_back(seg);
+    }
+
+    void addUnit(Kind kind, char c, size_t set = 0) {
+        Unit u = {kind, (uint16_t)set};
+        _units.push_back(u);
+        _chars.push_back(c);
+
+        Segment& seg = _segments.back();
+        ++seg.length;
+        if (kind != Kind::literal)
+            seg.literal = false;
+    }
+
+    bool matchUnit(const Unit& u, char expected, char c) const {
+        switch (u.kind) {
+            case Kind::literal:
+                return PathImpl::cmp(c, expected) == 0;
+            case Kind::any:
+                return true;
+            case Kind::set:
+                return _sets[u.set].has((unsigned char)c);
+        }
+
+        return false;
+    }
+
+    /**
+     * Returns true if the segment matches the name starting at the given
+     * pointer. There must be enough characters left.
+     */
+    bool matchSegment(const Segment& seg, const char* s) const {
+        const char* chars = _chars.data() + seg.begin;
+
+        if (seg.literal)
+            return PathImpl::equal(chars, s, seg.length);
+
+        const Unit* units = _units.data() + seg.begin;
+
+        for (size_t i = 0; i < seg.length; ++i) {
+            if (!matchUnit(units[i], chars[i], s[i]))
+                return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * Finds the first position in [begin, end) where the segment matches.
+     * Returns NULL if there is none.
+     */
+    const char* findSegment(const Segment& seg, const char* begin,
+            const char* end) const {
+
+        if ((size_t)(end - begin) < seg.length)
+            return NULL;
+
+        // Last position the segment can start at.
+        const char* last = end - seg.length;
+
+        if (seg.literal && !PathImpl::caseSensitive && seg.length > 0) {
+            const char* chars = _chars.data() + seg.begin;
+            const char first = PathImpl::fold(chars[0]);
+
+            for (; begin <= last; ++begin) {
+                if (PathImpl::fold(*begin) == first &&
+                        PathImpl::equal(chars, begin, seg.length))
+                    return begin;
+            }
+
+            return NULL;
+        }
+
+        if (seg.literal && seg.length > 0) {
+            const char first = _chars[seg.begin];
+
+            while (begin <= last) {
+                begin = (const char*)memchr(begin, first, last - begin + 1);
+                if (!begin)
+                    return NULL;
+
+                if (memcmp(_chars.data() + seg.begin, begin, seg.length) == 0)
+                    return begin;
+
+                ++begin;
+            }
+
+            return NULL;
+        }
+
+        for (; begin <= last; ++begin) {
+            if (matchSegment(seg, begin))
+                return begin;
+        }
+
+        return NULL;
+    }
+};
+
+template<class PathImpl>
+GlobPattern<PathImpl>::GlobPattern(const PathImpl& pattern)
+    : _star(false), _minLength(0), _never(false) {
+
+    const char* p = pattern.path;
+    const size_t n = pattern.length;
+
+    beginSegment();
+
+    for (size_t j = 0; j < n; ++j) {
+        switch (p[j]) {
+            case '?':
+                addUnit(Kind::any, p[j]);
+                break;
+
+            case '*':
+                // Consecutive stars are the same as one.
+                if (!_star || _segments.back().length > 0)
+                    beginSegment();
+                _star = true;
+                break;
+
+            case '[': {
+                // Skip past the opening bracket
+                if (++j == n) {
+                    _never = true;
+                    return;
+                }
+
+                // Invert the match?
+                bool invert = false;
+                if (p[j] == '!') {
+                    invert = true;
+                    if (++j == n) {
+                        _never = true;
+                        return;
+                    }
+                }
+
+                // Find the closing bracket
+                size_t end = j;
+                while (end < n && p[end] != ']')
+                    ++end;
+
+                // No matching bracket?
+                if (end == n) {
+                    _never = true;
+                    return;
+                }
+
+                CharSet set = {{0, 0, 0, 0}};
+
+                // Every character that compares equal to one of the characters
+                // between the brackets is part of the class. This takes care
+                // of case insensitivity.
+                for (; j < end; ++j) {
+                    for (unsigned c = 0; c < 256; ++c) {
+                        if (PathImpl::cmp((char)c, p[j]) == 0)
+                            set.add((unsigned char)c);
+                    }
+                }
+
+                if (invert) {
+                    for (auto& b: set.bits)
+                        b = ~b;
+                }
+
+                _sets.push_back(set);
+                addUnit(Kind::set, '[', _sets.size() - 1);
+
+                // j is now at the closing bracket
+                break;
+            }
+
+            default:
+                addUnit(Kind::literal, p[j]);
+                break;
+        }
+    }
+
+    for (auto&& seg: _segments)
+        _minLength += seg.length;
+}
+
+template<class PathImpl>
+bool GlobPattern<PathImpl>::matches(const char* s, size_t length) const {
+    if (_never || length < _minLength)
+        return false;
+
+    if (!_star)
+        return length == _minLength && matchSegment(_segments.front(), s);
+
+    // Note that there are always at least two segments if there is a star.
+    const Segment& first = _segments.front();
+    const Segment& last = _segments.back();
+
+    if (!matchSegment(first, s) ||
+        !matchSegment(last, s + length - last.length))
+        return false;
+
+    // Segments in the middle can go anywhere between the first and last
+    // segments. Taking the leftmost match for each one leaves the most room
+    // for the rest.
+    const char* begin = s + first.length;
+    const char* end = s + length - last.length;
+
+    for (size_t i = 1; i + 1 < _segments.size(); ++i) {
+        const Segment& seg = _segments[i];
+
+        const char* found = findSegment(seg, begin, end);
+        if (!found)
+            return false;
+
+        begin = found + seg.length;
+    }
+
+    return true;
+}
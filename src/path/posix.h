@@ -24,6 +24,21 @@ public:
 
     static int cmp(char a, char b);
 
+    /**
+     * Returns true if the n characters starting at a and b are the same as far
+     * as cmp() is concerned.
+     */
+    static inline bool equal(const char* a, const char* b, size_t n) {
+        return memcmp(a, b, n) == 0;
+    }
+
+    /**
+     * Characters are only ever the same as themselves.
+     */
+    static inline char fold(char c) {
+        return c;
+    }
+
     static inline bool isSep(char c) {
         return c == '/';
     }
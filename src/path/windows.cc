@@ -10,18 +10,75 @@
  * https://msdn.microsoft.com/en-us/library/windows/desktop/aa365247.aspx
  */
 
-#include <cctype>
 #include <cstring>
 #include <algorithm>
 
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   define WINPATH_SSE2
+#   include <emmintrin.h>
+#endif
+
 #include "path/windows.h"
 #include "lua.hpp"
 
+/**
+ * Only ASCII letters are folded. File names are UTF-8 here and folding single
+ * bytes according to the C library's locale would only mangle them.
+ */
 int WinPath::cmp(char a, char b) {
     if (isSep(a) && isSep(b))
         return 0;
 
-    return (int)tolower(a) - (int)tolower(b);
+    if (a >= 'A' && a <= 'Z') a = (char)(a + ('a' - 'A'));
+    if (b >= 'A' && b <= 'Z') b = (char)(b + ('a' - 'A'));
+
+    return (int)a - (int)b;
+}
+
+#ifdef WINPATH_SSE2
+
+namespace {
+
+/**
+ * Same as WinPath::fold() for 16 characters at once.
+ */
+inline __m128i fold16(__m128i x) {
+    // Shift 'A' down to -128 so that a single signed comparison tells if a
+    // character is between 'A' and 'Z'.
+    const __m128i shifted = _mm_add_epi8(x, _mm_set1_epi8(0x80 - 'A'));
+    const __m128i upper = _mm_cmplt_epi8(shifted,
+            _mm_set1_epi8((char)(-0x80 + 26)));
+    x = _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+
+    const __m128i backslash = _mm_cmpeq_epi8(x, _mm_set1_epi8('\\'));
+    return _mm_xor_si128(x, _mm_and_si128(backslash,
+                _mm_set1_epi8('\\' ^ '/')));
+}
+
+}
+
+#endif // WINPATH_SSE2
+
+bool WinPath::equal(const char* a, const char* b, size_t n) {
+    size_t i = 0;
+
+#ifdef WINPATH_SSE2
+    for (; i + 16 <= n; i += 16) {
+        const __m128i x = fold16(_mm_loadu_si128((const __m128i*)(a + i)));
+        const __m128i y = fold16(_mm_loadu_si128((const __m128i*)(b + i)));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF)
+            return false;
+    }
+#endif
+
+    for (; i < n; ++i) {
+        if (fold(a[i]) != fold(b[i]))
+            return false;
+    }
+
+    return true;
 }
 
 /**
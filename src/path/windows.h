@@ -24,6 +24,25 @@ public:
 
     static int cmp(char a, char b);
 
+    /**
+     * Returns true if the n characters starting at a and b are the same as far
+     * as cmp() is concerned. Many characters are compared at once where
+     * possible.
+     */
+    static bool equal(const char* a, const char* b, size_t n);
+
+    /**
+     * Folds the case of ASCII letters and turns separators into '/'. Two
+     * characters are the same if they fold to the same thing.
+     */
+    static inline char fold(char c) {
+        if (c >= 'A' && c <= 'Z')
+            return (char)(c + ('a' - 'A'));
+        if (c == '\\')
+            return '/';
+        return c;
+    }
+
     static inline bool isSep(char c) {
         return c == '/' || c == '\\';
     }
@@ -0,0 +1,369 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Lightweight profiling of where the time goes.
+ */
+#ifdef _WIN32
+#   define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include "profile.h"
+
+#include <inttypes.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace profile {
+
+bool active = false;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+Clock::time_point startTime;
+
+struct TimerInfo {
+    const char* name;
+
+    // Whether each occurrence shows up in the trace. Otherwise, it is only
+    // part of the summary.
+    bool traced;
+};
+
+const TimerInfo timerInfo[timerCount] = {
+    {"lua",        true},
+    {"shutdown",   true},
+    {"import",     true},
+    {"glob",       true},
+    {"readdir",    true},
+    {"rules",      false},
+    {"hash",       true},
+    {"deps write", true},
+    {"task",       true},
+    {"task wait",  false},
+};
+
+const char* const counterNames[counterCount] = {
+    "dir cache hits",
+    "dir cache misses",
+    "dirs listed",
+    "glob cache hits",
+    "publish_input calls",
+    "rules added",
+    "bytes emitted",
+    "deps bytes",
+    "queue depth",
+    "lua peak bytes",
+    "peak memory bytes",
+};
+
+/**
+ * Counters that keep the highest value instead of adding up.
+ */
+bool isPeak(size_t c) {
+    return c == queueDepth || c == luaPeak || c == processPeak;
+}
+
+struct Event {
+    Timer timer;
+    uint64_t start;
+    uint64_t duration;
+    std::string detail;
+};
+
+struct Sample {
+    Counter counter;
+    uint64_t time;
+    uint64_t value;
+};
+
+struct Total {
+    uint64_t time;
+    uint64_t count;
+    uint64_t max;
+};
+
+/**
+ * Everything recorded by a single thread. These outlive their threads so that
+ * they can be written out at the end, and are only dropped when profiling
+ * starts again.
+ */
+struct Thread {
+    uint32_t id;
+
+    std::vector<Event> events;
+    std::vector<Sample> samples;
+
+    Total timers[timerCount];
+
+    // For sampled and peak counters, this is the highest value seen.
+    uint64_t counters[counterCount];
+
+    // True once the thread has exited. Guarded by threadsMutex.
+    bool exited;
+
+    Thread() : id(0), timers(), counters(), exited(false) {}
+};
+
+std::mutex threadsMutex;
+std::vector<std::unique_ptr<Thread>> threads;
+
+thread_local Thread* current = nullptr;
+
+/**
+ * Marks the thread's record as exited when the thread does. The record is kept
+ * until the next time profiling starts.
+ */
+struct ThreadExit {
+    ~ThreadExit() {
+        if (!current) return;
+
+        std::lock_guard<std::mutex> lock(threadsMutex);
+        current->exited = true;
+    }
+};
+
+thread_local ThreadExit threadExit;
+
+Thread& thread() {
+    if (!current) {
+        // Using it is what makes it get destroyed when the thread exits.
+        (void)&threadExit;
+
+        std::unique_ptr<Thread> t(new Thread());
+        current = t.get();
+
+        std::lock_guard<std::mutex> lock(threadsMutex);
+        t->id = (uint32_t)threads.size() + 1;
+        threads.push_back(std::move(t));
+    }
+
+    return *current;
+}
+
+/**
+ * Writes a string as a JSON string.
+ */
+void putString(FILE* f, const std::string& s) {
+    fputc('"', f);
+
+    for (char c: s) {
+        switch (c) {
+            case '"':  fputs("\\\"", f); break;
+            case '\\': fputs("\\\\", f); break;
+            case '\n': fputs("\\n", f); break;
+            case '\t': fputs("\\t", f); break;
+            default:
+                if ((unsigned char)c < 0x20)
+                    fprintf(f, "\\u%04x", (unsigned)c);
+                else
+                    fputc(c, f);
+        }
+    }
+
+    fputc('"', f);
+}
+
+/**
+ * Trace timestamps are in microseconds.
+ */
+double micros(uint64_t ns) {
+    return (double)ns / 1000.0;
+}
+
+double millis(uint64_t ns) {
+    return (double)ns / 1000000.0;
+}
+
+bool writeTrace(const char* path, const Total* timers,
+        const uint64_t* counters) {
+
+    FILE* f = fopen(path, "w");
+    if (!f) return false;
+
+    fputs("{\"traceEvents\":[\n", f);
+
+    bool first = true;
+
+    for (auto&& t: threads) {
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%" PRIu32 ",\"args\":{\"name\":\"%s %" PRIu32 "\"}}",
+                first ? "" : ",\n", t->id, t->id == 1 ? "main" : "thread",
+                t->id);
+        first = false;
+
+        for (auto&& e: t->events) {
+            fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"button-lua\","
+                    "\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,"
+                    "\"tid\":%" PRIu32, timerInfo[e.timer].name,
+                    micros(e.start), micros(e.duration), t->id);
+
+            if (!e.detail.empty()) {
+                fputs(",\"args\":{\"detail\":", f);
+                putString(f, e.detail);
+                fputc('}', f);
+            }
+
+            fputc('}', f);
+        }
+
+        for (auto&& s: t->samples) {
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%.3f,"
+                    "\"pid\":1,\"args\":{\"value\":%" PRIu64 "}}",
+                    counterNames[s.counter], micros(s.time), s.value);
+        }
+    }
+
+    fputs("\n],\n\"displayTimeUnit\":\"ms\",\n\"otherData\":{", f);
+
+    first = true;
+
+    for (size_t i = 0; i < timerCount; ++i) {
+        fprintf(f, "%s\"%s\":\"%.3f ms\"", first ? "" : ",",
+                timerInfo[i].name, millis(timers[i].time));
+        first = false;
+    }
+
+    for (size_t i = 0; i < counterCount; ++i)
+        fprintf(f, ",\"%s\":\"%" PRIu64 "\"", counterNames[i], counters[i]);
+
+    fputs("}}\n", f);
+
+    const bool ok = ferror(f) == 0;
+    return fclose(f) == 0 && ok;
+}
+
+void writeSummary(FILE* f, const Total* timers, const uint64_t* counters) {
+    fputs("Profile:\n", f);
+
+    for (size_t i = 0; i < timerCount; ++i) {
+        const Total& t = timers[i];
+        if (t.count == 0) continue;
+
+        fprintf(f, "  %-20s %10.2f ms %10" PRIu64 " times  (max %.2f ms)\n",
+                timerInfo[i].name, millis(t.time), t.count, millis(t.max));
+    }
+
+    for (size_t i = 0; i < counterCount; ++i) {
+        if (isPeak(i))
+            fprintf(f, "  %-20s %10" PRIu64 " at most\n", counterNames[i],
+                    counters[i]);
+        else
+            fprintf(f, "  %-20s %10" PRIu64 "\n", counterNames[i],
+                    counters[i]);
+    }
+}
+
+}
+
+uint64_t now() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            Clock::now() - startTime).count();
+}
+
+void start() {
+    Thread& self = thread();
+
+    {
+        // A server profiles each of its runs separately. Every run has threads
+        // of its own, so the records of those that have exited are dropped.
+        std::lock_guard<std::mutex> lock(threadsMutex);
+
+        threads.erase(std::remove_if(threads.begin(), threads.end(),
+                [](const std::unique_ptr<Thread>& t) { return t->exited; }),
+                threads.end());
+
+        // The calling thread shows up first.
+        std::stable_partition(threads.begin(), threads.end(),
+                [&](const std::unique_ptr<Thread>& t) {
+                    return t.get() == &self;
+                });
+
+        uint32_t id = 0;
+
+        for (auto&& t: threads) {
+            t->id = ++id;
+            t->events.clear();
+            t->samples.clear();
+            std::fill(t->timers, t->timers + timerCount, Total());
+            std::fill(t->counters, t->counters + counterCount, 0);
+        }
+    }
+
+    startTime = Clock::now();
+    active = true;
+}
+
+bool finish(const char* path, FILE* summary) {
+    active = false;
+
+    Total timers[timerCount] = {};
+    uint64_t counters[counterCount] = {};
+
+    for (auto&& t: threads) {
+        for (size_t i = 0; i < timerCount; ++i) {
+            timers[i].time += t->timers[i].time;
+            timers[i].count += t->timers[i].count;
+            timers[i].max = std::max(timers[i].max, t->timers[i].max);
+        }
+
+        for (size_t i = 0; i < counterCount; ++i) {
+            if (isPeak(i))
+                counters[i] = std::max(counters[i], t->counters[i]);
+            else
+                counters[i] += t->counters[i];
+        }
+    }
+
+    const bool ok = writeTrace(path, timers, counters);
+
+    if (summary)
+        writeSummary(summary, timers, counters);
+
+    return ok;
+}
+
+void record(Timer timer, uint64_t start, const char* detail, size_t length) {
+    if (!active) return;
+
+    const uint64_t duration = now() - start;
+
+    Thread& t = thread();
+
+    Total& total = t.timers[timer];
+    total.time += duration;
+    total.count += 1;
+    total.max = std::max(total.max, duration);
+
+    if (!timerInfo[timer].traced)
+        return;
+
+    t.events.push_back(Event {timer, start, duration,
+            detail ? std::string(detail, length) : std::string()});
+}
+
+void addSlow(Counter c, uint64_t n) {
+    thread().counters[c] += n;
+}
+
+void sampleSlow(Counter c, uint64_t value) {
+    Thread& t = thread();
+    t.samples.push_back(Sample {c, now(), value});
+    t.counters[c] = std::max(t.counters[c], value);
+}
+
+void peakSlow(Counter c, uint64_t value) {
+    Thread& t = thread();
+    t.counters[c] = std::max(t.counters[c], value);
+}
+
+}
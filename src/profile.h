@@ -0,0 +1,166 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Lightweight profiling of where the time goes.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <utility>
+
+/**
+ * Records how long things take and how often they happen. The results can be
+ * written out as a trace that can be loaded into chrome://tracing, along with
+ * a short summary.
+ *
+ * Unless profiling was started, every function here returns after checking a
+ * single flag. Each thread records into its own buffer, so profiling doesn't
+ * add any contention either.
+ */
+namespace profile {
+
+/**
+ * Things that are timed.
+ */
+enum Timer {
+    lua,        // Running the main script.
+    shutdown,   // Resolving targets and generating their rules.
+    import,     // Running an imported script in its own Lua state.
+    glob,       // Calls to glob().
+    readdir,    // Listing a directory.
+    rules,      // Adding rules. Too frequent to trace individually.
+    hash,       // Computing the checksum of an input.
+    depsWrite,  // Sending dependencies to the parent build system.
+    task,       // Running a task on a thread pool.
+    taskWait,   // Time a task spent queued before it ran. Not traced.
+    timerCount
+};
+
+/**
+ * Things that are counted.
+ */
+enum Counter {
+    dirCacheHits,   // Lookups of directories that were already listed.
+    dirCacheMisses, // Lookups that had to list the directory.
+    dirsListed,     // Directories actually read from disk.
+    globCacheHits,  // Globs that were answered from an earlier, identical one.
+    publishInputs,  // Calls to publish_input().
+    rulesAdded,     // Rules added.
+    bytesEmitted,   // Bytes of rules written to the output.
+    depsBytes,      // Bytes of dependencies sent to the parent build system.
+    queueDepth,     // Tasks queued on a thread pool. Sampled, not summed.
+    luaPeak,        // Most memory used by any one Lua state. Not summed.
+    processPeak,    // Most memory used by the whole process. Not summed.
+    counterCount
+};
+
+/**
+ * True while profiling. Only changed while no other threads are running.
+ */
+extern bool active;
+
+inline bool enabled() {
+    return active;
+}
+
+/**
+ * Nanoseconds since profiling started.
+ */
+uint64_t now();
+
+/**
+ * Starts profiling. This must be called before any threads are started.
+ */
+void start();
+
+/**
+ * Stops profiling and writes out the trace to the given file. A summary is
+ * written to the given stream. This must be called once every other thread is
+ * done. Returns false if the trace could not be written.
+ */
+bool finish(const char* path, FILE* summary);
+
+/**
+ * Records that something took from the given start time until now. The detail
+ * shows up in the trace.
+ */
+void record(Timer t, uint64_t start, const char* detail = NULL,
+        size_t length = 0);
+
+void addSlow(Counter c, uint64_t n);
+void sampleSlow(Counter c, uint64_t value);
+void peakSlow(Counter c, uint64_t value);
+
+/**
+ * Adds to a counter.
+ */
+inline void count(Counter c, uint64_t n = 1) {
+    if (active) addSlow(c, n);
+}
+
+/**
+ * Records the current value of a counter that goes up and down.
+ */
+inline void sample(Counter c, uint64_t value) {
+    if (active) sampleSlow(c, value);
+}
+
+/**
+ * Raises a counter to the given value if it is lower. Unlike sample(), this
+ * doesn't show up in the trace.
+ */
+inline void peak(Counter c, uint64_t value) {
+    if (active) peakSlow(c, value);
+}
+
+/**
+ * Times the scope it is in.
+ */
+class Span {
+private:
+    const Timer _timer;
+    const uint64_t _start;
+    const char* _detail;
+    size_t _length;
+
+public:
+    explicit Span(Timer t, const char* detail = NULL, size_t length = 0)
+        : _timer(t), _start(active ? now() : 0), _detail(detail),
+          _length(length) {}
+
+    ~Span() {
+        if (active) record(_timer, _start, _detail, _length);
+    }
+
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+};
+
+/**
+ * Wraps a task so that the time it spends queued and running is recorded.
+ */
+template<class Fn>
+class TimedTask {
+private:
+    Fn _f;
+    uint64_t _queued;
+
+public:
+    explicit TimedTask(Fn&& f) : _f(std::move(f)), _queued(now()) {}
+    explicit TimedTask(const Fn& f) : _f(f), _queued(now()) {}
+
+    void operator()() {
+        const uint64_t started = now();
+        record(taskWait, _queued);
+        _f();
+        record(task, started);
+    }
+};
+
+}
@@ -0,0 +1,410 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Replays the output of a previous run if nothing it depended on has changed.
+ */
+
+#ifdef _WIN32
+#   define _CRT_SECURE_NO_WARNINGS
+#   include <windows.h>
+#endif
+
+#include <string.h>
+#include <time.h>
+
+#include "replaycache.h"
+#include "deps.h"
+#include "dircache.h"
+#include "embedded.h"
+#include "hasher.h"
+#include "output.h"
+
+namespace {
+
+const char magic[4] = {'B', 'T', 'R', 'C'};
+const uint32_t version = 2;
+
+// Size of a stamp in the file.
+const size_t stampSize = 32;
+
+/**
+ * Adds a string to the key along with its length so that the strings can't run
+ * into each other.
+ */
+void hashString(Sha256& h, const char* s, size_t length) {
+    char buf[4];
+    setU32(buf, (uint32_t)length);
+    h.update(buf, sizeof(buf));
+    h.update(s, length);
+}
+
+/**
+ * Reads an entire file.
+ */
+bool readFile(const std::string& path, std::string& contents) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        contents.append(buf, n);
+
+    const bool ok = ferror(f) == 0;
+    fclose(f);
+    return ok;
+}
+
+/**
+ * Writes out an input along with what it takes to check it next time. Returns
+ * false if there is no way to check it.
+ */
+bool putInput(OutputBuffer& out, DirCache& dirCache, const std::string& record,
+        uint64_t startTime) {
+
+    Dependency dep;
+    memcpy(&dep, record.data(), sizeof(dep));
+
+    const char* name = record.data() + sizeof(dep);
+    const std::string path(name, dep.length);
+
+    DirStamp stamp;
+    const bool exists = DirStamp::get(path, stamp);
+
+    // The parent gets the input again just as it was reported, even if it is
+    // checked some other way.
+    const bool nameOnly = dep.status == 0;
+
+    if (dep.status == 0) {
+        if (!exists) {
+            dep.status = 1;
+        }
+        else if (isDir(path)) {
+            // This is the same checksum upToDate() compares it with.
+            const std::string& names = dirCache.dirEntries(path).names();
+            Sha256::hash(names.data(), names.size(), dep.checksum);
+            dep.status = 3;
+        }
+        else {
+            // It couldn't be read for some reason and there is nothing to
+            // compare it with.
+            return false;
+        }
+    }
+
+    // If the file changed while it was being read, the checksum is of the old
+    // contents and the stamp is of the new ones. The stamp is then not used.
+    const bool hasStamp = exists && !stamp.isRacy(startTime);
+
+    putU32(out, dep.status);
+    out.write((const char*)dep.checksum, sizeof(dep.checksum));
+    out.put(nameOnly ? 1 : 0);
+    out.put(hasStamp ? 1 : 0);
+    putU64(out, hasStamp ? stamp.dev : 0);
+    putU64(out, hasStamp ? stamp.ino : 0);
+    putU64(out, hasStamp ? stamp.mtime : 0);
+    putU64(out, hasStamp ? stamp.ctime : 0);
+    putU32(out, dep.length);
+    out.write(name, dep.length);
+
+    return true;
+}
+
+void putOutput(OutputBuffer& out, const std::string& record) {
+    Dependency dep;
+    memcpy(&dep, record.data(), sizeof(dep));
+
+    putU32(out, dep.status);
+    out.write((const char*)dep.checksum, sizeof(dep.checksum));
+    putU32(out, dep.length);
+    out.write(record.data() + sizeof(dep), dep.length);
+}
+
+}
+
+ReplayCache::ReplayCache(const char* path, int argc, char** argv,
+        const char* script)
+    : _path(path), _hasKey(false), _startTime(0), _capture(NULL),
+      _rules(NULL), _rulesLength(0) {
+
+    // The main script isn't reported as an input, so it is part of the key
+    // instead.
+    uint8_t checksum[Sha256::digestLength];
+    if (checksumFile(script, checksum) != 2)
+        return;
+
+    Sha256 h;
+
+    char buf[4];
+    setU32(buf, version);
+    h.update(buf, sizeof(buf));
+
+    const std::string cwd = currentDir();
+    hashString(h, cwd.data(), cwd.size());
+
+    for (int i = 0; i < argc; ++i)
+        hashString(h, argv[i], strlen(argv[i]));
+
+    h.update(checksum, sizeof(checksum));
+
+    hash_embedded(h);
+
+    h.finish(_key);
+    _hasKey = true;
+}
+
+ReplayCache::~ReplayCache() {
+    if (_capture) fclose(_capture);
+}
+
+bool ReplayCache::parse() {
+    const char* data = _data.data();
+    const size_t length = _data.size();
+
+    size_t pos = sizeof(magic) + 4 + sizeof(_key);
+
+    if (length < pos + 4 || memcmp(data, magic, sizeof(magic)) != 0 ||
+            getU32(data + 4) != version ||
+            memcmp(data + 8, _key, sizeof(_key)) != 0)
+        return false;
+
+    const uint32_t inputs = getU32(data + pos);
+    pos += 4;
+
+    for (uint32_t i = 0; i < inputs; ++i) {
+        if (length - pos < 4 + Sha256::digestLength + 2 + stampSize + 4)
+            return false;
+
+        Record r;
+        r.status = getU32(data + pos);
+        r.checksum = (const uint8_t*)data + pos + 4;
+        pos += 4 + Sha256::digestLength;
+
+        r.nameOnly = data[pos] != 0;
+        ++pos;
+
+        r.hasStamp = data[pos] != 0;
+        r.stamp.dev   = getU64(data + pos + 1);
+        r.stamp.ino   = getU64(data + pos + 9);
+        r.stamp.mtime = getU64(data + pos + 17);
+        r.stamp.ctime = getU64(data + pos + 25);
+        pos += 1 + stampSize;
+
+        r.length = getU32(data + pos);
+        pos += 4;
+
+        if (length - pos < r.length)
+            return false;
+
+        r.name = data + pos;
+        pos += r.length;
+
+        _inputs.push_back(r);
+    }
+
+    if (length - pos < 4)
+        return false;
+
+    const uint32_t outputs = getU32(data + pos);
+    pos += 4;
+
+    for (uint32_t i = 0; i < outputs; ++i) {
+        if (length - pos < 4 + Sha256::digestLength + 4)
+            return false;
+
+        Record r;
+        r.status = getU32(data + pos);
+        r.checksum = (const uint8_t*)data + pos + 4;
+        r.nameOnly = false;
+        r.hasStamp = false;
+        pos += 4 + Sha256::digestLength;
+
+        r.length = getU32(data + pos);
+        pos += 4;
+
+        if (length - pos < r.length)
+            return false;
+
+        r.name = data + pos;
+        pos += r.length;
+
+        _outputs.push_back(r);
+    }
+
+    if (length - pos < 8)
+        return false;
+
+    _rulesLength = getU64(data + pos);
+    pos += 8;
+
+    if (length - pos != _rulesLength + Sha256::digestLength)
+        return false;
+
+    _rules = data + pos;
+
+    // Don't replay a file that got cut short or corrupted.
+    uint8_t checksum[Sha256::digestLength];
+    Sha256::hash(_rules, (size_t)_rulesLength, checksum);
+
+    return memcmp(checksum, _rules + _rulesLength, sizeof(checksum)) == 0;
+}
+
+bool ReplayCache::upToDate(DirCache& dirCache, const Record& r) const {
+    const std::string path(r.name, r.length);
+
+    DirStamp stamp;
+    const bool exists = DirStamp::get(path, stamp);
+
+    if (r.status == 1)
+        return !exists;
+
+    if (!exists)
+        return false;
+
+    // Nothing needs to be read if it hasn't been touched.
+    if (r.hasStamp && stamp == r.stamp)
+        return true;
+
+    uint8_t checksum[Sha256::digestLength];
+
+    if (r.status == 3) {
+        // This is the same checksum the directory was reported with.
+        const std::string& names = dirCache.dirEntries(path).names();
+        Sha256::hash(names.data(), names.size(), checksum);
+    }
+    else if (r.status != 2 || checksumFile(path, checksum) != 2) {
+        return false;
+    }
+
+    return memcmp(checksum, r.checksum, sizeof(checksum)) == 0;
+}
+
+bool ReplayCache::check() {
+    if (!_hasKey || !readFile(_path, _data) || !parse())
+        return false;
+
+    DirCache dirCache;
+
+    for (auto&& r: _inputs) {
+        if (!upToDate(dirCache, r))
+            return false;
+    }
+
+    return true;
+}
+
+void ReplayCache::replay(FILE* output, ImplicitDeps& deps) {
+    fwrite(_rules, 1, (size_t)_rulesLength, output);
+
+    for (auto&& r: _inputs) {
+        if (r.nameOnly)
+            deps.addInput(r.name, r.length);
+        else
+            deps.addInput(r.name, r.length, r.status, r.checksum);
+    }
+
+    for (auto&& r: _outputs)
+        deps.addOutput(r.name, r.length, r.status, r.checksum);
+}
+
+FILE* ReplayCache::record(ImplicitDeps& deps) {
+    if (!_hasKey)
+        return NULL;
+
+    _capture = tmpfile();
+    if (!_capture)
+        return NULL;
+
+    _startTime = (uint64_t)time(NULL);
+    deps.record();
+
+    return _capture;
+}
+
+bool ReplayCache::finish(FILE* output, const ImplicitDeps& deps) {
+    if (!_capture)
+        return false;
+
+    fflush(_capture);
+    fseek(_capture, 0, SEEK_END);
+    const long rulesLength = ftell(_capture);
+    rewind(_capture);
+
+    // Everything but the rules. Nothing is saved if an input can't be checked.
+    OutputBuffer head(NULL, 1 << 16);
+
+    bool save = rulesLength >= 0;
+
+    DirCache dirCache;
+
+    putU32(head, (uint32_t)deps.inputs().size());
+    for (auto&& record: deps.inputs()) {
+        if (!save) break;
+        save = putInput(head, dirCache, record, _startTime);
+    }
+
+    putU32(head, (uint32_t)deps.outputs().size());
+    for (auto&& record: deps.outputs())
+        putOutput(head, record);
+
+    const std::string tmp = _path + ".tmp";
+
+    FILE* f = save ? fopen(tmp.c_str(), "wb") : NULL;
+    save = f != NULL;
+
+    Sha256 h;
+    uint64_t copied = 0;
+
+    {
+        OutputBuffer out(f);
+
+        if (save) {
+            out.write(magic, sizeof(magic));
+            putU32(out, version);
+            out.write((const char*)_key, sizeof(_key));
+            out.write(head.data(), head.length());
+            putU64(out, (uint64_t)rulesLength);
+        }
+
+        // The rules go to the output and the file at the same time.
+        char buf[1 << 16];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), _capture)) > 0) {
+            fwrite(buf, 1, n, output);
+
+            if (save) {
+                h.update(buf, n);
+                out.write(buf, n);
+            }
+
+            copied += n;
+        }
+
+        if (save) {
+            uint8_t checksum[Sha256::digestLength];
+            h.finish(checksum);
+            out.write((const char*)checksum, sizeof(checksum));
+        }
+    }
+
+    if (!f)
+        return false;
+
+    const bool ok = ferror(f) == 0 && ferror(_capture) == 0 &&
+        copied == (uint64_t)rulesLength;
+
+    if (fclose(f) != 0 || !ok) {
+        remove(tmp.c_str());
+        return false;
+    }
+
+#ifdef _WIN32
+    return MoveFileExA(tmp.c_str(), _path.c_str(),
+            MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(tmp.c_str(), _path.c_str()) == 0;
+#endif
+}
@@ -0,0 +1,134 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Replays the output of a previous run if nothing it depended on has changed.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "dircachefile.h"
+#include "sha256.h"
+
+class ImplicitDeps;
+class DirCache;
+
+/**
+ * Saves the output of a run along with everything that went into it. The next
+ * run with the same command line checks that none of it has changed and, if
+ * so, replays the output without running any build scripts.
+ *
+ * A run is identified by a key: the checksum of the command line, the working
+ * directory, the main script, and the embedded scripts. Everything else it
+ * depended on is what was reported through ImplicitDeps. That is, the scripts
+ * that were loaded, the files given to publish_input(), and the directories
+ * that were listed. These are checked by their stamp (see DirStamp) and, only
+ * if that changed, by their checksum. Anything a script reads in some other
+ * way, such as with io.open() or os.getenv(), is not known about.
+ *
+ * The file is laid out as follows. All integers are little-endian.
+ *
+ *     "BTRC"        Magic bytes.
+ *     version       32-bit format version. Currently 2.
+ *     key           32-byte key of the run.
+ *     input count   32-bit number of inputs.
+ *     inputs        For each input, its 32-bit status and 32-byte checksum (see
+ *                   Dependency), a byte that is 1 if it was reported by name
+ *                   only, a byte that is 1 if the stamp that follows is valid,
+ *                   the stamp (4 64-bit integers), and the 32-bit length of the
+ *                   name followed by the name.
+ *
+ * An input reported by name only is checked by what it was found to be when
+ * the run was saved: missing, or a directory and the checksum of its listing.
+ * Any other such input can't be checked, so the run isn't saved.
+ *     output count  32-bit number of outputs.
+ *     outputs       For each output, its 32-bit status, 32-byte checksum, and
+ *                   the 32-bit length of the name followed by the name.
+ *     length        64-bit length of the rules that were written.
+ *     rules         The rules themselves.
+ *     checksum      32-byte checksum of the rules.
+ */
+class ReplayCache {
+private:
+    struct Record {
+        uint32_t status;
+        const uint8_t* checksum;
+
+        // True if it is to be reported by name only.
+        bool nameOnly;
+
+        bool hasStamp;
+        DirStamp stamp;
+
+        const char* name;
+        uint32_t length;
+    };
+
+    const std::string _path;
+
+    uint8_t _key[Sha256::digestLength];
+    bool _hasKey;
+
+    // Time at which the run started.
+    uint64_t _startTime;
+
+    // While recording, the rules are written here first.
+    FILE* _capture;
+
+    // Contents of the file loaded by check(). The records point into it.
+    std::string _data;
+    std::vector<Record> _inputs;
+    std::vector<Record> _outputs;
+    const char* _rules;
+    uint64_t _rulesLength;
+
+public:
+    /**
+     * The key of the run is computed from the given command line arguments and
+     * main script.
+     */
+    ReplayCache(const char* path, int argc, char** argv, const char* script);
+    ~ReplayCache();
+
+    ReplayCache(const ReplayCache&) = delete;
+    ReplayCache& operator=(const ReplayCache&) = delete;
+
+    /**
+     * Loads the saved run and returns true if it can be replayed. This is the
+     * case if it has the same key and none of its inputs have changed.
+     */
+    bool check();
+
+    /**
+     * Writes out the saved rules and reports the saved dependencies again.
+     * check() must have returned true.
+     */
+    void replay(FILE* output, ImplicitDeps& deps);
+
+    /**
+     * Starts recording a run. Returns the file the rules are to be written to
+     * instead of the output, or NULL if the run can't be recorded.
+     */
+    FILE* record(ImplicitDeps& deps);
+
+    /**
+     * Copies the rules of a successful run to the output and saves them along
+     * with the dependencies that were recorded. The file is replaced
+     * atomically.
+     *
+     * Returns false if the run could not be saved. The rules are copied to the
+     * output regardless.
+     */
+    bool finish(FILE* output, const ImplicitDeps& deps);
+
+private:
+    bool parse();
+    bool upToDate(DirCache& dirCache, const Record& r) const;
+};
@@ -9,46 +9,167 @@
 #include "lua.hpp"
 
 #include <stdio.h>
+
+#include <string>
+#include <vector>
+
 #include "rules.h"
+#include "profile.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   define HAVE_SSE2
+#   include <emmintrin.h>
+#   ifdef _MSC_VER
+#       include <intrin.h>
+#   endif
+#endif
 
 namespace {
 
-const char  escape_chars[] = {'\"',   '\t',  '\r',  '\n',  '\b',  '\\',  '\0'};
-const char* replacements[] = {"\\\"", "\\t", "\\r", "\\n", "\\b", "\\\\", NULL};
+/**
+ * Table of JSON escape sequences. Characters that don't need to be escaped map
+ * to NULL.
+ */
+struct EscapeTable {
+    const char* replacements[256];
 
-int json_print(lua_State* L, FILE* f);
+    EscapeTable() : replacements() {
+        replacements[(unsigned char)'\"'] = "\\\"";
+        replacements[(unsigned char)'\t'] = "\\t";
+        replacements[(unsigned char)'\r'] = "\\r";
+        replacements[(unsigned char)'\n'] = "\\n";
+        replacements[(unsigned char)'\b'] = "\\b";
+        replacements[(unsigned char)'\\'] = "\\\\";
+    }
+};
+
+const EscapeTable escapes;
+
+int json_print(lua_State* L, OutputBuffer& f);
 const char* json_escape_sequence(char c);
-void json_print_string(const char* s, size_t len, FILE* f);
-int json_print_table(lua_State* L, FILE* f);
-int json_print(lua_State* L, FILE* f);
+size_t json_find_escape(const char* s, size_t len);
+void json_print_string(const char* s, size_t len, OutputBuffer& f);
+int json_print_table(lua_State* L, OutputBuffer& f);
 
 /**
  * For the given character, returns the equivalent JSON escape sequence. If the
  * given character is not a character to be escaped, returns NULL.
  */
-const char* json_escape_sequence(char c) {
-    for (size_t i = 0; escape_chars[i] != '\0'; ++i) {
-        if (escape_chars[i] == c)
-            return replacements[i];
+inline const char* json_escape_sequence(char c) {
+    return escapes.replacements[(unsigned char)c];
+}
+
+#ifdef HAVE_SSE2
+
+/**
+ * Returns the index of the lowest set bit. The mask must not be 0.
+ */
+inline unsigned lowest_bit(unsigned mask) {
+#   ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, mask);
+    return (unsigned)i;
+#   else
+    return (unsigned)__builtin_ctz(mask);
+#   endif
+}
+
+#endif // HAVE_SSE2
+
+/**
+ * Returns the index of the first character in the string that needs to be
+ * escaped. If there is no such character, returns the length of the string.
+ *
+ * Where possible, 16 characters are checked at a time.
+ */
+size_t json_find_escape(const char* s, size_t len) {
+    size_t i = 0;
+
+#ifdef HAVE_SSE2
+    const __m128i quote     = _mm_set1_epi8('\"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i tab       = _mm_set1_epi8('\t');
+    const __m128i cr        = _mm_set1_epi8('\r');
+    const __m128i lf        = _mm_set1_epi8('\n');
+    const __m128i bs        = _mm_set1_epi8('\b');
+
+    for (; i + 16 <= len; i += 16) {
+        const __m128i chunk = _mm_loadu_si128((const __m128i*)(s + i));
+
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                         _mm_cmpeq_epi8(chunk, backslash)),
+            _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, tab),
+                             _mm_cmpeq_epi8(chunk, cr)),
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, lf),
+                             _mm_cmpeq_epi8(chunk, bs))));
+
+        if (unsigned mask = (unsigned)_mm_movemask_epi8(m))
+            return i + lowest_bit(mask);
+    }
+#else
+    for (; i + 4 <= len; i += 4) {
+        if (json_escape_sequence(s[i]))   return i;
+        if (json_escape_sequence(s[i+1])) return i+1;
+        if (json_escape_sequence(s[i+2])) return i+2;
+        if (json_escape_sequence(s[i+3])) return i+3;
+    }
+#endif
+
+    for (; i < len; ++i) {
+        if (json_escape_sequence(s[i]))
+            return i;
     }
 
-    return NULL;
+    return len;
 }
 
 /**
- * Prints the given string to the given file in JSON format.
+ * Prints the given characters to the given buffer, escaped for use in a JSON
+ * string.
+ *
+ * Runs of characters that don't need escaping are copied in bulk.
  */
-void json_print_string(const char* s, size_t len, FILE* f) {
-    fputc('"', f); // Opening quote
+void json_print_chars(const char* s, size_t len, OutputBuffer& f) {
+    while (len > 0) {
+        const size_t n = json_find_escape(s, len);
 
-    for (size_t i = 0; i < len; ++i) {
-        if (const char* r = json_escape_sequence(s[i]))
-            fputs(r, f);
-        else
-            fputc(s[i], f);
+        f.write(s, n);
+
+        if (n == len)
+            break;
+
+        const char* r = json_escape_sequence(s[n]);
+        f.write(r, 2);
+
+        s += n + 1;
+        len -= n + 1;
     }
+}
 
-    fputc('"', f); // Closing quote
+/**
+ * Prints the given string to the given buffer in JSON format.
+ */
+void json_print_string(const char* s, size_t len, OutputBuffer& f) {
+    f.put('"'); // Opening quote
+    json_print_chars(s, len, f);
+    f.put('"'); // Closing quote
+}
+
+/**
+ * Returns the given string in JSON format. If quote is false, the string is
+ * only escaped.
+ */
+std::string json_encode(const std::string& s, bool quote = true) {
+    OutputBuffer buf(NULL, s.size() + 16);
+
+    if (quote)
+        json_print_string(s.data(), s.size(), buf);
+    else
+        json_print_chars(s.data(), s.size(), buf);
+
+    return std::string(buf.data(), buf.length());
 }
 
 /**
@@ -56,9 +177,9 @@ void json_print_string(const char* s, size_t len, FILE* f) {
  *
  * The table is assumed to be a sequential array.
  */
-int json_print_table(lua_State* L, FILE* f) {
+int json_print_table(lua_State* L, OutputBuffer& f) {
 
-    fputs("[", f);
+    f.put('[');
 
     for (int i = 1; ; ++i) {
         lua_rawgeti(L, -1, i);
@@ -70,7 +191,7 @@ int json_print_table(lua_State* L, FILE* f) {
         }
 
         if (i > 1)
-            fputs(", ", f);
+            f.write(", ", 2);
 
         json_print(L, f);
 
@@ -78,7 +199,7 @@ int json_print_table(lua_State* L, FILE* f) {
         lua_pop(L, 1);
     }
 
-    fputs("]", f);
+    f.put(']');
 
     return 0;
 }
@@ -86,21 +207,28 @@ int json_print_table(lua_State* L, FILE* f) {
 /**
  * Prints the value at the top of the stack.
  */
-int json_print(lua_State* L, FILE* f) {
+int json_print(lua_State* L, OutputBuffer& f) {
 
     switch (lua_type(L, -1))
     {
     case LUA_TNIL:
-        fputs("null", f);
+        f.write("null", 4);
         break;
 
     case LUA_TBOOLEAN:
-        fputs(lua_toboolean(L, -1) ? "true" : "false", f);
+        if (lua_toboolean(L, -1))
+            f.write("true", 4);
+        else
+            f.write("false", 5);
         break;
 
-    case LUA_TNUMBER:
-        fprintf(f, "%f", lua_tonumber(L, -1));
+    case LUA_TNUMBER: {
+        char buf[512];
+        int n = snprintf(buf, sizeof(buf), "%f", lua_tonumber(L, -1));
+        if (n > 0)
+            f.write(buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf)-1);
         break;
+    }
 
     case LUA_TTABLE:
         return json_print_table(L, f);
@@ -122,40 +250,473 @@ int json_print(lua_State* L, FILE* f) {
 /**
  * Prints a single field of a JSON dictionary.
  */
-int json_print_field(lua_State* L, const char* field, FILE* f) {
+template<size_t N>
+int json_print_field(lua_State* L, const char (&field)[N], OutputBuffer& f) {
 
-    fprintf(f, "\"%s\": ", field);
+    f.put('"');
+    f.write(field, N-1);
+    f.write("\": ", 3);
 
     json_print(L, f);
 
     return 0;
 }
 
+/**
+ * Adds the string or number at the top of the stack to the string table and
+ * writes out its ID.
+ */
+int binary_print_string(lua_State* L, const char* field, StringTable& strings,
+        OutputBuffer& f) {
+
+    switch (lua_type(L, -1))
+    {
+    case LUA_TSTRING:
+    case LUA_TNUMBER: {
+        size_t len;
+        const char* s = lua_tolstring(L, -1, &len);
+        putU32(f, strings.intern(s, len));
+        break;
+    }
+
+    default:
+        return luaL_error(L, "bad type for element in field '%s' (string expected, got %s)",
+                field, luaL_typename(L, -1));
+    }
+
+    return 0;
+}
+
+/**
+ * Writes out the list of strings at the top of the stack. The number of
+ * elements comes first.
+ */
+int binary_print_list(lua_State* L, const char* field, StringTable& strings,
+        OutputBuffer& f) {
+
+    // Element count. Filled in after we know it.
+    const size_t countOffset = f.length();
+    putU32(f, 0);
+
+    uint32_t n = 0;
+
+    for (int i = 1; ; ++i) {
+        lua_rawgeti(L, -1, i);
+
+        if (lua_type(L, -1) == LUA_TNIL) {
+            lua_pop(L, 1);
+            break;
+        }
+
+        binary_print_string(L, field, strings, f);
+        ++n;
+
+        // Pop table element
+        lua_pop(L, 1);
+    }
+
+    setU32(f.data() + countOffset, n);
+
+    return 0;
+}
+
+/**
+ * Writes out an optional string field that is at the top of the stack.
+ */
+int binary_print_optional(lua_State* L, const char* field, StringTable& strings,
+        OutputBuffer& f) {
+
+    switch (lua_type(L, -1))
+    {
+    case LUA_TSTRING: {
+        size_t len;
+        const char* s = lua_tolstring(L, -1, &len);
+        putU32(f, strings.intern(s, len));
+        break;
+    }
+    case LUA_TNIL:
+        // Not specified
+        putU32(f, 0xFFFFFFFF);
+        break;
+    default:
+        return luaL_error(L, "bad type for field '%s' (string expected, got %s)",
+                field, luaL_typename(L, -1));
+    }
+
+    return 0;
+}
+
+/**
+ * Returns true if the argument refers to the rule's input or output.
+ */
+bool has_variable(const std::string& arg) {
+    return arg.find("$in") != std::string::npos ||
+           arg.find("$out") != std::string::npos;
+}
+
+/**
+ * Replaces "$in" and "$out" in the given argument.
+ */
+void expand(const std::string& arg, const char* in, size_t inLen,
+        const char* out, size_t outLen, std::string& buf) {
+
+    buf.clear();
+
+    for (size_t i = 0; i < arg.size(); ) {
+        if (arg.compare(i, 3, "$in") == 0) {
+            buf.append(in, inLen);
+            i += 3;
+        }
+        else if (arg.compare(i, 4, "$out") == 0) {
+            buf.append(out, outLen);
+            i += 4;
+        }
+        else {
+            buf.push_back(arg[i]);
+            ++i;
+        }
+    }
+}
+
+/**
+ * Checks that the given field of the table at the given index is either missing
+ * or a list of strings. Raises a Lua error if it isn't.
+ */
+void check_list_field(lua_State* L, int index, const char* field) {
+
+    lua_getfield(L, index, field);
+
+    switch (lua_type(L, -1))
+    {
+    case LUA_TNIL:
+        break;
+
+    case LUA_TTABLE:
+        for (int i = 1; ; ++i) {
+            lua_rawgeti(L, -1, i);
+            int type = lua_type(L, -1);
+            lua_pop(L, 1);
+
+            if (type == LUA_TNIL)
+                break;
+
+            if (type != LUA_TSTRING)
+                luaL_error(L, "bad type for element in field '%s' (string expected, got %s)",
+                        field, lua_typename(L, type));
+        }
+        break;
+
+    default:
+        luaL_error(L, "bad type for field '%s' (table expected, got %s)",
+                field, luaL_typename(L, -1));
+    }
+
+    lua_pop(L, 1);
+}
+
+/**
+ * Checks that the given field of the table at the given index is either missing
+ * or a string. Raises a Lua error if it isn't.
+ */
+void check_optional_field(lua_State* L, int index, const char* field) {
+
+    lua_getfield(L, index, field);
+
+    const int type = lua_type(L, -1);
+    if (type != LUA_TSTRING && type != LUA_TNIL)
+        luaL_error(L, "bad type for field '%s' (string expected, got %s)",
+                field, luaL_typename(L, -1));
+
+    lua_pop(L, 1);
+}
+
+/**
+ * Gets the list of strings in the given field of the table at the given index.
+ * The field must have been checked with check_list_field().
+ */
+template<typename T>
+void get_string_list(lua_State* L, int index, const char* field,
+        std::vector<T>& v) {
+
+    lua_getfield(L, index, field);
+
+    if (lua_type(L, -1) == LUA_TTABLE) {
+        for (int i = 1; ; ++i) {
+            lua_rawgeti(L, -1, i);
+
+            if (lua_type(L, -1) == LUA_TNIL) {
+                lua_pop(L, 1);
+                break;
+            }
+
+            size_t len;
+            const char* s = lua_tolstring(L, -1, &len);
+            v.emplace_back(s, len);
+
+            // Pop table element
+            lua_pop(L, 1);
+        }
+    }
+
+    lua_pop(L, 1);
+}
+
+/**
+ * Gets the optional string in the given field of the table at the given
+ * index. Returns true if it was given. The field must have been checked with
+ * check_optional_field().
+ */
+bool get_optional_string(lua_State* L, int index, const char* field,
+        std::string& s) {
+
+    lua_getfield(L, index, field);
+
+    bool found = false;
+
+    if (lua_type(L, -1) == LUA_TSTRING) {
+        size_t len;
+        const char* p = lua_tolstring(L, -1, &len);
+        s.assign(p, len);
+        found = true;
+    }
+
+    lua_pop(L, 1);
+    return found;
+}
+
+/**
+ * Checks that the optional table of strings at the given index only has
+ * strings in it. Returns the number of strings.
+ */
+size_t check_string_list(lua_State* L, int index, const char* field) {
+    if (lua_isnoneornil(L, index))
+        return 0;
+
+    luaL_checktype(L, index, LUA_TTABLE);
+
+    size_t n = 0;
+
+    for (int i = 1; ; ++i) {
+        lua_rawgeti(L, index, i);
+        int type = lua_type(L, -1);
+        lua_pop(L, 1);
+
+        if (type == LUA_TNIL)
+            break;
+
+        if (type != LUA_TSTRING)
+            luaL_error(L, "bad type for element in field '%s' (string expected, got %s)",
+                    field, lua_typename(L, type));
+
+        ++n;
+    }
+
+    return n;
+}
+
 }
 
 namespace buttonlua {
 
-Rules::Rules(FILE* f) : _f(f), _n(0) {
-    fputs("[", _f);
+RuleTemplate::RuleTemplate()
+    : _rules(NULL), _interned(false), _hasDisplay(false), _hasCwd(false),
+      _cwdId(0xFFFFFFFF) {
+}
+
+int RuleTemplate::init(lua_State* L, int index, Rules& rules) {
+
+    luaL_checktype(L, index, LUA_TTABLE);
+
+    // Errors don't unwind the stack, so everything is checked before any of it
+    // is copied out.
+    check_list_field(L, index, "inputs");
+    check_list_field(L, index, "command");
+    check_list_field(L, index, "args");
+    check_optional_field(L, index, "display");
+    check_optional_field(L, index, "cwd");
+
+    _rules = &rules;
+
+    get_string_list(L, index, "inputs", _inputs);
+    get_string_list(L, index, "command", _command);
+    get_string_list(L, index, "args", _args);
+    _hasDisplay = get_optional_string(L, index, "display", _display);
+    _hasCwd = get_optional_string(L, index, "cwd", _cwd);
+
+    for (auto&& arg: _args)
+        arg.substitute = has_variable(arg.text);
+
+    if (rules._format == RuleFormat::binary) {
+        // Filled in by the first rule.
+        _inputIds.resize(_inputs.size());
+        _commandIds.resize(_command.size());
+        return 0;
+    }
+
+    for (auto&& v: _inputs) {
+        if (!_jsonInputs.empty()) _jsonInputs.append(", ");
+        _jsonInputs.append(json_encode(v));
+    }
+
+    for (auto&& v: _command) {
+        if (!_jsonCommand.empty()) _jsonCommand.append(", ");
+        _jsonCommand.append(json_encode(v));
+    }
+
+    // Arguments with variables can only be encoded for each rule.
+    for (auto&& arg: _args) {
+        if (!arg.substitute)
+            arg.json = json_encode(arg.text);
+    }
+
+    if (_hasDisplay)
+        _jsonDisplay = json_encode(_display, false);
+
+    if (_hasCwd)
+        _jsonCwd = json_encode(_cwd);
+
+    return 0;
+}
+
+Rules::Rules(FILE* f, RuleFormat format)
+    : _format(format), _out(f), _n(0), _records(NULL, 4096), _partial(0),
+      _shard(false) {
+
+    if (_format == RuleFormat::json)
+        _out.put('[');
+}
+
+Rules::Rules(RuleFormat format)
+    : _format(format), _out(NULL), _n(0), _records(NULL, 4096), _partial(0),
+      _shard(true) {
 }
 
 Rules::~Rules() {
-    fputs("\n]\n", _f);
+    if (_shard)
+        return;
+
+    if (_format == RuleFormat::json) {
+        _out.write("\n]\n", 3);
+    }
+    else {
+        // Throw away the last rule if it was left incomplete.
+        if (_partial != 0)
+            _records.truncate(_partial - 1);
+
+        _out.write("BTNR", 4);
+        putU32(_out, 1);
+
+        putU32(_out, (uint32_t)_strings.size());
+        _out.write(_strings.data().data(), _strings.data().length());
+
+        putU32(_out, (uint32_t)_n);
+        _out.write(_records.data(), _records.length());
+    }
+
+    profile::count(profile::bytesEmitted, _out.written() + _out.length());
+}
+
+void Rules::append(Rules& shard) {
+    if (_format == RuleFormat::json) {
+        // The first rule of a shard isn't preceded by a comma.
+        if (shard._n > 0) {
+            if (_n > 0)
+                _out.put(',');
+
+            _out.write(shard._out.data(), shard._out.length());
+        }
+
+        _n += shard._n;
+        shard._out.clear();
+        shard._n = 0;
+        return;
+    }
+
+    if (shard._partial != 0) {
+        shard._records.truncate(shard._partial - 1);
+        shard._partial = 0;
+    }
+
+    if (_partial != 0) {
+        _records.truncate(_partial - 1);
+        _partial = 0;
+    }
+
+    // Strings are added in the same order that the shard first saw them. The
+    // string table thus ends up the same as if the shard's rules (and
+    // templates) had used this table all along.
+    std::vector<uint32_t> ids(shard._strings.size());
+    for (size_t i = 0; i < ids.size(); ++i)
+        ids[i] = _strings.intern(shard._strings.str((uint32_t)i),
+                shard._strings.length((uint32_t)i));
+
+    const char* p = shard._records.data();
+    const char* end = p + shard._records.length();
+
+    // Copies a count followed by that many string IDs, mapping each ID.
+    auto copyList = [&] {
+        const uint32_t n = getU32(p);
+        putU32(_records, n);
+        p += 4;
+
+        for (uint32_t i = 0; i < n; ++i, p += 4)
+            putU32(_records, ids[getU32(p)]);
+    };
+
+    // Copies an optional string ID.
+    auto copyOptional = [&] {
+        const uint32_t id = getU32(p);
+        putU32(_records, id == 0xFFFFFFFF ? id : ids[id]);
+        p += 4;
+    };
+
+    while (p < end) {
+        // The length stays the same.
+        putU32(_records, getU32(p));
+        p += 4;
+
+        copyList(); // inputs
+
+        const uint32_t commands = getU32(p);
+        putU32(_records, commands);
+        p += 4;
+
+        for (uint32_t i = 0; i < commands; ++i)
+            copyList();
+
+        copyList(); // outputs
+        copyOptional(); // cwd
+        copyOptional(); // display
+    }
+
+    _n += shard._n;
+    shard._records.clear();
+    shard._n = 0;
 }
 
 int Rules::add(lua_State* L) {
+    profile::Span span(profile::rules);
+    profile::count(profile::rulesAdded);
+
+    if (_format == RuleFormat::binary)
+        return addBinary(L);
+
+    return addJSON(L);
+}
+
+int Rules::addJSON(lua_State* L) {
 
     luaL_checktype(L, 1, LUA_TTABLE);
 
     if (_n > 0)
-        fputs(",", _f);
+        _out.put(',');
 
-    fputs("\n    {\n        ", _f);
+    _out.write("\n    {\n        ");
 
     // Inputs (required)
     lua_getfield(L, 1, "inputs");
     if (lua_type(L, -1) == LUA_TTABLE)
-        json_print_field(L, "inputs", _f);
+        json_print_field(L, "inputs", _out);
     else
         return luaL_error(L, "bad type for field '%s' (table expected, got %s)",
                 "inputs", luaL_typename(L, -1));
@@ -163,8 +724,8 @@ int Rules::add(lua_State* L) {
     // Task (required)
     lua_getfield(L, 1, "task");
     if (lua_type(L, -1) == LUA_TTABLE) {
-        fputs(",\n        ", _f);
-        json_print_field(L, "task", _f);
+        _out.write(",\n        ");
+        json_print_field(L, "task", _out);
     }
     else
         return luaL_error(L, "bad type for field '%s' (table expected, got %s)",
@@ -173,8 +734,8 @@ int Rules::add(lua_State* L) {
     // Outputs (required)
     lua_getfield(L, 1, "outputs");
     if (lua_type(L, -1) == LUA_TTABLE) {
-        fputs(",\n        ", _f);
-        json_print_field(L, "outputs", _f);
+        _out.write(",\n        ");
+        json_print_field(L, "outputs", _out);
     }
     else
         return luaL_error(L, "bad type for field '%s' (table expected, got %s)",
@@ -185,8 +746,8 @@ int Rules::add(lua_State* L) {
     switch (lua_type(L, -1))
     {
     case LUA_TSTRING:
-        fputs(",\n        ", _f);
-        json_print_field(L, "cwd", _f);
+        _out.write(",\n        ");
+        json_print_field(L, "cwd", _out);
         break;
     case LUA_TNIL:
         // Not specified
@@ -201,8 +762,8 @@ int Rules::add(lua_State* L) {
     switch (lua_type(L, -1))
     {
     case LUA_TSTRING:
-        fputs(",\n        ", _f);
-        json_print_field(L, "display", _f);
+        _out.write(",\n        ");
+        json_print_field(L, "display", _out);
         break;
     case LUA_TNIL:
         // Not specified
@@ -212,7 +773,252 @@ int Rules::add(lua_State* L) {
                 "display", luaL_typename(L, -1));
     }
 
-    fputs("\n    }", _f);
+    _out.write("\n    }");
+
+    ++_n;
+    return 0;
+}
+
+int Rules::addBinary(lua_State* L) {
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    // Throw away the last rule if it was left incomplete.
+    if (_partial != 0)
+        _records.truncate(_partial - 1);
+
+    const size_t start = _records.length();
+    _partial = start + 1;
+
+    // Record length. Filled in at the end.
+    putU32(_records, 0);
+
+    // Inputs (required)
+    lua_getfield(L, 1, "inputs");
+    if (lua_type(L, -1) == LUA_TTABLE)
+        binary_print_list(L, "inputs", _strings, _records);
+    else
+        return luaL_error(L, "bad type for field '%s' (table expected, got %s)",
+                "inputs", luaL_typename(L, -1));
+
+    // Task (required)
+    lua_getfield(L, 1, "task");
+    if (lua_type(L, -1) == LUA_TTABLE) {
+        const size_t countOffset = _records.length();
+        putU32(_records, 0);
+
+        uint32_t n = 0;
+
+        for (int i = 1; ; ++i) {
+            lua_rawgeti(L, -1, i);
+            int type = lua_type(L, -1);
+
+            if (type == LUA_TNIL) {
+                lua_pop(L, 1);
+                break;
+            }
+
+            if (type != LUA_TTABLE)
+                return luaL_error(L, "bad type for command in field '%s' (table expected, got %s)",
+                        "task", luaL_typename(L, -1));
+
+            binary_print_list(L, "task", _strings, _records);
+            ++n;
+
+            // Pop command
+            lua_pop(L, 1);
+        }
+
+        setU32(_records.data() + countOffset, n);
+    }
+    else
+        return luaL_error(L, "bad type for field '%s' (table expected, got %s)",
+                "task", luaL_typename(L, -1));
+
+    // Outputs (required)
+    lua_getfield(L, 1, "outputs");
+    if (lua_type(L, -1) == LUA_TTABLE)
+        binary_print_list(L, "outputs", _strings, _records);
+    else
+        return luaL_error(L, "bad type for field '%s' (table expected, got %s)",
+                "outputs", luaL_typename(L, -1));
+
+    // Working directory (optional)
+    lua_getfield(L, 1, "cwd");
+    binary_print_optional(L, "cwd", _strings, _records);
+
+    // Display (optional)
+    lua_getfield(L, 1, "display");
+    binary_print_optional(L, "display", _strings, _records);
+
+    setU32(_records.data() + start, (uint32_t)(_records.length() - start - 4));
+
+    _partial = 0;
+
+    ++_n;
+    return 0;
+}
+
+int Rules::add(lua_State* L, RuleTemplate& t, int index) {
+
+    profile::Span span(profile::rules);
+    profile::count(profile::rulesAdded);
+
+    // Check everything up front so that an error never leaves a rule half
+    // written.
+    size_t inLen, outLen;
+    const char* in = luaL_checklstring(L, index, &inLen);
+    const char* out = luaL_checklstring(L, index+1, &outLen);
+
+    const int deps = index+2;
+    const size_t depCount = check_string_list(L, deps, "inputs");
+
+    // Scratch space for expanding arguments.
+    std::string buf;
+
+    if (_format == RuleFormat::json) {
+        if (_n > 0)
+            _out.put(',');
+
+        _out.write("\n    {\n        \"inputs\": [");
+
+        _out.write(t._jsonInputs.data(), t._jsonInputs.size());
+        if (!t._inputs.empty())
+            _out.write(", ", 2);
+
+        json_print_string(in, inLen, _out);
+
+        for (size_t i = 1; i <= depCount; ++i) {
+            lua_rawgeti(L, deps, (lua_Integer)i);
+
+            size_t len;
+            const char* s = lua_tolstring(L, -1, &len);
+            _out.write(", ", 2);
+            json_print_string(s, len, _out);
+
+            lua_pop(L, 1);
+        }
+
+        _out.write("],\n        \"task\": [[");
+
+        _out.write(t._jsonCommand.data(), t._jsonCommand.size());
+
+        bool first = t._command.empty();
+
+        for (auto&& arg: t._args) {
+            if (!first)
+                _out.write(", ", 2);
+            first = false;
+
+            if (arg.substitute) {
+                expand(arg.text, in, inLen, out, outLen, buf);
+                json_print_string(buf.data(), buf.size(), _out);
+            }
+            else {
+                _out.write(arg.json.data(), arg.json.size());
+            }
+        }
+
+        _out.write("]],\n        \"outputs\": [");
+        json_print_string(out, outLen, _out);
+        _out.put(']');
+
+        if (t._hasCwd) {
+            _out.write(",\n        \"cwd\": ");
+            _out.write(t._jsonCwd.data(), t._jsonCwd.size());
+        }
+
+        if (t._hasDisplay) {
+            _out.write(",\n        \"display\": \"");
+            _out.write(t._jsonDisplay.data(), t._jsonDisplay.size());
+            json_print_chars(in, inLen, _out);
+            _out.put('"');
+        }
+
+        _out.write("\n    }");
+
+        ++_n;
+        return 0;
+    }
+
+    // Throw away the last rule if it was left incomplete.
+    if (_partial != 0) {
+        _records.truncate(_partial - 1);
+        _partial = 0;
+    }
+
+    const size_t start = _records.length();
+
+    // Record length. Filled in at the end.
+    putU32(_records, 0);
+
+    // Writes out the ID of a string shared by every rule of the template. It
+    // is interned along with the first rule, in the same order as rule{} would
+    // intern it, so that the string table comes out the same.
+    auto shared = [&](uint32_t& id, const std::string& s) {
+        if (!t._interned)
+            id = _strings.intern(s.data(), s.size());
+        putU32(_records, id);
+    };
+
+    // Inputs
+    putU32(_records, (uint32_t)(t._inputs.size() + 1 + depCount));
+
+    for (size_t i = 0; i < t._inputs.size(); ++i)
+        shared(t._inputIds[i], t._inputs[i]);
+
+    putU32(_records, _strings.intern(in, inLen));
+
+    for (size_t i = 1; i <= depCount; ++i) {
+        lua_rawgeti(L, deps, (lua_Integer)i);
+
+        size_t len;
+        const char* s = lua_tolstring(L, -1, &len);
+        putU32(_records, _strings.intern(s, len));
+
+        lua_pop(L, 1);
+    }
+
+    // Task. Always a single command.
+    putU32(_records, 1);
+    putU32(_records, (uint32_t)(t._command.size() + t._args.size()));
+
+    for (size_t i = 0; i < t._command.size(); ++i)
+        shared(t._commandIds[i], t._command[i]);
+
+    for (auto&& arg: t._args) {
+        if (arg.substitute) {
+            expand(arg.text, in, inLen, out, outLen, buf);
+            putU32(_records, _strings.intern(buf.data(), buf.size()));
+        }
+        else {
+            shared(arg.id, arg.text);
+        }
+    }
+
+    // Outputs
+    putU32(_records, 1);
+    putU32(_records, _strings.intern(out, outLen));
+
+    // Working directory
+    if (t._hasCwd)
+        shared(t._cwdId, t._cwd);
+    else
+        putU32(_records, 0xFFFFFFFF);
+
+    // Display
+    if (t._hasDisplay) {
+        buf.assign(t._display);
+        buf.append(in, inLen);
+        putU32(_records, _strings.intern(buf.data(), buf.size()));
+    }
+    else {
+        putU32(_records, 0xFFFFFFFF);
+    }
+
+    t._interned = true;
+
+    setU32(_records.data() + start, (uint32_t)(_records.length() - start - 4));
 
     ++_n;
     return 0;
@@ -9,30 +9,195 @@
 #pragma once
 
 #include <stdio.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "output.h"
+#include "stringtable.h"
 
 struct lua_State;
 
 namespace buttonlua {
 
+/**
+ * Output format for the rules.
+ *
+ * The binary format is laid out as follows. All integers are 32-bit
+ * little-endian.
+ *
+ *     "BTNR"          Magic bytes.
+ *     version         Format version. Currently 1.
+ *     string count    Number of strings in the string table.
+ *     strings         For each string, its length followed by its bytes.
+ *     rule count      Number of rules.
+ *     rules           For each rule, its length in bytes followed by:
+ *                       - inputs:  count, then that many string IDs.
+ *                       - task:    command count, then for each command an
+ *                                  argument count and that many string IDs.
+ *                       - outputs: count, then that many string IDs.
+ *                       - cwd:     string ID, or 0xFFFFFFFF if not given.
+ *                       - display: string ID, or 0xFFFFFFFF if not given.
+ *
+ * A string ID is the index of a string in the string table. Every distinct
+ * string is stored exactly once.
+ */
+enum class RuleFormat {
+    json,
+    binary,
+};
+
+class Rules;
+
+/**
+ * A template for many rules that share most of their inputs and command line.
+ * Only the parts that differ are given for each rule. This is typically used
+ * for compiling each source file of a target.
+ *
+ * A template is created from a table with these fields:
+ *
+ *     inputs  = Inputs shared by every rule (e.g., headers).
+ *     command = Start of the command line shared by every rule.
+ *     args    = Arguments to add after the command. Any "$in" or "$out" in an
+ *               argument is replaced by the rule's input or output.
+ *     display = Optional prefix for the display string. The input is appended
+ *               to it.
+ *     cwd     = Optional working directory.
+ *
+ * Each rule then has the inputs, followed by its own input and any extra
+ * dependencies, a single command, and its own output.
+ *
+ * For the JSON format, everything that is shared is encoded once up front. For
+ * the binary format, the shared strings are only added to the string table
+ * along with the first rule, in the same order that rule{} would add them.
+ * Either way, the output is the same as if each rule had been given to rule{}.
+ */
+class RuleTemplate
+{
+private:
+    friend class Rules;
+
+    Rules* _rules;
+
+    // Shared inputs and the start of the command line.
+    std::vector<std::string> _inputs;
+    std::vector<std::string> _command;
+
+    // The same, encoded as JSON strings separated by ", ".
+    std::string _jsonInputs;
+    std::string _jsonCommand;
+
+    struct Arg {
+        // Raw argument.
+        std::string text;
+
+        // Argument encoded as a JSON string.
+        std::string json;
+
+        // String ID for the binary format.
+        uint32_t id;
+
+        // True if the argument contains "$in" or "$out".
+        bool substitute;
+
+        Arg(const char* s, size_t len)
+            : text(s, len), id(0xFFFFFFFF), substitute(false) {}
+    };
+
+    std::vector<Arg> _args;
+
+    // String IDs for the binary format. These are only valid once the first
+    // rule has been added.
+    std::vector<uint32_t> _inputIds;
+    std::vector<uint32_t> _commandIds;
+    bool _interned;
+
+    bool _hasDisplay;
+    std::string _display;
+    std::string _jsonDisplay; // Escaped, without any quotes.
+
+    bool _hasCwd;
+    std::string _cwd;
+    std::string _jsonCwd;
+    uint32_t _cwdId;
+
+public:
+    RuleTemplate();
+
+    /**
+     * Sets up the template from the table at the given index of the stack.
+     * Raises a Lua error if the table is malformed.
+     */
+    int init(lua_State* L, int index, Rules& rules);
+
+    /**
+     * The rules this template was set up for.
+     */
+    Rules* rules() const {
+        return _rules;
+    }
+};
+
 class Rules
 {
 private:
-    // File handle to write to.
-    FILE* _f;
+    RuleFormat _format;
+
+    // Buffered output to the file.
+    OutputBuffer _out;
 
     // Number of rules.
     size_t _n;
 
+    // For the binary format, the string table and the encoded rules. These
+    // must be held until the end since the string table comes first.
+    StringTable _strings;
+    OutputBuffer _records;
+
+    // Start of a record that was not completed due to an error.
+    size_t _partial;
+
+    // True if this is a shard that is only kept in memory.
+    bool _shard;
+
 public:
-    Rules(FILE* f);
+    Rules(FILE* f, RuleFormat format = RuleFormat::json);
+
+    /**
+     * Creates a shard. Rules added to a shard are kept in memory until they
+     * are appended to other rules. This lets rules be generated on several
+     * threads at once and still be written out in a fixed order.
+     */
+    explicit Rules(RuleFormat format);
+
     ~Rules();
 
+    /**
+     * Appends the rules of a shard of the same format. The output is exactly
+     * the same as if the rules had been added here directly. The shard is left
+     * empty.
+     */
+    void append(Rules& shard);
+
     /**
      * Outputs a rule to the file.
      */
     int add(lua_State *L);
 
+    /**
+     * Outputs a rule based on a template. The rule's input, output, and
+     * optional table of extra dependencies start at the given index of the
+     * stack.
+     */
+    int add(lua_State* L, RuleTemplate& t, int index);
+
 private:
+    friend class RuleTemplate;
+
+    int addJSON(lua_State* L);
+    int addBinary(lua_State* L);
+
     int stringToJSON(lua_State* L, const char* field, size_t i);
     int listToJSON(lua_State* L, const char* field, size_t i);
 };
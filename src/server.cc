@@ -0,0 +1,697 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Running as a server that keeps its directory listings between runs.
+ *
+ * A request is a single message on a stream socket:
+ *
+ *     "BTLS"             Magic
+ *     u32                Version
+ *     u32                Flags (which dependency channels are passed along)
+ *     u32                Length of the rest
+ *     string             Working directory
+ *     u32, string...     Command line arguments
+ *     u32, string...     Environment variables, as "name=value"
+ *
+ * Strings are a u32 length followed by that many bytes. The client's standard
+ * output, standard error, and dependency channels (in that order, if the flags
+ * say so) are passed along with the first part of the message. The response
+ * is the exit code of the run as a u32 once it is completely done.
+ */
+#ifndef _WIN32
+#   include <errno.h>
+#   include <fcntl.h>
+#   include <signal.h>
+#   include <stdlib.h>
+#   include <sys/socket.h>
+#   include <sys/stat.h>
+#   include <sys/un.h>
+#   include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "server.h"
+#include "button-lua.h"
+#include "output.h"
+
+#ifndef _WIN32
+#   include "allocator.h"
+#   include "deps.h"
+#   include "dircache.h"
+#   include "dirwatch.h"
+
+extern char** environ;
+#endif
+
+namespace buttonlua {
+
+#ifdef _WIN32
+
+int serve(const char* socket) {
+    (void)socket;
+    fputs("Error: --serve is not supported on this platform\n", stderr);
+    return 1;
+}
+
+bool forward(const char* socket, int argc, char** argv, int& status) {
+    (void)socket; (void)argc; (void)argv; (void)status;
+    return false;
+}
+
+#else // _WIN32
+
+namespace {
+
+const char magic[4] = {'B', 'T', 'L', 'S'};
+const uint32_t version = 1;
+
+// Size of the fixed part of a request.
+const size_t headerSize = 16;
+
+enum Flags : uint32_t {
+    hasInputs  = 1 << 0,
+    hasOutputs = 1 << 1,
+};
+
+// Standard output, standard error, and both dependency channels.
+const size_t maxFds = 4;
+
+bool address(const char* path, struct sockaddr_un& addr) {
+    const size_t len = strlen(path);
+    if (len >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path '%s' is too long\n", path);
+        return false;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, len);
+    return true;
+}
+
+/**
+ * Keeps the file descriptor from being inherited by any process the run
+ * starts. Returns the file descriptor.
+ */
+int cloexec(int fd) {
+    if (fd >= 0)
+        fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+    return fd;
+}
+
+/**
+ * Creates a socket to listen or connect on.
+ */
+int newSocket() {
+    return cloexec(socket(AF_UNIX, SOCK_STREAM, 0));
+}
+
+/**
+ * Removes every environment variable.
+ */
+void clearEnv() {
+    // Unsetting them changes environ, so the names are copied out first.
+    std::vector<std::string> names;
+    for (char** e = environ; *e; ++e) {
+        const char* eq = strchr(*e, '=');
+        names.push_back(eq ? std::string(*e, (size_t)(eq - *e))
+                           : std::string(*e));
+    }
+
+    for (auto&& name: names)
+        unsetenv(name.c_str());
+}
+
+/**
+ * Returns the environment variables that setting up a Lua state depends on.
+ * These are where package.path and package.cpath come from.
+ */
+std::string luaEnv() {
+    std::vector<std::string> vars;
+    for (char** e = environ; *e; ++e) {
+        if (strncmp(*e, "LUA_", 4) == 0)
+            vars.push_back(*e);
+    }
+
+    std::sort(vars.begin(), vars.end());
+
+    std::string s;
+    for (auto&& var: vars) {
+        s.append(var);
+        s.push_back('\0');
+    }
+
+    return s;
+}
+
+bool writeAll(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        const ssize_t n = ::write(fd, data, length);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+
+        data += n;
+        length -= (size_t)n;
+    }
+
+    return true;
+}
+
+bool readAll(int fd, char* data, size_t length) {
+    while (length > 0) {
+        const ssize_t n = ::read(fd, data, length);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+
+        if (n == 0)
+            return false;
+
+        data += n;
+        length -= (size_t)n;
+    }
+
+    return true;
+}
+
+/**
+ * Returns the file descriptor of a dependency channel, if the parent build
+ * system gave us one.
+ */
+int channel(const char* var) {
+    const char* value = getenv(var);
+    return value ? atoi(value) : 0;
+}
+
+void putString(OutputBuffer& out, const char* s, size_t length) {
+    putU32(out, (uint32_t)length);
+    out.write(s, length);
+}
+
+/**
+ * Reads strings out of a request.
+ */
+class Reader {
+private:
+    const char* _data;
+    size_t _length;
+    size_t _pos;
+    bool _ok;
+
+public:
+    Reader(const char* data, size_t length)
+        : _data(data), _length(length), _pos(0), _ok(true) {}
+
+    bool ok() const {
+        return _ok;
+    }
+
+    uint32_t u32() {
+        if (!_ok || _length - _pos < 4) {
+            _ok = false;
+            return 0;
+        }
+
+        const uint32_t x = getU32(_data + _pos);
+        _pos += 4;
+        return x;
+    }
+
+    std::string string() {
+        const uint32_t n = u32();
+        if (!_ok || _length - _pos < n) {
+            _ok = false;
+            return std::string();
+        }
+
+        std::string s(_data + _pos, n);
+        _pos += n;
+        return s;
+    }
+};
+
+/**
+ * A request from a client.
+ */
+struct Request {
+    int out, err, inputs, outputs;
+
+    std::string cwd;
+    std::vector<std::string> args;
+    std::vector<std::string> env;
+
+    Request() : out(-1), err(-1), inputs(-1), outputs(-1) {}
+
+    ~Request() {
+        for (int fd: {out, err, inputs, outputs})
+            if (fd >= 0) close(fd);
+    }
+};
+
+/**
+ * Returns true if the other end of the connection is run by the same user as
+ * the server. Anyone else could otherwise run scripts as this user.
+ */
+bool trusted(int sock) {
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+        return false;
+
+    return cred.uid == geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(sock, &uid, &gid) != 0)
+        return false;
+
+    return uid == geteuid();
+#endif
+}
+
+/**
+ * Receives a request along with the file descriptors that come with it.
+ */
+bool receive(int sock, Request& req) {
+    if (!trusted(sock))
+        return false;
+
+    char header[headerSize];
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * maxFds)];
+    } control;
+
+    struct iovec iov = {header, sizeof(header)};
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0)
+        return false;
+
+    int fds[maxFds];
+    size_t fdCount = 0;
+
+    for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        const size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; ++i) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+
+            if (fdCount < maxFds)
+                fds[fdCount++] = cloexec(fd);
+            else
+                close(fd);
+        }
+    }
+
+    // Hand them over first so that they get closed no matter what.
+    int* slots[maxFds] = {&req.out, &req.err, &req.inputs, &req.outputs};
+    for (size_t i = 0; i < fdCount; ++i)
+        *slots[i] = fds[i];
+
+    if (!readAll(sock, header + n, sizeof(header) - (size_t)n))
+        return false;
+
+    if (memcmp(header, magic, sizeof(magic)) != 0 ||
+            getU32(header + 4) != version)
+        return false;
+
+    const uint32_t flags = getU32(header + 8);
+
+    const size_t expected = 2 + ((flags & hasInputs) ? 1 : 0) +
+                                ((flags & hasOutputs) ? 1 : 0);
+    if (fdCount != expected)
+        return false;
+
+    // The channels that weren't passed along are the last ones.
+    if (!(flags & hasInputs)) {
+        req.outputs = req.inputs;
+        req.inputs = -1;
+    }
+
+    std::vector<char> body(getU32(header + 12));
+    if (!readAll(sock, body.data(), body.size()))
+        return false;
+
+    Reader r(body.data(), body.size());
+
+    req.cwd = r.string();
+
+    for (uint32_t i = 0, count = r.u32(); r.ok() && i < count; ++i)
+        req.args.push_back(r.string());
+
+    for (uint32_t i = 0, count = r.u32(); r.ok() && i < count; ++i)
+        req.env.push_back(r.string());
+
+    return r.ok() && !req.args.empty();
+}
+
+/**
+ * Everything the server keeps between runs.
+ */
+class Server {
+private:
+    // Working directory of the last run. Listings of relative paths are only
+    // good for the same one.
+    std::string _cwd;
+
+    std::unique_ptr<DirWatcher> _watcher;
+    std::unique_ptr<DirCache> _dirCache;
+
+    // Lua state for the next run.
+    std::unique_ptr<LuaAllocator> _allocator;
+    lua_State* _L;
+
+    // The Lua variables from the environment that the state was set up with.
+    std::string _luaEnv;
+
+public:
+    Server() : _L(NULL) {}
+
+    ~Server() {
+        if (_L) lua_close(_L);
+    }
+
+    /**
+     * Initializes a Lua state for the next run, if there isn't one already.
+     */
+    void prepare() {
+        if (_L) return;
+
+        _allocator.reset(new LuaAllocator());
+        _L = new_state(*_allocator);
+        _luaEnv = luaEnv();
+
+        if (_L && init(_L) != 0) {
+            lua_close(_L);
+            _L = NULL;
+        }
+    }
+
+    /**
+     * Does a run and returns its exit code.
+     */
+    int run(Request& req);
+
+private:
+    void startRun(ImplicitDeps* deps);
+};
+
+void Server::startRun(ImplicitDeps* deps) {
+    if (_dirCache && _dirCache->refresh(deps))
+        return;
+
+    // Start over. The watcher goes too since it may have lost track.
+    _dirCache.reset();
+    _watcher.reset(new DirWatcher());
+    _dirCache.reset(new DirCache(deps));
+    _dirCache->watch(_watcher.get());
+    _dirCache->refresh(deps);
+}
+
+int Server::run(Request& req) {
+    if (chdir(req.cwd.c_str()) != 0) {
+        dprintf(req.err, "Error: Failed to change to directory '%s': %s\n",
+                req.cwd.c_str(), strerror(errno));
+        return 1;
+    }
+
+    if (req.cwd != _cwd) {
+        _dirCache.reset();
+        _cwd = req.cwd;
+    }
+
+    clearEnv();
+    for (auto&& var: req.env) {
+        const size_t eq = var.find('=');
+        if (eq != std::string::npos && eq > 0)
+            setenv(var.substr(0, eq).c_str(), var.c_str() + eq + 1, 1);
+    }
+
+    // The state was set up ahead of time with the server's environment. It
+    // can't be used if the client would have gotten a different package.path
+    // or package.cpath.
+    if (_L && luaEnv() != _luaEnv) {
+        lua_close(_L);
+        _L = NULL;
+        prepare();
+    }
+
+    // Everything the run prints goes to the client.
+    fflush(stdout);
+    fflush(stderr);
+
+    const int savedOut = dup(STDOUT_FILENO);
+    const int savedErr = dup(STDERR_FILENO);
+
+    dup2(req.out, STDOUT_FILENO);
+    dup2(req.err, STDERR_FILENO);
+
+    int status;
+
+    {
+        // Dependencies must all be sent before the client is told the run is
+        // done.
+        ImplicitDeps deps(req.inputs, req.outputs);
+        req.inputs = req.outputs = -1;
+
+        startRun(&deps);
+
+        std::vector<char*> argv;
+        for (auto&& arg: req.args)
+            argv.push_back(&arg[0]);
+        argv.push_back(NULL);
+
+        Warm warm = {_dirCache.get(), &deps, _L, _allocator.get()};
+        status = execute((int)req.args.size(), argv.data(), &warm);
+        _L = warm.L;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+
+    dup2(savedOut, STDOUT_FILENO);
+    dup2(savedErr, STDERR_FILENO);
+    close(savedOut);
+    close(savedErr);
+
+    return status;
+}
+
+}
+
+int serve(const char* socketPath) {
+    struct sockaddr_un addr;
+    if (!address(socketPath, addr))
+        return 1;
+
+    // A client that goes away must not take the server with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    const int sock = newSocket();
+    if (sock < 0) {
+        perror("Failed to create socket");
+        return 1;
+    }
+
+    // A socket left behind by an earlier server is in the way, but one that
+    // a server is still listening on must be left alone.
+    struct stat st;
+    if (lstat(socketPath, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        const int probe = newSocket();
+        const bool live = probe >= 0 &&
+            connect(probe, (const struct sockaddr*)&addr, sizeof(addr)) == 0;
+        const bool stale = !live && errno == ECONNREFUSED;
+
+        if (probe >= 0)
+            close(probe);
+
+        if (live) {
+            fprintf(stderr, "Error: A server is already listening on '%s'\n",
+                    socketPath);
+            close(sock);
+            return 1;
+        }
+
+        if (stale)
+            unlink(socketPath);
+    }
+
+    // Only this user may connect.
+    const mode_t mask = umask(077);
+    const bool bound =
+        bind(sock, (const struct sockaddr*)&addr, sizeof(addr)) == 0;
+    umask(mask);
+
+    if (!bound || listen(sock, 16) != 0) {
+        fprintf(stderr, "Error: Failed to listen on '%s': %s\n", socketPath,
+                strerror(errno));
+        close(sock);
+        return 1;
+    }
+
+    Server server;
+
+    while (true) {
+        server.prepare();
+
+        const int client = cloexec(accept(sock, NULL, NULL));
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            perror("Failed to accept connection");
+            break;
+        }
+
+        Request req;
+        if (receive(client, req)) {
+            char response[4];
+            setU32(response, (uint32_t)server.run(req));
+            writeAll(client, response, sizeof(response));
+        }
+
+        close(client);
+    }
+
+    close(sock);
+    return 1;
+}
+
+bool forward(const char* socketPath, int argc, char** argv, int& status) {
+    struct sockaddr_un addr;
+    if (!address(socketPath, addr))
+        return false;
+
+    const int sock = newSocket();
+    if (sock < 0)
+        return false;
+
+    if (connect(sock, (const struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return false;
+    }
+
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        close(sock);
+        return false;
+    }
+
+    int fds[maxFds] = {STDOUT_FILENO, STDERR_FILENO};
+    size_t fdCount = 2;
+
+    uint32_t flags = 0;
+
+    if (const int fd = channel("BUTTON_INPUTS")) {
+        fds[fdCount++] = fd;
+        flags |= hasInputs;
+    }
+
+    if (const int fd = channel("BUTTON_OUTPUTS")) {
+        fds[fdCount++] = fd;
+        flags |= hasOutputs;
+    }
+
+    OutputBuffer body(NULL, 64 * 1024);
+    putString(body, cwd, strlen(cwd));
+
+    putU32(body, (uint32_t)argc);
+    for (int i = 0; i < argc; ++i)
+        putString(body, argv[i], strlen(argv[i]));
+
+    size_t envCount = 0;
+    for (char** e = environ; *e; ++e)
+        ++envCount;
+
+    putU32(body, (uint32_t)envCount);
+    for (char** e = environ; *e; ++e)
+        putString(body, *e, strlen(*e));
+
+    char header[headerSize];
+    memcpy(header, magic, sizeof(magic));
+    setU32(header + 4, version);
+    setU32(header + 8, flags);
+    setU32(header + 12, (uint32_t)body.length());
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * maxFds)];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct iovec iov = {header, sizeof(header)};
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fdCount);
+
+    struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int) * fdCount);
+    memcpy(CMSG_DATA(c), fds, sizeof(int) * fdCount);
+
+    ssize_t n;
+    do {
+        n = sendmsg(sock, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+
+    // Nothing has been sent, so the run can still be done here instead.
+    if (n <= 0) {
+        close(sock);
+        return false;
+    }
+
+    char response[4];
+
+    if (!writeAll(sock, header + n, sizeof(header) - (size_t)n) ||
+            !writeAll(sock, body.data(), body.length()) ||
+            !readAll(sock, response, sizeof(response))) {
+        fprintf(stderr, "Error: Lost connection to server '%s'\n",
+                socketPath);
+        status = 1;
+    }
+    else {
+        status = (int)getU32(response);
+    }
+
+    close(sock);
+    return true;
+}
+
+#endif // !_WIN32
+
+}
@@ -0,0 +1,48 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Running as a server that keeps its directory listings between runs.
+ */
+#pragma once
+
+namespace buttonlua {
+
+/**
+ * Serves runs on a local socket until killed.
+ *
+ * Starting a new process for every run means listing the whole tree again
+ * every time. The server instead keeps its directory listings and watches the
+ * directories for changes (with inotify on Linux), so that a run only lists
+ * what has changed since the last one. A Lua state is also initialized ahead
+ * of time for the next run.
+ *
+ * Each run still starts with a fresh Lua state since scripts and modules keep
+ * their own state. Runs are done one at a time, in the working directory and
+ * with the environment of the client. The client's standard output, standard
+ * error, and dependency channels are passed along to the server, which writes
+ * to them directly. To the parent build system, it is as if the client did the
+ * run itself.
+ *
+ * Where directories can't be watched, every listing is thrown away between
+ * runs, which still saves starting up.
+ *
+ * Since runs are done as the user running the server, the socket can only be
+ * connected to by that user, and connections from anyone else are dropped. A
+ * socket left behind by a server that is gone is replaced, but not one that a
+ * server is still listening on.
+ *
+ * Returns the exit code if the server fails to start.
+ */
+int serve(const char* socket);
+
+/**
+ * Asks the server on the given socket to do the run with the given command
+ * line. Returns false if there is no server, so that the caller can do the
+ * run itself. Otherwise, sets the exit code of the run.
+ */
+bool forward(const char* socket, int argc, char** argv, int& status);
+
+}
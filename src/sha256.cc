@@ -0,0 +1,151 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * SHA-256 checksums.
+ */
+#include "sha256.h"
+
+#include <string.h>
+
+namespace {
+
+const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+inline uint32_t rotr(uint32_t x, unsigned n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+inline uint32_t loadBE(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8)  |  (uint32_t)p[3];
+}
+
+inline void storeBE(uint8_t* p, uint32_t x) {
+    p[0] = (uint8_t)(x >> 24);
+    p[1] = (uint8_t)(x >> 16);
+    p[2] = (uint8_t)(x >> 8);
+    p[3] = (uint8_t)x;
+}
+
+}
+
+Sha256::Sha256() : _length(0), _blockLength(0) {
+    _state[0] = 0x6a09e667;
+    _state[1] = 0xbb67ae85;
+    _state[2] = 0x3c6ef372;
+    _state[3] = 0xa54ff53a;
+    _state[4] = 0x510e527f;
+    _state[5] = 0x9b05688c;
+    _state[6] = 0x1f83d9ab;
+    _state[7] = 0x5be0cd19;
+}
+
+void Sha256::transform(const uint8_t block[64]) {
+    uint32_t w[64];
+
+    for (size_t i = 0; i < 16; ++i)
+        w[i] = loadBE(block + i*4);
+
+    for (size_t i = 16; i < 64; ++i) {
+        const uint32_t s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+        const uint32_t s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+    uint32_t a = _state[0], b = _state[1], c = _state[2], d = _state[3];
+    uint32_t e = _state[4], f = _state[5], g = _state[6], h = _state[7];
+
+    for (size_t i = 0; i < 64; ++i) {
+        const uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+        const uint32_t ch = (e & f) ^ (~e & g);
+        const uint32_t t1 = h + s1 + ch + k[i] + w[i];
+        const uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+        const uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        const uint32_t t2 = s0 + maj;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    _state[0] += a; _state[1] += b; _state[2] += c; _state[3] += d;
+    _state[4] += e; _state[5] += f; _state[6] += g; _state[7] += h;
+}
+
+void Sha256::update(const void* data, size_t length) {
+    const uint8_t* p = (const uint8_t*)data;
+
+    _length += length;
+
+    // Fill up the partial block first.
+    if (_blockLength > 0) {
+        const size_t n = length < 64 - _blockLength ? length : 64 - _blockLength;
+        memcpy(_block + _blockLength, p, n);
+        _blockLength += n;
+        p += n;
+        length -= n;
+
+        if (_blockLength < 64)
+            return;
+
+        transform(_block);
+        _blockLength = 0;
+    }
+
+    // Whole blocks can be transformed in place.
+    for (; length >= 64; p += 64, length -= 64)
+        transform(p);
+
+    memcpy(_block, p, length);
+    _blockLength = length;
+}
+
+void Sha256::finish(uint8_t digest[digestLength]) {
+    const uint64_t bits = _length * 8;
+
+    // Pad with a 1 bit, then zeros, up to the last 8 bytes of a block.
+    _block[_blockLength++] = 0x80;
+
+    if (_blockLength > 56) {
+        memset(_block + _blockLength, 0, 64 - _blockLength);
+        transform(_block);
+        _blockLength = 0;
+    }
+
+    memset(_block + _blockLength, 0, 56 - _blockLength);
+
+    // The length goes at the end in bits.
+    storeBE(_block + 56, (uint32_t)(bits >> 32));
+    storeBE(_block + 60, (uint32_t)bits);
+    transform(_block);
+
+    for (size_t i = 0; i < 8; ++i)
+        storeBE(digest + i*4, _state[i]);
+}
+
+void Sha256::hash(const void* data, size_t length,
+        uint8_t digest[digestLength]) {
+    Sha256 h;
+    h.update(data, length);
+    h.finish(digest);
+}
@@ -0,0 +1,51 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * SHA-256 checksums.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Incrementally computes a SHA-256 checksum.
+ */
+class Sha256 {
+public:
+    static const size_t digestLength = 32;
+
+    Sha256();
+
+    /**
+     * Adds more data to the checksum.
+     */
+    void update(const void* data, size_t length);
+
+    /**
+     * Finishes the checksum and stores it in the given buffer. Nothing can be
+     * added afterwards.
+     */
+    void finish(uint8_t digest[digestLength]);
+
+    /**
+     * Convenience function to compute the checksum of a single block of data.
+     */
+    static void hash(const void* data, size_t length,
+            uint8_t digest[digestLength]);
+
+private:
+    void transform(const uint8_t block[64]);
+
+    uint32_t _state[8];
+
+    // Total number of bytes added so far.
+    uint64_t _length;
+
+    // Partial block that hasn't been transformed yet.
+    uint8_t _block[64];
+    size_t _blockLength;
+};
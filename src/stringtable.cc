@@ -0,0 +1,78 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Interned string table.
+ */
+#include "stringtable.h"
+
+#include <string.h>
+
+namespace {
+
+/**
+ * FNV-1a hash.
+ */
+uint32_t hashString(const char* s, size_t length) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < length; ++i) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+}
+
+StringTable::StringTable() : _data(NULL, 1 << 16), _slots(1024, 0) {
+}
+
+size_t StringTable::length(uint32_t id) const {
+    return getU32(_data.data() + _offsets[id] - 4);
+}
+
+uint32_t StringTable::intern(const char* s, size_t length) {
+    const uint32_t h = hashString(s, length);
+    const size_t mask = _slots.size() - 1;
+
+    size_t i = h & mask;
+    while (uint32_t slot = _slots[i]) {
+        const uint32_t id = slot - 1;
+        if (_hashes[id] == h && this->length(id) == length &&
+                memcmp(str(id), s, length) == 0)
+            return id;
+
+        i = (i + 1) & mask;
+    }
+
+    const uint32_t id = (uint32_t)_offsets.size();
+
+    putU32(_data, (uint32_t)length);
+    _offsets.push_back(_data.length());
+    _data.write(s, length);
+    _hashes.push_back(h);
+
+    _slots[i] = id + 1;
+
+    // Keep the load factor below 1/2.
+    if (_offsets.size() * 2 > _slots.size())
+        grow();
+
+    return id;
+}
+
+void StringTable::grow() {
+    std::vector<uint32_t> slots(_slots.size() * 2, 0);
+    const size_t mask = slots.size() - 1;
+
+    for (uint32_t id = 0; id < _hashes.size(); ++id) {
+        size_t i = _hashes[id] & mask;
+        while (slots[i])
+            i = (i + 1) & mask;
+        slots[i] = id + 1;
+    }
+
+    _slots.swap(slots);
+}
@@ -0,0 +1,73 @@
+/**
+ * Copyright (c) Jason White
+ *
+ * MIT License
+ *
+ * Description:
+ * Interned string table.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "output.h"
+
+/**
+ * Assigns a unique, sequential ID to every distinct string added to it.
+ *
+ * The strings are stored back-to-back in the order they were first added, each
+ * one preceded by its 32-bit little-endian length. Thus, the table can be
+ * written out as-is.
+ */
+class StringTable
+{
+private:
+    // Encoded strings.
+    OutputBuffer _data;
+
+    // Offset of each string (past its length prefix) in the data buffer.
+    std::vector<size_t> _offsets;
+
+    // Hash of each string.
+    std::vector<uint32_t> _hashes;
+
+    // Open addressing hash index. Each slot holds ID+1 or 0 if empty.
+    std::vector<uint32_t> _slots;
+
+public:
+    StringTable();
+
+    /**
+     * Returns the ID of the given string, adding it to the table if it isn't
+     * there yet.
+     */
+    uint32_t intern(const char* s, size_t length);
+
+    /**
+     * Returns the string with the given ID.
+     */
+    const char* str(uint32_t id) const {
+        return _data.data() + _offsets[id];
+    }
+
+    size_t length(uint32_t id) const;
+
+    /**
+     * Number of strings in the table.
+     */
+    size_t size() const {
+        return _offsets.size();
+    }
+
+    /**
+     * The encoded strings.
+     */
+    const OutputBuffer& data() const {
+        return _data;
+    }
+
+private:
+    void grow();
+};
@@ -23,78 +23,201 @@
 
 #include <algorithm>
 
+namespace {
+
+// The pool and worker index of the current thread, if any.
+thread_local const ThreadPool* currentPool = nullptr;
+thread_local size_t currentIndex = 0;
+
+}
+
 ThreadPool::ThreadPool(size_t threads) :
-    _threads(std::max((size_t)1, threads)), _tasksLeft(0), _stop(false)
+    _queued(0), _tasksLeft(0), _next(0), _stop(false), _sleeping(0),
+    _waiting(0)
 {
-    // Initialize worker threads.
-    for (auto& t: _threads)
-        t = std::thread([this] { worker(); });
+    threads = std::max((size_t)1, threads);
+
+    for (size_t i = 0; i < threads; ++i)
+        _workers.emplace_back(new Worker());
+
+    // Initialize worker threads. This must happen after all the queues exist
+    // since workers steal from each other.
+    for (size_t i = 0; i < threads; ++i)
+        _workers[i]->thread = std::thread([this, i] { worker(i); });
 }
 
 ThreadPool::~ThreadPool() {
-    _stop = true;
+    {
+        std::lock_guard<std::mutex> lock(_sleepMutex);
+        _stop = true;
+    }
 
     // Wake up all threads waiting for a new task.
-    _taskAvailableCond.notify_all();
+    _sleepCond.notify_all();
 
-    for (auto& x : _threads) {
-        if (x.joinable())
-            x.join();
+    for (auto& w : _workers) {
+        if (w->thread.joinable())
+            w->thread.join();
     }
 }
 
-void ThreadPool::enqueueTask(std::function<void()> task) {
+size_t ThreadPool::currentWorker() const {
+    return currentPool == this ? currentIndex : _workers.size();
+}
+
+void ThreadPool::push(Task&& task) {
+    size_t i = currentWorker();
+    if (i == _workers.size())
+        i = _next.fetch_add(1, std::memory_order_relaxed) % _workers.size();
+
+    ++_tasksLeft;
+
     {
-        std::lock_guard<std::mutex> lock(_queueMutex);
-        _queue.emplace(task);
+        Worker& w = *_workers[i];
+        std::lock_guard<std::mutex> lock(w.mutex);
+        w.queue.push_back(std::move(task));
     }
 
-    {
-        std::lock_guard<std::mutex> lock(_tasksLeftMutex);
-        ++_tasksLeft;
+    profile::sample(profile::queueDepth, ++_queued);
+
+    // Only bother with the lock if someone might be asleep.
+    if (_sleeping > 0) {
+        std::lock_guard<std::mutex> lock(_sleepMutex);
+        _sleepCond.notify_one();
+    }
+}
+
+bool ThreadPool::pop(size_t index, Task& task) {
+    Worker& w = *_workers[index];
+    std::lock_guard<std::mutex> lock(w.mutex);
+
+    if (w.queue.empty())
+        return false;
+
+    task = std::move(w.queue.back());
+    w.queue.pop_back();
+    --_queued;
+    return true;
+}
+
+bool ThreadPool::steal(size_t thief, Task& task) {
+    if (_queued == 0)
+        return false;
+
+    const size_t n = _workers.size();
+
+    for (size_t i = 1; i <= n; ++i) {
+        Worker& w = *_workers[(thief + i) % n];
+
+        std::lock_guard<std::mutex> lock(w.mutex);
+        if (w.queue.empty())
+            continue;
+
+        task = std::move(w.queue.front());
+        w.queue.pop_front();
+        --_queued;
+        return true;
     }
 
-    _taskAvailableCond.notify_one();
+    return false;
+}
+
+void ThreadPool::run(Task& task) {
+    task();
+    task = Task();
+
+    if (--_tasksLeft == 0 && _waiting > 0) {
+        std::lock_guard<std::mutex> lock(_waitMutex);
+        _waitCond.notify_all();
+    }
 }
 
 void ThreadPool::waitAll() {
-    std::unique_lock<std::mutex> lock(_tasksLeftMutex);
-    if (_tasksLeft > 0) {
-        _waitCond.wait(lock, [this] {
-                return _tasksLeft == 0;
-                });
+    if (_tasksLeft == 0)
+        return;
+
+    std::unique_lock<std::mutex> lock(_waitMutex);
+    ++_waiting;
+    _waitCond.wait(lock, [this] {
+            return _tasksLeft == 0;
+            });
+    --_waiting;
+}
+
+bool ThreadPool::runPendingTask() {
+    const size_t i = currentWorker();
+
+    Task task;
+
+    if (i < _workers.size()) {
+        if (!pop(i, task) && !steal(i, task))
+            return false;
     }
+    else if (!steal(_next.fetch_add(1, std::memory_order_relaxed), task)) {
+        return false;
+    }
+
+    run(task);
+    return true;
 }
 
-void ThreadPool::worker() {
+void ThreadPool::worker(size_t index) {
+    currentPool = this;
+    currentIndex = index;
+
+    Task task;
+
     while (true)
     {
-        std::function<void()> task;
-
-        {
-            std::unique_lock<std::mutex> lock(_queueMutex);
+        if (pop(index, task) || steal(index, task)) {
+            run(task);
+            continue;
+        }
 
-            if (_stop) return;
+        std::unique_lock<std::mutex> lock(_sleepMutex);
 
-            // Wait for a task if we don't have any.
-            _taskAvailableCond.wait(lock, [this] {
-                    return _queue.size() > 0 || _stop;
-                    });
+        if (_stop) return;
 
-            if (_stop) return;
+        // Wait for a task if we don't have any.
+        ++_sleeping;
+        _sleepCond.wait(lock, [this] {
+                return _queued > 0 || _stop;
+                });
+        --_sleeping;
 
-            // Get task from the queue
-            task = std::move(_queue.front());
-            _queue.pop();
-        }
+        if (_stop) return;
+    }
+}
 
-        task();
+void TaskGroup::done() {
+    // Only the transition to 0 needs the lock. It must not be possible for the
+    // waiting thread to wake up and destroy the group while this is still
+    // being used.
+    size_t n = _pending.load(std::memory_order_relaxed);
+    while (n > 1) {
+        if (_pending.compare_exchange_weak(n, n - 1))
+            return;
+    }
 
-        {
-            std::lock_guard<std::mutex> lock(_tasksLeftMutex);
-            --_tasksLeft;
-        }
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (--_pending == 0)
+        _cond.notify_all();
+}
 
-        _waitCond.notify_one();
+void TaskGroup::wait() {
+    while (_pending > 0) {
+        // Help out instead of sleeping.
+        if (_pool.runPendingTask())
+            continue;
+
+        // Nothing to do for now. Wait for the group to finish, but check back
+        // now and then in case more tasks have been queued.
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cond.wait_for(lock, std::chrono::milliseconds(1), [this] {
+                return _pending == 0;
+                });
     }
+
+    // Synchronize with the final call to done().
+    std::lock_guard<std::mutex> lock(_mutex);
 }
@@ -28,12 +28,146 @@
 #include <condition_variable>
 
 #include <functional>
+#include <type_traits>
+#include <utility>
+#include <new>
 
 #include <vector>
-#include <queue>
+#include <deque>
+#include <memory>
+
+#include "profile.h"
+
+/**
+ * A move-only, type-erased task. Small closures are stored inline so that
+ * queuing them doesn't require a heap allocation.
+ */
+class Task {
+public:
+    // Closures up to this size are stored inline.
+    static const size_t inlineSize = 64;
+
+    Task() : _ops(nullptr) {}
+
+    template<class F, class = typename std::enable_if<
+        !std::is_same<typename std::decay<F>::type, Task>::value>::type>
+    Task(F&& f) : _ops(nullptr) {
+        typedef typename std::decay<F>::type Fn;
+        construct<Fn>(std::forward<F>(f), std::integral_constant<bool,
+                sizeof(Fn) <= inlineSize &&
+                alignof(Fn) <= alignof(Storage) &&
+                std::is_nothrow_move_constructible<Fn>::value>());
+    }
+
+    Task(Task&& rhs) noexcept : _ops(rhs._ops) {
+        if (_ops) {
+            _ops->move(&_storage, &rhs._storage);
+            rhs._ops = nullptr;
+        }
+    }
+
+    Task& operator=(Task&& rhs) noexcept {
+        if (this != &rhs) {
+            reset();
+            if (rhs._ops) {
+                rhs._ops->move(&_storage, &rhs._storage);
+                _ops = rhs._ops;
+                rhs._ops = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() {
+        reset();
+    }
+
+    explicit operator bool() const {
+        return _ops != nullptr;
+    }
+
+    void operator()() {
+        _ops->invoke(&_storage);
+    }
+
+private:
+    typedef std::aligned_storage<inlineSize>::type Storage;
+
+    struct Ops {
+        void (*invoke)(void*);
+        void (*move)(void* dst, void* src);
+        void (*destroy)(void*);
+    };
+
+    // Operations for closures stored inline.
+    template<class Fn>
+    struct InlineOps {
+        static void invoke(void* p) { (*(Fn*)p)(); }
+        static void move(void* dst, void* src) {
+            new (dst) Fn(std::move(*(Fn*)src));
+            ((Fn*)src)->~Fn();
+        }
+        static void destroy(void* p) { ((Fn*)p)->~Fn(); }
+        static const Ops ops;
+    };
+
+    // Operations for closures that are too big and are stored on the heap.
+    template<class Fn>
+    struct HeapOps {
+        static void invoke(void* p) { (**(Fn**)p)(); }
+        static void move(void* dst, void* src) { *(Fn**)dst = *(Fn**)src; }
+        static void destroy(void* p) { delete *(Fn**)p; }
+        static const Ops ops;
+    };
+
+    template<class Fn, class F>
+    void construct(F&& f, std::true_type) {
+        new (&_storage) Fn(std::forward<F>(f));
+        _ops = &InlineOps<Fn>::ops;
+    }
+
+    template<class Fn, class F>
+    void construct(F&& f, std::false_type) {
+        *(Fn**)&_storage = new Fn(std::forward<F>(f));
+        _ops = &HeapOps<Fn>::ops;
+    }
+
+    void reset() {
+        if (_ops) {
+            _ops->destroy(&_storage);
+            _ops = nullptr;
+        }
+    }
+
+    Storage _storage;
+    const Ops* _ops;
+};
+
+template<class Fn>
+const Task::Ops Task::InlineOps<Fn>::ops = {
+    &Task::InlineOps<Fn>::invoke,
+    &Task::InlineOps<Fn>::move,
+    &Task::InlineOps<Fn>::destroy,
+};
+
+template<class Fn>
+const Task::Ops Task::HeapOps<Fn>::ops = {
+    &Task::HeapOps<Fn>::invoke,
+    &Task::HeapOps<Fn>::move,
+    &Task::HeapOps<Fn>::destroy,
+};
 
 /**
- * A thread pool.
+ * A work-stealing thread pool.
+ *
+ * Each worker thread has its own double-ended queue of tasks. Tasks queued from
+ * within a worker go onto that worker's queue and are taken off the back (most
+ * recent first). When a worker runs out of tasks, it steals from the front of
+ * another worker's queue. Tasks queued from outside of the pool are spread
+ * across the workers.
  */
 class ThreadPool {
 public:
@@ -53,13 +187,22 @@ public:
     ~ThreadPool();
 
     /**
-     * Adds a new task to the end of the queue.
+     * Adds a new task to the queue.
      */
-    void enqueueTask(std::function<void()> task);
+    template<class F>
+    void enqueueTask(F&& f) {
+        if (profile::enabled()) {
+            typedef typename std::decay<F>::type Fn;
+            push(Task(profile::TimedTask<Fn>(std::forward<F>(f))));
+        }
+        else {
+            push(Task(std::forward<F>(f)));
+        }
+    }
 
     /**
-     * Wraps a task in a future and adds it to the end of the queue. This is
-     * useful if you care about the result (but it has more overhead).
+     * Wraps a task in a future and adds it to the queue. This is useful if you
+     * care about the result (but it has more overhead).
      */
     template<class F, class... Args>
     std::future<typename std::result_of<F(Args...)>::type>
@@ -83,20 +226,158 @@ public:
      */
     void waitAll();
 
+    /**
+     * Takes a queued task, if there is one, and runs it on the calling thread.
+     * Returns true if a task was run. This lets threads that are waiting on
+     * something help out instead of sleeping.
+     */
+    bool runPendingTask();
+
+    /**
+     * Returns the number of worker threads.
+     */
+    size_t size() const {
+        return _workers.size();
+    }
+
+    /**
+     * Returns roughly how many tasks are waiting to run.
+     */
+    size_t queued() const {
+        return _queued.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Returns the index of the calling worker thread in this pool. If the
+     * calling thread does not belong to this pool, returns `size()`.
+     */
+    size_t currentWorker() const;
+
 private:
+    struct Worker {
+        std::thread thread;
+
+        // Protects the queue. The owner and thieves rarely contend for it.
+        std::mutex mutex;
+        std::deque<Task> queue;
+    };
+
     /**
-     * Takes the next task in the queue and runs it. Notify the main thread that a
-     * task has completed. This is the main loop for each thread.
+     * Adds a task to the current worker's queue or, if called from outside of
+     * the pool, to some worker's queue.
      */
-    void worker();
+    void push(Task&& task);
 
-    std::vector<std::thread> _threads;
-    std::queue<std::function<void()>> _queue;
+    /**
+     * Takes a task from the back of the given worker's queue.
+     */
+    bool pop(size_t worker, Task& task);
+
+    /**
+     * Takes a task from the front of some other worker's queue.
+     */
+    bool steal(size_t thief, Task& task);
+
+    /**
+     * Runs a task and marks it as done.
+     */
+    void run(Task& task);
+
+    /**
+     * Main loop for each thread. Runs tasks until the pool is destroyed.
+     */
+    void worker(size_t index);
+
+    std::vector<std::unique_ptr<Worker>> _workers;
+
+    // Number of tasks sitting in queues.
+    std::atomic<size_t> _queued;
+
+    // Number of tasks that have been queued but have not yet finished.
+    std::atomic<size_t> _tasksLeft;
+
+    // Used for round-robin distribution of tasks queued from outside of the
+    // pool.
+    std::atomic<size_t> _next;
 
-    size_t _tasksLeft;
     std::atomic_bool _stop;
-    std::condition_variable _taskAvailableCond;
+
+    // Idle workers sleep here until more work shows up.
+    std::atomic<size_t> _sleeping;
+    std::mutex _sleepMutex;
+    std::condition_variable _sleepCond;
+
+    // Threads blocked in waitAll() sleep here.
+    std::atomic<size_t> _waiting;
+    std::mutex _waitMutex;
     std::condition_variable _waitCond;
-    std::mutex _tasksLeftMutex;
-    std::mutex _queueMutex;
+};
+
+/**
+ * A group of tasks that can be waited on independently of any other tasks in
+ * the thread pool. Tasks queued through the group may queue more tasks in the
+ * same group.
+ *
+ * While waiting, the calling thread runs queued tasks itself rather than
+ * sleeping.
+ */
+class TaskGroup {
+public:
+    explicit TaskGroup(ThreadPool& pool) : _pool(pool), _pending(0) {}
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    /**
+     * Waits for any remaining tasks.
+     */
+    ~TaskGroup() {
+        wait();
+    }
+
+    ThreadPool& pool() const {
+        return _pool;
+    }
+
+    /**
+     * Adds a new task to the group.
+     */
+    template<class F>
+    void run(F&& f) {
+        ++_pending;
+        _pool.enqueueTask(Runner<typename std::decay<F>::type>{
+                this, std::forward<F>(f)});
+    }
+
+    /**
+     * Blocks until all tasks in this group have completed. Tasks in the pool
+     * (from any group) are run on the calling thread in the meantime.
+     */
+    void wait();
+
+private:
+    template<class Fn>
+    struct Runner {
+        TaskGroup* group;
+        Fn f;
+
+        void operator()() {
+            f();
+            group->done();
+        }
+    };
+
+    /**
+     * Marks a task as completed.
+     */
+    void done();
+
+    ThreadPool& _pool;
+
+    // Number of tasks that have not yet finished.
+    std::atomic<size_t> _pending;
+
+    // Protects the transition of the pending count to 0.
+    std::mutex _mutex;
+    std::condition_variable _cond;
 };
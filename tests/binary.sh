@@ -0,0 +1,23 @@
+#!/bin/bash -e
+# Copyright (c) 2016 Jason White
+# MIT License
+#
+# Description:
+# Tests that the binary format holds exactly the same rules as the JSON format.
+
+tempdir=$(mktemp -d)
+
+teardown() {
+    rm -rf -- "$tempdir"
+}
+
+# Cleanup on exit
+trap teardown 0
+
+button-lua binary/BUILD.lua -f json -o "$tempdir/rules.json"
+button-lua binary/BUILD.lua -f binary -o "$tempdir/rules.bin"
+
+button-lua binary/decode.lua -o /dev/null "$tempdir/rules.bin" \
+    > "$tempdir/decoded.json"
+
+cmp "$tempdir/rules.json" "$tempdir/decoded.json"
@@ -0,0 +1,60 @@
+--[[
+Copyright 2016 Jason White. MIT license.
+
+Description:
+Rules that cover every part of the binary format.
+]]
+
+-- Several commands, with the working directory and display string given.
+-- Strings that need escaping in JSON are stored as they are.
+rule {
+    inputs  = {"gen.py", "data/\"quoted\".txt"},
+    task    = {
+        {"python", "gen.py", "-o", "gen.h"},
+        {"sed", "-i", "s/\t/    /g", "gen.h"},
+        {"echo", "back\\slash\r\n"},
+    },
+    outputs = {"gen.h"},
+    cwd     = "build",
+    display = "gen \"gen.h\"\b",
+}
+
+-- Nothing but the required fields. The inputs are empty.
+rule {
+    inputs  = {},
+    task    = {{"touch", "stamp"}},
+    outputs = {"stamp"},
+}
+
+-- Most of the strings are already in the table.
+rule {
+    inputs  = {"gen.h", "stamp", "foo.c"},
+    task    = {{"gcc", "-c", "foo.c", "-o", "foo.o"}},
+    outputs = {"foo.o"},
+    display = "cc foo.c",
+}
+
+-- No command at all and no outputs, only a working directory.
+rule {
+    inputs  = {"foo.o"},
+    task    = {},
+    outputs = {},
+    cwd     = "build",
+}
+
+local t = rule_template {
+    inputs  = {"gen.h"},
+    command = {"gcc"},
+    args    = {"-c", "$in", "-o", "$out"},
+    display = "cc ",
+    cwd     = "build",
+}
+
+t:add("bar.c", "bar.o", {"stamp"})
+t:add("baz.c", "baz.o")
+
+rule {
+    inputs  = {"foo.o", "bar.o", "baz.o"},
+    task    = {{"gcc", "foo.o", "bar.o", "baz.o", "-o", "foobar"}},
+    outputs = {"foobar"},
+}
@@ -0,0 +1,163 @@
+--[[
+Copyright 2016 Jason White. MIT license.
+
+Description:
+Decodes a file of rules in the binary format and writes them to stdout in the
+JSON format, exactly as button-lua would have written them. Along the way, the
+layout of the file is checked.
+
+Usage: button-lua decode.lua -o /dev/null rules.bin
+]]
+
+local path = ...
+
+local f = assert(io.open(path, "rb"))
+local data = f:read("*a")
+f:close()
+
+local pos = 1
+
+--[[
+    Reads a 32-bit little-endian integer.
+]]
+local function u32()
+    local a, b, c, d = data:byte(pos, pos + 3)
+    assert(d, "unexpected end of file")
+    pos = pos + 4
+    return a + b * 0x100 + c * 0x10000 + d * 0x1000000
+end
+
+assert(data:sub(1, 4) == "BTNR", "bad magic bytes")
+pos = 5
+
+assert(u32() == 1, "bad version")
+
+--[[
+    String table
+]]
+local strings, stored = {}, {}
+local stringCount = u32()
+
+for id = 0, stringCount - 1 do
+    local len = u32()
+    local s = data:sub(pos, pos + len - 1)
+    assert(#s == len, "unexpected end of file")
+    pos = pos + len
+
+    assert(not stored[s], "string stored more than once: " .. s)
+    stored[s] = true
+    strings[id] = s
+end
+
+-- Strings are added to the table as the rules use them, so they must first
+-- show up in the same order as they are stored.
+local nextId = 0
+
+local function str(id)
+    assert(id < stringCount, "bad string ID " .. id)
+
+    if id == nextId then
+        nextId = nextId + 1
+    end
+
+    assert(id < nextId, "string " .. id .. " used before the ones ahead of it")
+    return strings[id]
+end
+
+local function list()
+    local t = {}
+    for i = 1, u32() do
+        t[i] = str(u32())
+    end
+    return t
+end
+
+local function optional()
+    local id = u32()
+    if id ~= 0xFFFFFFFF then
+        return str(id)
+    end
+end
+
+--[[
+    Rules
+]]
+local rules = {}
+
+for i = 1, u32() do
+    local length = u32()
+    local start = pos
+
+    local r = {}
+
+    r.inputs = list()
+
+    r.task = {}
+    for j = 1, u32() do
+        r.task[j] = list()
+    end
+
+    r.outputs = list()
+    r.cwd = optional()
+    r.display = optional()
+
+    assert(pos - start == length, "bad length for rule " .. i)
+
+    rules[i] = r
+end
+
+assert(pos == #data + 1, "trailing bytes at the end of the file")
+assert(nextId == stringCount, "strings stored that no rule uses")
+
+--[[
+    JSON output
+]]
+local escapes = {
+    ['"']  = '\\"',
+    ['\t'] = '\\t',
+    ['\r'] = '\\r',
+    ['\n'] = '\\n',
+    ['\b'] = '\\b',
+    ['\\'] = '\\\\',
+}
+
+local function quote(s)
+    return '"' .. s:gsub('["\t\r\n\b\\]', escapes) .. '"'
+end
+
+local function array(t, f)
+    local items = {}
+    for i,v in ipairs(t) do
+        items[i] = f(v)
+    end
+    return "[" .. table.concat(items, ", ") .. "]"
+end
+
+local function stringList(t)
+    return array(t, quote)
+end
+
+io.write("[")
+
+for i,r in ipairs(rules) do
+    if i > 1 then
+        io.write(",")
+    end
+
+    io.write("\n    {\n        ")
+    io.write('"inputs": ', stringList(r.inputs))
+    io.write(',\n        "task": ', array(r.task, stringList))
+    io.write(',\n        "outputs": ', stringList(r.outputs))
+
+    if r.cwd then
+        io.write(',\n        "cwd": ', quote(r.cwd))
+    end
+
+    if r.display then
+        io.write(',\n        "display": ', quote(r.display))
+    end
+
+    io.write("\n    }")
+end
+
+io.write("\n]\n")
@@ -0,0 +1,42 @@
+#!/bin/bash -e
+# Copyright (c) 2016 Jason White
+# MIT License
+#
+# Description:
+# Tests that importing scripts and generating rules in parallel gives exactly
+# the same output as doing it one after another, including what the main
+# script changed in modules before importing them.
+
+tempdir=$(mktemp -d)
+
+teardown() {
+    rm -rf -- "$tempdir"
+}
+
+# Cleanup on exit
+trap teardown 0
+
+cp -r -- import/. "$tempdir"
+
+cd $tempdir
+
+touch -- "lib/foo.c" \
+         "lib/bar.c" \
+         "app/main.c" \
+         "app/util.c"
+
+for format in json binary; do
+    button-lua BUILD.lua -f $format -o serial
+    button-lua BUILD.lua -f $format --parallel -o parallel
+    cmp serial parallel
+    button-lua BUILD.lua -f $format --parallel-rules -o parallel
+    cmp serial parallel
+    button-lua BUILD.lua -f $format --parallel --parallel-rules -o parallel
+    cmp serial parallel
+done
+
+# Make sure the changes to modules actually made a difference.
+button-lua BUILD.lua --parallel --parallel-rules -o parallel
+for s in '"clang"' '"-O2"' '"-DNDEBUG"' '"-DFOO_STATIC"' '"build/app"'; do
+    grep -qF -- "$s" parallel
+done
@@ -0,0 +1,28 @@
+--[[
+Copyright (c) Jason White. MIT license.
+
+Description:
+Imports a couple of scripts. Globals set up here, and changes made to modules
+before the scripts are imported, must be seen by them.
+]]
+
+WARNINGS = {"all", "extra"}
+
+local cc = require "rules.cc"
+cc.toolchain.gcc = "clang"
+cc.common.bindir = "build"
+cc.common.defines = {"NDEBUG"}
+table.insert(cc.common.opts, "-O2")
+
+-- The lib script uses a module that can only be found this way.
+package.path = package.path .. ";modules/?.lua"
+
+import "lib/BUILD.lua"
+
+rule {
+    inputs = {"gen.txt"},
+    task = {{"cp", "gen.txt", "gen.c"}},
+    outputs = {"gen.c"},
+}
+
+import "app/BUILD.lua"
@@ -0,0 +1,8 @@
+local cc = require "rules.cc"
+
+cc.binary {
+    name = "app",
+    deps = {"foo"},
+    srcs = glob "*.c",
+    warnings = WARNINGS,
+}
@@ -0,0 +1,16 @@
+local cc = require "rules.cc"
+local config = require "config"
+
+cc.library {
+    name = "foo",
+    static = true,
+    srcs = glob "*.c",
+    warnings = WARNINGS,
+    defines = config.defines,
+}
+
+rule {
+    inputs = {"foo.txt"},
+    task = {{"cp", "foo.txt", "foo.h"}},
+    outputs = {"foo.h"},
+}
@@ -0,0 +1,11 @@
+--[[
+Copyright (c) Jason White. MIT license.
+
+Description:
+A module that is only found once the main script adds this directory to
+package.path.
+]]
+
+return {
+    defines = {"FOO_STATIC"},
+}
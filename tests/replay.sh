@@ -0,0 +1,76 @@
+#!/bin/bash -e
+# Copyright (c) 2016 Jason White
+# MIT License
+#
+# Description:
+# Tests that a run saved in a replay cache is only replayed if nothing it
+# depended on has changed.
+
+tempdir=$(mktemp -d)
+
+teardown() {
+    rm -rf -- "$tempdir"
+}
+
+# Cleanup on exit
+trap teardown 0
+
+cp -r -- import/. "$tempdir"
+
+cd $tempdir
+
+touch -- "lib/foo.c" \
+         "lib/bar.c" \
+         "app/main.c" \
+         "app/util.c"
+
+# Runs with the replay cache and checks the output against a direct run. The
+# command line must be the same every time for the run to be replayed. The
+# dependencies are sent to $1.inputs and $1.outputs as they would be to the
+# parent build system, and the profile summary goes to $1.profile.
+run() {
+    BUTTON_INPUTS=3 BUTTON_OUTPUTS=4 \
+        button-lua BUILD.lua -o replayed --replay-cache replay.cache \
+        --profile trace.json 3> "$1.inputs" 4> "$1.outputs" 2> "$1.profile"
+
+    button-lua BUILD.lua -o expected
+    cmp expected replayed
+}
+
+# The scripts are run and the run is saved.
+record() {
+    run recorded
+    grep -q '^  lua ' recorded.profile
+    [ -s recorded.inputs ]
+}
+
+# The saved run is replayed without running any Lua, and reports exactly the
+# same dependencies.
+replay() {
+    run replayed
+
+    if grep -q '^  lua ' replayed.profile; then
+        echo "Error: Scripts were run instead of replayed"
+        exit 1
+    fi
+
+    cmp recorded.inputs replayed.inputs
+    cmp recorded.outputs replayed.outputs
+}
+
+# Recorded, then replayed. A run that globs a directory can be replayed again
+# and again.
+record
+grep -qF lib recorded.inputs
+replay
+replay
+
+# A new file shows up in a glob.
+touch -- "lib/baz.c"
+record
+replay
+
+# An imported script changes.
+echo 'rule { inputs = {}, task = {{"true"}}, outputs = {"x"} }' >> app/BUILD.lua
+record
+replay
@@ -0,0 +1,67 @@
+#!/bin/bash -e
+# Copyright (c) 2016 Jason White
+# MIT License
+#
+# Description:
+# Tests that runs done by a server give the same output as running directly,
+# even as files come and go between runs.
+
+tempdir=$(mktemp -d)
+
+teardown() {
+    [ -n "$server" ] && kill "$server" 2>/dev/null
+    rm -rf -- "$tempdir"
+}
+
+# Cleanup on exit
+trap teardown 0
+
+cp -r -- import/. "$tempdir"
+
+cd $tempdir
+
+touch -- "lib/foo.c" \
+         "lib/bar.c" \
+         "app/main.c" \
+         "app/util.c"
+
+button-lua --serve server.sock &
+server=$!
+
+# Wait for it to start listening.
+for i in $(seq 50); do
+    [ -S server.sock ] && break
+    sleep 0.1
+done
+
+check() {
+    button-lua BUILD.lua -o expected
+    button-lua BUILD.lua -o served --connect server.sock
+    cmp expected served
+}
+
+# Listed, then listed again from the server's cache.
+check
+check
+
+# A new file shows up in a glob.
+touch -- "lib/baz.c"
+check
+
+# A file goes away.
+rm -- "lib/foo.c"
+check
+
+# A directory is renamed and another one takes its place. Nothing that was
+# listed below it can be used any more.
+mv -- lib lib.old
+mkdir -- lib
+cp -- lib.old/BUILD.lua lib/
+touch -- "lib/qux.c"
+check
+
+# Without a server, the run is done directly.
+kill "$server"
+wait "$server" || true
+server=
+check
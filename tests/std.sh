@@ -9,3 +9,4 @@ runtest std/globals.sh
 runtest std/posixpath.sh
 runtest std/winpath.sh
 runtest std/glob.sh
+runtest std/table.sh
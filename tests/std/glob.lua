@@ -131,6 +131,59 @@ assert(equal(
     }
 ))
 
+-- Excluded subtrees are not visited, but what a later expression adds back is
+-- still there.
+assert(equal(
+    glob {"**", "!c/**"},
+    {
+        "a/foo.c",
+        "a/foo.h",
+        "b/bar.c",
+        "b/bar.h",
+    }
+))
+
+assert(equal(
+    glob {"**", "!c/**", "c/*/*.cc", "!c/3/**"},
+    {
+        "a/foo.c",
+        "a/foo.h",
+        "b/bar.c",
+        "b/bar.h",
+        "c/1/foo.cc",
+        "c/2/bar.cc",
+    }
+))
+
+assert(equal(
+    glob {"**", "!**/"},
+    {
+        "a/foo.c",
+        "a/foo.h",
+        "b/bar.c",
+        "b/bar.h",
+        "c/baz.h",
+        "c/1/foo.cc",
+        "c/2/bar.cc",
+        "c/3/baz.cc",
+    }
+))
+
+assert(equal(
+    glob {"**/", "!c/**/"},
+    {
+        "a",
+        "b",
+        "c",
+    }
+))
+
+assert(equal(
+    glob {"**", "!**"},
+    {
+    }
+))
+
 SCRIPT_DIR = "a"
 
 assert(equal(
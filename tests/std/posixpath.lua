@@ -192,6 +192,37 @@ assert(path.norm("/../../.././bar/") == "/bar")
 assert(path.norm("../foo/../bar/") == "../bar")
 assert(path.norm("../foo/../bar///") == "../bar")
 assert(path.norm("../path/./to//a/../b/c/../../test.txt/") == "../path/to/test.txt")
+assert(path.norm("../../foo/bar") == "../../foo/bar")
+assert(path.norm("/") == "/")
+assert(path.norm("foo/.") == "foo")
+assert(path.norm("..") == "..")
+
+--[[
+    path.joinnorm
+]]
+local joined = path.joinnorm("foo", {"bar", "./baz/", "../qux", "/abs//x", ""})
+assert(#joined == 5)
+assert(joined[1] == "foo/bar")
+assert(joined[2] == "foo/baz")
+assert(joined[3] == "qux")
+assert(joined[4] == "/abs/x")
+assert(joined[5] == "foo")
+assert(#path.joinnorm("foo", {}) == 0)
+assert(path.joinnorm("", {"a//b"})[1] == "a/b")
+assert(path.joinnorm("obj/.", {"src/foo.c"}, ".o")[1] == "obj/src/foo.c.o")
+assert(not pcall(path.joinnorm, "foo", {"bar", {}}))
+
+--[[
+    path.setexts
+]]
+local changed = path.setexts({"foo.c", "bar", ".baz", "a/b.d"}, ".o")
+assert(#changed == 4)
+assert(changed[1] == "foo.o")
+assert(changed[2] == "bar.o")
+assert(changed[3] == ".baz.o")
+assert(changed[4] == "a/b.o")
+assert(#path.setexts({}, ".o") == 0)
+assert(not pcall(path.setexts, {"foo.c", true}, ".o"))
 
 --[[
     path.matches
@@ -206,6 +237,8 @@ assert(path.matches("foo.bar.baz", "f*.b*.b*"))
 assert(path.matches("foo", "[bf]oo"))
 assert(path.matches("zoo", "[!bf]oo"))
 assert(path.matches("foo.c", "[fb]*.c"))
+assert(path.matches("foo", "foo**"))
+assert(path.matches("foo_test_bar.cc", "*_test_*.cc"))
 
 assert(not path.matches("", "a"))
 assert(not path.matches("a", ""))
@@ -217,3 +250,4 @@ assert(not path.matches("foo.c", "*.C"))
 assert(not path.matches("foo.bar.baz", "f*.f*.f*"))
 assert(not path.matches("zoo", "[bf]oo"))
 assert(not path.matches("zoo", "[!bzf]oo"))
+assert(not path.matches("foo", "[fo"))
@@ -0,0 +1,82 @@
+--[[
+Copyright 2016 Jason White. MIT license.
+
+Description:
+Tests additions to the table library.
+]]
+
+local function equal(t1, t2)
+    if #t1 ~= #t2 then
+        return false
+    end
+
+    for i,v in ipairs(t1) do
+        if v ~= t2[i] then
+            return false
+        end
+    end
+
+    return true
+end
+
+--[[
+    table.append
+]]
+local t = {"a"}
+assert(table.append(t, "b", {"c", "d"}, {}) == t)
+assert(equal(t, {"a", "b", "c", "d"}))
+
+-- Values after a nil are ignored.
+assert(equal(table.append({}, "a", nil, "b"), {"a"}))
+
+-- A list appended to itself is doubled.
+local t = {"a", "b"}
+table.append(t, t)
+assert(equal(t, {"a", "b", "a", "b"}))
+
+--[[
+    table.join
+]]
+assert(equal(table.join(), {}))
+assert(equal(table.join("a"), {"a"}))
+assert(equal(table.join({"a", "b"}, "c", {}, {"d"}), {"a", "b", "c", "d"}))
+assert(equal(table.join({1, 2}, false), {1, 2, false}))
+
+-- Nested tables are not flattened any further.
+local inner = {"b"}
+local joined = table.join({"a", inner})
+assert(#joined == 2 and joined[2] == inner)
+
+-- The arguments are left alone.
+local a = {"a"}
+assert(table.join(a, "b") ~= a)
+assert(equal(a, {"a"}))
+
+--[[
+    table.contains
+]]
+assert(table.contains({"a", "b"}, "b"))
+assert(not table.contains({"a", "b"}, "c"))
+assert(not table.contains({}, "a"))
+assert(not table.contains({"a"}, nil))
+assert(table.contains({1, 2, 3}, 2.0))
+
+--[[
+    table.filter
+]]
+local function is_even(x)
+    return x % 2 == 0
+end
+
+assert(equal(table.filter({1, 2, 3, 4}, is_even), {2, 4}))
+assert(equal(table.filter({}, is_even), {}))
+assert(not pcall(table.filter, {1}, nil))
+
+--[[
+    table.set
+]]
+local s = table.set {".c", ".h"}
+assert(s[".c"] == true)
+assert(s[".h"] == true)
+assert(s[".cc"] == nil)
+assert(next(table.set {}) == nil)
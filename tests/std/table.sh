@@ -0,0 +1,4 @@
+#!/bin/bash -e
+# Copyright (c) 2016 Jason White
+# MIT License
+button-lua table.lua -o /dev/null
@@ -236,6 +236,28 @@ assert(path.norm("C:/foo/../../../bar") == "C:\\bar")
 assert(path.norm("\\\\server\\share\\..\\..\\foo") == "\\\\server\\share\\foo")
 assert(path.norm("\\\\?\\UNC\\server\\share\\..\\..\\foo") == "\\\\?\\UNC\\server\\share\\foo")
 assert(path.norm("\\\\.\\COM1\\bar\\baz\\..\\..\\..\\foo") == "\\\\.\\COM1\\foo")
+assert(path.norm("C:\\foo\\bar") == "C:\\foo\\bar")
+assert(path.norm("C:/") == "C:\\")
+assert(path.norm("\\\\server\\share\\") == "\\\\server\\share")
+assert(path.norm("foo\\bar/baz") == "foo\\bar\\baz")
+
+--[[
+    path.joinnorm
+]]
+local joined = path.joinnorm("foo", {"bar", "./baz/", "..\\qux", "C:/abs//x"})
+assert(#joined == 4)
+assert(joined[1] == "foo\\bar")
+assert(joined[2] == "foo\\baz")
+assert(joined[3] == "qux")
+assert(joined[4] == "C:\\abs\\x")
+assert(path.joinnorm("obj", {"src/foo.c"}, ".o")[1] == "obj\\src\\foo.c.o")
+
+--[[
+    path.setexts
+]]
+local changed = path.setexts({"foo.c", "a\\b.d"}, ".obj")
+assert(changed[1] == "foo.obj")
+assert(changed[2] == "a\\b.obj")
 
 --[[
     path.matches
@@ -252,6 +274,13 @@ assert(path.matches("foo.bar.baz", "f*.b*.b*"))
 assert(path.matches("foo", "[bf]oo"))
 assert(path.matches("zoo", "[!bf]oo"))
 assert(path.matches("foo.c", "[fb]*.c"))
+assert(path.matches("foo", "foo**"))
+assert(path.matches("foo_test_bar.cc", "*_test_*.cc"))
+assert(path.matches("Some_Really_Long_File_Name.CPP",
+                    "some_really_long_file_name.cpp"))
+assert(path.matches("src_Some_Really_Long_File_Name.cpp",
+                    "*_SOME_REALLY_LONG_FILE_NAME.*"))
+assert(path.matches("\xC3\xA9t\xC3\xA9.c", "\xC3\xA9T\xC3\xA9.C"))
 
 assert(not path.matches("", "a"))
 assert(not path.matches("a", ""))
@@ -261,3 +290,7 @@ assert(not path.matches("foo.d", "*.c"))
 assert(not path.matches("foo.bar.baz", "f*.f*.f*"))
 assert(not path.matches("zoo", "[bf]oo"))
 assert(not path.matches("zoo", "[!bzf]oo"))
+assert(not path.matches("foo", "[fo"))
+assert(not path.matches("Some_Really_Long_File_Name.cpp",
+                        "some_really_long_file_nbme.cpp"))
+assert(not path.matches("\xC3\xA9t\xC3\xA9.c", "\xC3\x89t\xC3\x89.c"))
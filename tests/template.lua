@@ -0,0 +1,86 @@
+--[[
+Copyright 2016 Jason White. MIT license.
+
+Description:
+Adds the same rules either with rule_template or with rule{}, depending on the
+argument given to the script. Both must give exactly the same output.
+]]
+
+local mode = ...
+
+--[[
+    Does what rule_template does, but with rule{}.
+]]
+local function rules_template(t)
+    local function expand(arg, input, output)
+        return (arg:gsub("%$in", function() return input end)
+                   :gsub("%$out", function() return output end))
+    end
+
+    return {
+        add = function(self, input, output, deps)
+            local args = {}
+            for _,arg in ipairs(t.args or {}) do
+                table.insert(args, expand(arg, input, output))
+            end
+
+            rule {
+                inputs  = table.join(t.inputs or {}, input, deps or {}),
+                task    = {table.join(t.command or {}, args)},
+                outputs = {output},
+                cwd     = t.cwd,
+                display = t.display and (t.display .. input),
+            }
+        end
+    }
+end
+
+local template = rule_template
+if mode == "rule" then
+    template = rules_template
+end
+
+rule {
+    inputs  = {"gen.py"},
+    task    = {{"python", "gen.py"}, {"touch", "gen.h"}},
+    outputs = {"gen.h"},
+}
+
+-- Never used, so none of its strings may show up.
+template {
+    inputs  = {"unused.h"},
+    command = {"unused"},
+    args    = {"--unused", "$in"},
+    cwd     = "unused",
+    display = "unused ",
+}
+
+local cc = template {
+    inputs  = {"foo.h", "gen.h"},
+    command = {"gcc", "-Wall"},
+    args    = {"-c", "$in", "-o", "$out", "-MF", "$out.d"},
+    display = "cc ",
+    cwd     = "build",
+}
+
+-- The extra dependency comes before the command line, so it is the first to
+-- use "-Wall".
+cc:add("foo.c", "foo.o", {"-Wall", "bar.h"})
+cc:add("bar.c", "bar.o")
+
+rule {
+    inputs  = {"foo.o", "bar.o"},
+    task    = {{"gcc", "foo.o", "bar.o", "-o", "foobar"}},
+    outputs = {"foobar"},
+    display = "ld foobar",
+}
+
+cc:add("baz.c", "baz.o", {})
+
+-- Nothing shared but the arguments.
+local cp = template {
+    args = {"cp", "$in", "$out"},
+}
+
+cp:add("foobar", "install/foobar")
+cp:add("gen.h", "install/gen.h", {"foobar"})
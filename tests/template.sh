@@ -0,0 +1,22 @@
+#!/bin/bash -e
+# Copyright (c) 2016 Jason White
+# MIT License
+#
+# Description:
+# Tests that rules added with rule_template are exactly the same as the rules
+# added with rule{}, including the string table of the binary format.
+
+tempdir=$(mktemp -d)
+
+teardown() {
+    rm -rf -- "$tempdir"
+}
+
+# Cleanup on exit
+trap teardown 0
+
+for format in json binary; do
+    button-lua template.lua -f $format -o "$tempdir/rule" rule
+    button-lua template.lua -f $format -o "$tempdir/template" template
+    cmp "$tempdir/rule" "$tempdir/template"
+done
@@ -18,8 +18,13 @@
 # OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 # SOFTWARE.
 
+# With -bytecode, the scripts are precompiled with luac and the stripped
+# bytecode is embedded instead. The path to luac defaults to the one next to
+# the Lua executable.
 param (
-    [Parameter(Mandatory=$true)][string]$lua
+    [Parameter(Mandatory=$true)][string]$lua,
+    [string]$luac,
+    [switch]$bytecode
 )
 
 # Stop immediately if something fails.
@@ -29,6 +34,14 @@ $ErrorActionPreference='Stop'
 # directories.
 $lua=(Resolve-Path $lua)
 
+if ($bytecode) {
+    if (!$luac) {
+        $luac = Join-Path (Split-Path $lua) 'luac.exe'
+    }
+
+    $luac=(Resolve-Path $luac)
+}
+
 # CD to the root of this project; "tools\embed.lua" needs this to be its
 # working directory.
 Set-Location (Join-Path $PSScriptRoot '..')
@@ -39,5 +52,20 @@ foreach ($name in (Get-ChildItem scripts -Include "*.lua" -Recurse -Name)) {
     $dirname = [io.path]::GetDirectoryName($outfile)
     mkdir -Force -Path $dirname > $null
     Write-Host "Generating '$outfile'..."
-    & $lua tools\embed.lua (Join-Path scripts $name) | Out-File $outfile
+
+    $script = (Join-Path scripts $name)
+
+    if ($bytecode) {
+        $chunk = "$outfile.luac"
+        & $luac -s -o $chunk $script
+        if ($LASTEXITCODE -ne 0) {
+            throw "Failed to compile '$script'."
+        }
+
+        & $lua tools\embed.lua $script $chunk | Out-File $outfile
+        Remove-Item $chunk
+    }
+    else {
+        & $lua tools\embed.lua $script | Out-File $outfile
+    }
 }
@@ -21,7 +21,10 @@ THE SOFTWARE.
 ]]
 
 local description = [[
-Usage: lua embed.lua filename
+Usage: lua embed.lua filename [bytecode]
+
+If a file of precompiled bytecode is given, it is embedded instead of the
+script itself. The variable name is still derived from the script.
 ]]
 
 if not arg or not arg[1] then
@@ -32,7 +35,7 @@ end
 local filename = arg[1]
 local varname = filename:gsub("[/\\%.]", "_")
 
-local content = assert(io.open(filename, "rb")):read("*a")
+local content = assert(io.open(arg[2] or filename, "rb")):read("*a")
 
 local numtab = {};
 
@@ -46,11 +49,11 @@ end
 
 io.write(([[
 /**
- * This file is automatically generated from the script:
+ * This file is automatically generated from the script%s:
  *
  *      %s
  */
 unsigned char %s[] = {
 %s
 };
-]]):format(filename, varname, dump(content)))
+]]):format(arg[2] and " (as bytecode)" or "", filename, varname, dump(content)))